@@ -8,18 +8,440 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <variant>
 #include <vector>
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define VORBIS_X86 1
+#else
+#define VORBIS_X86 0
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif VORBIS_X86
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/resource.h>
+#endif
+
+// =============================================================================
+// TRACING
+// =============================================================================
+
+// Numeric so that VORBIS_TRACE_LEVEL can be compared in #if.
+#define VORBIS_TRACE_WARNING 1
+#define VORBIS_TRACE_INFO 2
+#define VORBIS_TRACE_VERBOSE 3
+
+enum ETraceLevel
+{
+    kTraceWarning = VORBIS_TRACE_WARNING,
+    kTraceInfo = VORBIS_TRACE_INFO,
+    kTraceVerbose = VORBIS_TRACE_VERBOSE
+};
+
+enum FTraceCategory
+{
+    kTraceOgg = 0x01,
+    kTraceHeaders = 0x02,
+    kTraceCodebooks = 0x04,
+    kTracePackets = 0x08,
+    kTraceAll = 0xff
+};
+
+// Traces above VORBIS_TRACE_LEVEL or outside of VORBIS_TRACE_CATEGORIES are
+// discarded at compile time, release builds compile every trace out.
+#ifndef VORBIS_TRACE_LEVEL
+#ifdef NDEBUG
+#define VORBIS_TRACE_LEVEL 0
+#else
+#define VORBIS_TRACE_LEVEL VORBIS_TRACE_INFO
+#endif
+#endif
+
+#ifndef VORBIS_TRACE_CATEGORIES
+#define VORBIS_TRACE_CATEGORIES kTraceAll
+#endif
+
+#if VORBIS_TRACE_LEVEL > 0
+
+// Fixed size ring of formatted records. Writers take an index with a single
+// atomic increment and publish the record through its sequence number, so
+// tracing never blocks and the oldest records are overwritten. A writer that
+// laps another one still busy on the same record drops its own.
+struct TraceRing
+{
+    static constexpr std::size_t kRecordCount = 4096u;
+    static constexpr std::size_t kMessageSize = 116u;
+    static constexpr std::uint64_t kBusy = ~0ull;
+
+    struct Record
+    {
+        std::atomic<std::uint64_t> sequence{ 0u }; // index + 1 once written
+        std::uint8_t level = 0u;
+        std::uint8_t category = 0u;
+        char message[kMessageSize];
+    };
+
+    std::atomic<std::uint64_t> head{ 0u };
+    Record records[kRecordCount];
+};
+
+inline TraceRing& Trace_GetRing()
+{
+    static TraceRing s_ring;
+    return s_ring;
+}
+
+template <typename... Args>
+void Trace_Write(int _level, int _category, char const* _format, Args... _args)
+{
+    TraceRing &ring = Trace_GetRing();
+    std::uint64_t const index = ring.head.fetch_add(1u, std::memory_order_relaxed);
+    TraceRing::Record &record = ring.records[index % TraceRing::kRecordCount];
+
+    std::uint64_t sequence = record.sequence.load(std::memory_order_relaxed);
+    if (sequence == TraceRing::kBusy ||
+        !record.sequence.compare_exchange_strong(sequence, TraceRing::kBusy, std::memory_order_acquire))
+        return;
+    record.level = (std::uint8_t)_level;
+    record.category = (std::uint8_t)_category;
+    if constexpr (sizeof...(Args) == 0u)
+        std::snprintf(record.message, TraceRing::kMessageSize, "%s", _format);
+    else
+        std::snprintf(record.message, TraceRing::kMessageSize, _format, _args...);
+    record.sequence.store(index + 1u, std::memory_order_release);
+}
+
+// Writes the records still held by the ring, oldest first. Records being
+// overwritten while dumping are skipped.
+void Trace_Dump(std::FILE* _file)
+{
+    TraceRing &ring = Trace_GetRing();
+    std::uint64_t const head = ring.head.load(std::memory_order_acquire);
+    std::uint64_t const first = (head > TraceRing::kRecordCount) ? head - TraceRing::kRecordCount : 0u;
+    for (std::uint64_t index = first; index < head; ++index)
+    {
+        TraceRing::Record const& record = ring.records[index % TraceRing::kRecordCount];
+        if (record.sequence.load(std::memory_order_acquire) != index + 1u)
+            continue;
+        char message[TraceRing::kMessageSize];
+        std::memcpy(message, record.message, sizeof(message));
+        std::uint8_t const level = record.level;
+        std::uint8_t const category = record.category;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (record.sequence.load(std::memory_order_relaxed) != index + 1u)
+            continue;
+        message[TraceRing::kMessageSize - 1u] = '\0';
+        std::fprintf(_file, "%llu [%u:%02x] %s\n", (unsigned long long)index,
+                     (unsigned)level, (unsigned)category, message);
+    }
+}
+
+#define VORBIS_TRACE(level, category, ...)                                \
+    do                                                                    \
+    {                                                                     \
+        if constexpr ((level) <= VORBIS_TRACE_LEVEL &&                    \
+                      ((category) & (VORBIS_TRACE_CATEGORIES)) != 0)      \
+            Trace_Write((level), (category), __VA_ARGS__);                \
+    } while (0)
+
+#else
+
+inline void Trace_Dump(std::FILE*) {}
+
+#define VORBIS_TRACE(level, category, ...) do {} while (0)
+
+#endif
+
+// =============================================================================
+// PROFILING
+// =============================================================================
+
+// Per stage timings and codeword statistics, only collected when built with
+// VORBIS_PROFILE=1.
+#ifndef VORBIS_PROFILE
+#define VORBIS_PROFILE 0
+#endif
+
+enum EVorbisStage
+{
+    kStageDemux = 0,
+    kStagePacketAssembly,
+    kStageFloorDecode,
+    kStageResidue,
+    kStageCoupling,
+    kStageFloorSynthesis,
+    kStageImdct, // includes windowing, folded into the unfold
+    kStageOverlap,
+    kStageOutput,
+    kStageCount
+};
+
+constexpr char const* kStageNames[kStageCount] = {
+    "demux", "packet_assembly", "floor_decode", "residue", "coupling",
+    "floor_synthesis", "imdct_window", "overlap", "output"
+};
+
+struct VorbisProfile
+{
+    std::uint64_t ticks[kStageCount] = {};
+    std::uint64_t calls[kStageCount] = {};
+    std::uint64_t packets = 0u;
+    std::uint64_t frames = 0u;
+    std::uint64_t codeword_lengths[33] = {}; // decoded codewords per length
+    std::uint64_t secondary_lookups = 0u; // codewords resolved past the primary table
+};
+
+inline std::uint64_t VorbisProfileTicks()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (std::uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Attributes the time elapsed since the previous lap to a stage.
+struct VorbisStageClock
+{
+#if VORBIS_PROFILE
+    explicit VorbisStageClock(VorbisProfile &_profile)
+        : profile(&_profile), last(VorbisProfileTicks())
+    {}
+
+    void Lap(EVorbisStage _stage)
+    {
+        std::uint64_t const now = VorbisProfileTicks();
+        profile->ticks[_stage] += now - last;
+        ++profile->calls[_stage];
+        last = now;
+    }
+
+    VorbisProfile* profile;
+    std::uint64_t last;
+#else
+    explicit VorbisStageClock(VorbisProfile&) {}
+    void Lap(EVorbisStage) {}
+#endif
+};
+
+#if VORBIS_PROFILE
+// Profile of the packet being decoded on this thread, for codeword statistics.
+thread_local VorbisProfile* t_codeword_profile = nullptr;
+
+struct VorbisCodewordProfileScope
+{
+    explicit VorbisCodewordProfileScope(VorbisProfile &_profile) { t_codeword_profile = &_profile; }
+    ~VorbisCodewordProfileScope() { t_codeword_profile = nullptr; }
+};
+#endif
+
+double VorbisProfileTicksPerSecond()
+{
+    using Clock_t = std::chrono::steady_clock;
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    static double const s_ticks_per_second = []()
+    {
+        Clock_t::time_point const begin = Clock_t::now();
+        std::uint64_t const begin_ticks = VorbisProfileTicks();
+        while (Clock_t::now() - begin < std::chrono::milliseconds(20));
+        std::uint64_t const end_ticks = VorbisProfileTicks();
+        double const seconds = std::chrono::duration<double>(Clock_t::now() - begin).count();
+        return (double)(end_ticks - begin_ticks) / seconds;
+    }();
+    return s_ticks_per_second;
+#else
+    return (double)Clock_t::period::den / (double)Clock_t::period::num;
+#endif
+}
+
+void VorbisProfileAccumulate(VorbisProfile const& _profile, VorbisProfile &o_total)
+{
+    for (int stage = 0; stage < kStageCount; ++stage)
+    {
+        o_total.ticks[stage] += _profile.ticks[stage];
+        o_total.calls[stage] += _profile.calls[stage];
+    }
+    o_total.packets += _profile.packets;
+    o_total.frames += _profile.frames;
+    for (int length = 0; length < 33; ++length)
+        o_total.codeword_lengths[length] += _profile.codeword_lengths[length];
+    o_total.secondary_lookups += _profile.secondary_lookups;
+}
+
+void VorbisProfileWriteJson(VorbisProfile const& _profile, std::ostream &_out)
+{
+    double const ns_per_tick = 1e9 / VorbisProfileTicksPerSecond();
+
+    _out << "{\"enabled\":" << (VORBIS_PROFILE ? "true" : "false")
+         << ",\"packets\":" << _profile.packets
+         << ",\"frames\":" << _profile.frames
+         << ",\"stages\":{";
+    for (int stage = 0; stage < kStageCount; ++stage)
+    {
+        _out << (stage ? "," : "") << "\"" << kStageNames[stage] << "\":{"
+             << "\"calls\":" << _profile.calls[stage]
+             << ",\"ticks\":" << _profile.ticks[stage]
+             << ",\"ns\":" << (std::uint64_t)((double)_profile.ticks[stage] * ns_per_tick) << "}";
+    }
+
+    std::uint64_t lookups = 0u;
+    for (std::uint64_t count : _profile.codeword_lengths)
+        lookups += count;
+    _out << "},\"huffman\":{\"lookups\":" << lookups
+         << ",\"secondary_lookups\":" << _profile.secondary_lookups
+         << ",\"codeword_lengths\":[";
+    for (int length = 0; length < 33; ++length)
+        _out << (length ? "," : "") << _profile.codeword_lengths[length];
+    _out << "]}}";
+}
+
+// =============================================================================
+// CPU DISPATCH
+// =============================================================================
+
+// Hot kernels come as a portable scalar reference plus SIMD variants compiled
+// for their own instruction set, and the widest variant the host supports is
+// picked at runtime. Every variant gives bit exact results.
+#if defined(__GNUC__) && !defined(__clang__)
+// AVX-512 implies FMA, contracting a * b + c would round differently
+#define VORBIS_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+#elif defined(__clang__)
+#define VORBIS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define VORBIS_TARGET(isa)
+#endif
+
+enum FCpuFeature
+{
+    kCpuSse2 = 0x01,
+    kCpuAvx2 = 0x02,
+    kCpuAvx512 = 0x04,
+    kCpuNeon = 0x08
+};
+
+struct VorbisDither;
+
+using VorbisQuantizeFunc = void (*)(float const* _samples,
+                                    float const* _overlap,
+                                    std::uint32_t _begin,
+                                    std::uint32_t _end,
+                                    VorbisDither* _dither,
+                                    std::uint8_t* o_output,
+                                    std::size_t _output_stride);
+
+struct VorbisKernels
+{
+    char const* name;
+    std::uint32_t features;
+
+    void (*inverse_coupling)(float* _magnitude, float* _angle, std::uint32_t _n);
+    // one radix-4 stage of the inverse FFT, over every group of 4h points
+    void (*fft_pass)(float* _re, float* _im, std::uint32_t _size, std::uint32_t _h,
+                     float const* _twiddles);
+    // windows the DCT-IV output while unfolding it to the N samples of a block
+    void (*imdct_unfold)(float const* _u, float const* _window, float* o_out, std::uint32_t _n);
+    // o_out[i] = _a[i] + _b[i], o_out may alias _a
+    void (*overlap_add)(float* o_out, float const* _a, float const* _b, std::uint32_t _n);
+    VorbisQuantizeFunc quantize_int16;
+    VorbisQuantizeFunc quantize_int24;
+};
+
+VorbisKernels const& VorbisSelectKernels(std::uint32_t _features);
+
+std::uint32_t VorbisCpuFeatures()
+{
+    std::uint32_t features = 0u;
+#if VORBIS_X86
+    unsigned regs[4] = {};
+    auto const cpuid = [&regs](unsigned _leaf, unsigned _subleaf)
+    {
+#if defined(_MSC_VER)
+        __cpuidex(reinterpret_cast<int*>(regs), (int)_leaf, (int)_subleaf);
+#else
+        __cpuid_count(_leaf, _subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    };
+
+    cpuid(0u, 0u);
+    unsigned const max_leaf = regs[0];
+    cpuid(1u, 0u);
+    if (regs[3] & (1u << 26u))
+        features |= kCpuSse2;
+
+    // the OS must also save the wider registers, as reported by XCR0
+    bool const avx = (regs[2] & (1u << 28u)) != 0u;
+    std::uint64_t xcr0 = 0u;
+    if (regs[2] & (1u << 27u))
+    {
+#if defined(_MSC_VER)
+        xcr0 = _xgetbv(0);
+#else
+        std::uint32_t low, high;
+        __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+        xcr0 = ((std::uint64_t)high << 32u) | low;
+#endif
+    }
+
+    if (max_leaf >= 7u)
+    {
+        cpuid(7u, 0u);
+        if (avx && (xcr0 & 0x06u) == 0x06u && (regs[1] & (1u << 5u)))
+            features |= kCpuAvx2;
+        if ((features & kCpuAvx2) && (xcr0 & 0xe6u) == 0xe6u && (regs[1] & (1u << 16u)))
+            features |= kCpuAvx512;
+    }
+#elif defined(__ARM_NEON)
+    features |= kCpuNeon;
+#endif
+    return features;
+}
+
+// Resolved once. VORBIS_CPU_MASK in the environment restricts the features
+// taken into account, VORBIS_CPU_MASK=0 selects the scalar references.
+VorbisKernels const& VorbisGetKernels()
+{
+    static VorbisKernels const& s_kernels = []() -> VorbisKernels const&
+    {
+        std::uint32_t features = VorbisCpuFeatures();
+        if (char const* mask = std::getenv("VORBIS_CPU_MASK"))
+            features &= (std::uint32_t)std::strtoul(mask, nullptr, 0);
+        return VorbisSelectKernels(features);
+    }();
+    return s_kernels;
+}
+
 // =============================================================================
 // HUFFMAN CODING
 // =============================================================================
@@ -28,6 +450,7 @@ struct BinaryNode
 {
     std::uint32_t v = -1u;
     std::uint8_t length = 0u;
+    std::uint32_t entry = 0u;
     std::size_t left = 0u, right = 0u;
 };
 
@@ -46,6 +469,35 @@ std::uint32_t Huffman_ReadEntry(HuffmanLUT const& _lut,
                                 int &_bit_offset,
                                 int &o_bits_read);
 
+// Multi-level lookup table indexed by the next bits of the stream (LSB first).
+// slot layout : [31] link flag
+//               [29:24] bits consumed by a leaf, or width of the linked table
+//               [23:0] entry index of a leaf, or offset of the linked table
+// A zero slot is an unknown codeword.
+struct HuffmanTable
+{
+    static constexpr int kPrimaryBits = 10;
+    static constexpr int kSecondaryBits = 6;
+    static constexpr std::uint32_t kLinkFlag = 0x80000000u;
+
+    std::vector<std::uint32_t> slots;
+    int primary_bits = 0;
+};
+
+bool Huffman_ComputeCodewords(std::vector<std::uint8_t> const& _lengths,
+                              std::vector<std::uint32_t> &o_codewords);
+HuffmanTable Huffman_BuildTable(std::vector<std::uint8_t> const& _lengths,
+                                int _primary_bits = HuffmanTable::kPrimaryBits);
+std::uint32_t Huffman_DecodeEntry(std::uint32_t const* _slots,
+                                  int _primary_bits,
+                                  std::uint8_t const* &_base_address,
+                                  int &_bit_offset,
+                                  int &o_bits_read);
+std::uint32_t Huffman_DecodeEntry(HuffmanTable const& _table,
+                                  std::uint8_t const* &_base_address,
+                                  int &_bit_offset,
+                                  int &o_bits_read);
+
 // =============================================================================
 // OGG FILE FORMAT
 // =============================================================================
@@ -86,18 +538,6 @@ struct PageDesc
     std::uint8_t const* stream_begin = nullptr;
 };
 
-int debug_PageCount = 0;
-std::uint8_t* debug_baseBuff;
-
-std::ptrdiff_t debug_ComputeOffset(PageDesc const& _page, std::size_t _seg_index)
-{
-    std::uint32_t byte_offset = 0u;
-    for (int i = 0; i < (int)_seg_index-1; ++i)
-        byte_offset += _page.segment_table[i];
-
-    return (_page.stream_begin + byte_offset) - debug_baseBuff;
-}
-
 using PageContainer = std::vector<PageDesc>;
 using OggContents = std::unordered_map<std::uint32_t, PageContainer>;
 
@@ -292,6 +732,14 @@ constexpr unsigned ilog(std::uint32_t _v)
     return res;
 }
 
+constexpr std::uint32_t bit_reverse(std::uint32_t _v, unsigned _length)
+{
+    std::uint32_t res = 0u;
+    for (unsigned i = 0u; i < _length; ++i, _v >>= 1u)
+        res = (res << 1u) | (_v & 1u);
+    return res;
+}
+
 constexpr std::uint32_t lookup1_values(std::uint32_t _entry_count, std::uint16_t _dimensions)
 {
     if (_dimensions == 0u)
@@ -309,7 +757,7 @@ constexpr std::uint32_t lookup1_values(std::uint32_t _entry_count, std::uint16_t
     return static_cast<std::uint32_t>(f_result) - 1u;
 }
 
-inline std::size_t low_neighbour(std::vector<std::uint32_t> const& _values, std::size_t _index)
+inline std::size_t low_neighbour(std::uint32_t const* _values, std::size_t _index)
 {
     std::size_t n = -1u;
     for (std::size_t i = 0u; i < _index; ++i)
@@ -319,7 +767,7 @@ inline std::size_t low_neighbour(std::vector<std::uint32_t> const& _values, std:
     return n;
 }
 
-inline std::size_t high_neighbour(std::vector<std::uint32_t> const& _values, std::size_t _index)
+inline std::size_t high_neighbour(std::uint32_t const* _values, std::size_t _index)
 {
     std::size_t n = -1u;
     for (std::size_t i = 0u; i < _index; ++i)
@@ -344,38 +792,40 @@ std::uint32_t render_point(std::uint32_t x0, std::uint32_t y0,
         return (std::uint32_t)std::max(0u, y0 + off);
 }
 
-float WindowEval(std::uint32_t _n,
-                 std::uint32_t _lws, std::uint32_t _lwe,
-                 std::uint32_t _rws, std::uint32_t _rwe)
+// Array inside a setup arena, addressed by its byte offset from the array
+// object itself. The whole arena can be moved as one block, but a record
+// holding arrays must never be copied out of it.
+template <typename T>
+struct VorbisSetupArray
 {
-    constexpr float piOver2 = 3.1415926536f * .5f;
-
-    if (_n >= _rwe)
-        return 0.f;
-
-    if (_n >= _rws)
-    {
-        float t0 = std::sin(((float)(_n - _rws) + .5f) / (float)(_rwe-_rws) * piOver2 + piOver2);
-        return std::sin(piOver2 * t0*t0);
-    }
-
-    if (_n >= _lwe)
-        return 1.f;
-
-    if (_n >= _lws)
-    {
-        float t0 = std::sin(((float)(_n - _lws) + .5f) / (float)(_lwe-_lws) * piOver2);
-        return std::sin(piOver2 * t0*t0);
-    }
+    std::int32_t offset = 0;
+    std::uint32_t count = 0u;
+
+    VorbisSetupArray() = default;
+    VorbisSetupArray(VorbisSetupArray const&) = delete;
+    VorbisSetupArray& operator=(VorbisSetupArray const&) = delete;
+
+    T* data() { return count ? reinterpret_cast<T*>(reinterpret_cast<std::uint8_t*>(this) + offset) : nullptr; }
+    T const* data() const { return count ? reinterpret_cast<T const*>(reinterpret_cast<std::uint8_t const*>(this) + offset) : nullptr; }
+    std::size_t size() const { return count; }
+    bool empty() const { return !count; }
+    T& operator[](std::size_t _index) { return data()[_index]; }
+    T const& operator[](std::size_t _index) const { return data()[_index]; }
+    T const* begin() const { return data(); }
+    T const* end() const { return data() + count; }
+};
 
-    return 0.f;
-}
+template <typename T>
+using VorbisVector = std::vector<T>;
 
-struct VorbisCodebook
+// The setup records are parsed with Array = VorbisVector, then flattened into
+// a single arena with Array = VorbisSetupArray for decoding.
+template <template <typename> class Array>
+struct VorbisCodebookT
 {
     std::uint16_t dimensions;
     std::uint32_t entry_count;
-    std::vector<std::uint8_t> entry_lengths;
+    Array<std::uint8_t> entry_lengths;
 
     bool ordered;
     bool sparse;
@@ -385,10 +835,16 @@ struct VorbisCodebook
     float delta_value;
     std::uint8_t multiplicand_bit_size;
     bool sequence_p;
-    std::vector<std::uint16_t> multiplicands;
+    Array<std::uint16_t> multiplicands;
+
+    // HuffmanTable slots and primary width
+    Array<std::uint32_t> huffman_slots;
+    int huffman_bits = 0;
+    Array<float> vq_values; // entry_count * dimensions, unpacked lookup
 };
 
-struct VorbisFloor
+template <template <typename> class Array>
+struct VorbisFloorT
 {
     struct Floor0
     {
@@ -398,7 +854,9 @@ struct VorbisFloor
         std::uint8_t amplitude_bits;
         std::uint8_t amplitude_offset;
         std::uint8_t book_count;
-        std::vector<std::uint8_t> codebooks;
+        Array<std::uint8_t> codebooks;
+
+        Array<std::int32_t> bark_map[2]; // per blocksize, n/2 entries
     };
 
     struct Floor1
@@ -408,22 +866,24 @@ struct VorbisFloor
             std::uint8_t dimensions;
             std::uint8_t subclass_logcount;
             std::uint8_t masterbook;
-            std::vector<std::uint8_t> subclass_codebooks;
+            Array<std::uint8_t> subclass_codebooks;
         };
 
         std::uint8_t partition_count;
-        std::vector<std::uint8_t> partition_classes;
-        std::vector<Class> classes;
+        Array<std::uint8_t> partition_classes;
+        Array<Class> classes;
         std::uint8_t multiplier;
         std::uint32_t value_count;
-        std::vector<std::uint32_t> values;
+        Array<std::uint32_t> values;
+        Array<std::uint8_t> sorted_indices; // values in ascending X order
     };
 
     std::uint16_t type;
     std::variant<Floor0, Floor1> data;
 };
 
-struct VorbisResidue
+template <template <typename> class Array>
+struct VorbisResidueT
 {
     static constexpr std::uint16_t kUnusedBook = 0x100u;
 
@@ -433,23 +893,28 @@ struct VorbisResidue
     std::uint32_t partition_size;
     std::uint8_t classif_count;
     std::uint8_t classbook;
-    std::vector<std::uint8_t> cascade;
-    std::vector<std::uint16_t> books;
+    Array<std::uint8_t> cascade;
+    Array<std::uint16_t> books;
+
+    // classbook entry -> classbook.dimensions partition classes, most
+    // significant first
+    Array<std::uint8_t> classifications;
 };
 
-struct VorbisMapping
+template <template <typename> class Array>
+struct VorbisMappingT
 {
     std::uint16_t type;
     bool submap_flag;
     std::uint8_t submap_count;
     bool coupling_flag;
     std::uint8_t coupling_step_count;
-    std::vector<std::uint32_t> magnitudes;
-    std::vector<std::uint32_t> angles;
+    Array<std::uint32_t> magnitudes;
+    Array<std::uint32_t> angles;
     std::uint8_t reserved_field;
-    std::vector<std::uint8_t> muxes;
-    std::vector<std::uint8_t> submap_floors;
-    std::vector<std::uint8_t> submap_residues;
+    Array<std::uint8_t> muxes;
+    Array<std::uint8_t> submap_floors;
+    Array<std::uint8_t> submap_residues;
 };
 
 struct VorbisMode
@@ -460,6 +925,42 @@ struct VorbisMode
     std::uint8_t mapping;
 };
 
+template <template <typename> class Array>
+struct VorbisSetupT
+{
+    Array<VorbisCodebookT<Array>> codebooks;
+    Array<VorbisFloorT<Array>> floors;
+    Array<VorbisResidueT<Array>> residues;
+    Array<VorbisMappingT<Array>> mappings;
+    Array<VorbisMode> modes;
+};
+
+using VorbisCodebookDesc = VorbisCodebookT<VorbisVector>;
+using VorbisFloorDesc = VorbisFloorT<VorbisVector>;
+using VorbisResidueDesc = VorbisResidueT<VorbisVector>;
+using VorbisMappingDesc = VorbisMappingT<VorbisVector>;
+using VorbisSetupDesc = VorbisSetupT<VorbisVector>;
+
+using VorbisCodebook = VorbisCodebookT<VorbisSetupArray>;
+using VorbisFloor = VorbisFloorT<VorbisSetupArray>;
+using VorbisResidue = VorbisResidueT<VorbisSetupArray>;
+using VorbisMapping = VorbisMappingT<VorbisSetupArray>;
+using VorbisSetupHeader = VorbisSetupT<VorbisSetupArray>;
+
+// Owns a flattened setup : the VorbisSetupHeader record at offset 0, then
+// per codebook its Huffman slots and VQ values, then the floor, residue and
+// mapping tables, and last the data only needed while parsing.
+struct VorbisSetupArena
+{
+    std::vector<std::max_align_t> storage;
+    std::size_t size = 0u; // in bytes
+
+    VorbisSetupHeader const& header() const
+    {
+        return *reinterpret_cast<VorbisSetupHeader const*>(storage.data());
+    }
+};
+
 struct VorbisIDHeader
 {
     std::size_t page_index;
@@ -477,16 +978,124 @@ struct VorbisIDHeader
     // + 1 bit framing flag (0x01 because of byte alignment)
 };
 
-struct VorbisSetupHeader
+// Tables for one blocksize N. The N/2 point DCT-IV at the core of the IMDCT
+// runs as an N/4 point complex inverse FFT on split real/imaginary arrays,
+// in radix-4 stages (plus one radix-2 stage when log2(N/4) is odd).
+struct VorbisMdct
 {
-    std::size_t page_index;
-    std::size_t segment_index;
+    std::uint32_t n = 0u;
+    std::vector<float> twiddle_re; // exp(i*2pi/N * (j + 1/8)), N/4 entries
+    std::vector<float> twiddle_im;
+    std::vector<std::uint32_t> bit_reverse; // N/4 entries
+    // per radix-4 stage of half-size h : W_2h^j re, im then W_4h^j re, im,
+    // h entries each
+    std::vector<float> stage_twiddles;
+};
+
+// Full-length windows of a blocksize pair : the short window, then the long
+// window for each (previous_window_flag, next_window_flag) combination.
+struct VorbisWindows
+{
+    std::vector<float> shapes[5];
+};
+
+// Finished samples of the last packet : size samples per channel, starting at
+// offset in block slot. The overlap_size of them starting at overlap_start still
+// need the samples of overlap_slot, from overlap_offset, added.
+struct VorbisPcmRange
+{
+    std::uint32_t slot = 0u;
+    std::uint32_t offset = 0u;
+    std::uint32_t size = 0u;
+    std::uint32_t overlap_start = 0u;
+    std::uint32_t overlap_size = 0u;
+    std::uint32_t overlap_slot = 0u;
+    std::uint32_t overlap_offset = 0u;
+};
 
-    std::vector<VorbisCodebook> codebooks;
-    std::vector<VorbisFloor> floors;
-    std::vector<VorbisResidue> residues;
-    std::vector<VorbisMapping> mappings;
-    std::vector<VorbisMode> modes;
+// Bump allocator for per-packet temporaries. It is sized once at open from
+// the stream limits and rewound at the start of every packet, so steady-state
+// decode does not touch the heap.
+struct VorbisScratchArena
+{
+    std::vector<std::max_align_t> storage;
+    std::size_t capacity = 0u; // in bytes
+    std::size_t used = 0u;
+    std::size_t peak = 0u;
+};
+
+void VorbisScratchReserve(VorbisScratchArena &o_arena, std::size_t _bytes)
+{
+    std::size_t const count = (_bytes + sizeof(std::max_align_t) - 1u) / sizeof(std::max_align_t);
+    o_arena.storage.assign(count, std::max_align_t{});
+    o_arena.capacity = count * sizeof(std::max_align_t);
+    o_arena.used = 0u;
+    o_arena.peak = 0u;
+}
+
+inline void VorbisScratchReset(VorbisScratchArena &_arena)
+{
+    _arena.used = 0u;
+}
+
+// Returns nullptr when the reservation is exceeded, which the sizing at open
+// rules out for conforming streams.
+template <typename T>
+T* VorbisScratchAllocate(VorbisScratchArena &_arena, std::size_t _count)
+{
+    static_assert(std::is_trivially_destructible<T>::value, "scratch memory is never destroyed");
+    std::size_t const offset = (_arena.used + alignof(T) - 1u) & ~(alignof(T) - 1u);
+    std::size_t const size = _count * sizeof(T);
+    assert(offset + size <= _arena.capacity);
+    if (offset + size > _arena.capacity)
+        return nullptr;
+
+    _arena.used = offset + size;
+    _arena.peak = std::max(_arena.peak, _arena.used);
+    return reinterpret_cast<T*>(reinterpret_cast<std::uint8_t*>(_arena.storage.data()) + offset);
+}
+
+struct VorbisDecodeBuffers
+{
+    static constexpr std::size_t kPacketPadding = 8u;
+    static constexpr std::size_t kFloor1MaxValues = 65u;
+    static constexpr std::size_t kFloor0MaxOrder = 256u;
+
+    std::uint32_t channel_stride = 0u; // (1 << blocksize_1) / 2
+    std::vector<float> spectrum; // planar, channel_stride floats per channel
+
+    std::vector<std::uint8_t> packet; // packets spanning pages are reassembled here
+
+    // Channels whose floor is unused are silent for the packet. Their spectrum
+    // is left untouched (stale) unless coupling forces a residue decode, so
+    // later stages must check these flags rather than read the spectrum.
+    std::vector<std::uint8_t> floor_unused;
+    std::vector<std::uint8_t> no_residue;
+    bool silent_packet = false; // every channel unused, nothing past the floors
+    std::vector<std::int32_t> floor1_y;
+    std::vector<std::uint8_t> floor1_step2;
+    std::vector<std::uint32_t> floor0_amplitude;
+    std::vector<float> floor0_coefficients;
+
+    VorbisKernels const* kernels = nullptr;
+    VorbisMdct const* mdct[2] = { nullptr, nullptr };
+    VorbisWindows const* windows = nullptr;
+    std::uint32_t blocksize = 0u; // of the last decoded packet
+    std::vector<float> imdct_scratch;
+
+    // Overlap ring, two windowed IMDCT outputs per channel. The IMDCT writes in
+    // ring_slot while the other slot holds the previous packet, whose right half
+    // is overlapped in place.
+    std::uint32_t channel_count = 0u;
+    std::uint32_t block_stride = 0u; // 1 << blocksize_1
+    std::vector<float> block; // [slot][channel][block_stride]
+    std::uint32_t ring_slot = 0u;
+    std::uint32_t previous_blocksize = 0u; // 0 before the first packet
+    VorbisPcmRange pcm;
+
+    VorbisScratchArena scratch; // floor1 Y values, residue classifications
+
+    VorbisProfile profile;
 };
 
 enum EVorbisError
@@ -537,14 +1146,15 @@ EVorbisError ComputePacketSize(PageContainer const& _pages,
 
     while (_pages[_page_index].segment_table[_seg_index] == 255u)
     {
-        std::cout << std::dec << (unsigned)_pages[_page_index].segment_table[_seg_index] << " ";
+        VORBIS_TRACE(kTraceVerbose, kTraceOgg, "lacing 255 page %zu segment %zu", _page_index, _seg_index);
         o_packet_size += _pages[_page_index].segment_table[_seg_index++];
         if (_seg_index >= _pages[_page_index].segment_count)
             if (++_page_index >= _pages.size())
                 return EVorbisError::kInvalidStream;
     }
 
-    std::cout << std::dec << (unsigned)_pages[_page_index].segment_table[_seg_index] << std::endl;
+    VORBIS_TRACE(kTraceVerbose, kTraceOgg, "lacing %u page %zu segment %zu",
+                 (unsigned)_pages[_page_index].segment_table[_seg_index], _page_index, _seg_index);
     o_packet_size += _pages[_page_index].segment_table[_seg_index];
     o_page_end = _page_index;
     o_seg_end = _seg_index + 1;
@@ -558,6 +1168,78 @@ EVorbisError ComputePacketSize(PageContainer const& _pages,
     return EVorbisError::kNoError;
 }
 
+// Points o_packet at the packet data when it lies within a single page, and
+// reassembles it into o_storage (padded) when it spans several pages.
+EVorbisError AssemblePacket(PageContainer const& _pages,
+                            std::size_t _page_index,
+                            std::size_t _seg_index,
+                            std::vector<std::uint8_t> &o_storage,
+                            std::uint8_t const* &o_packet,
+                            std::size_t &o_packet_size,
+                            std::size_t &o_page_end,
+                            std::size_t &o_seg_end)
+{
+    if (_page_index >= _pages.size())
+        return EVorbisError::kEndOfStream;
+
+    std::size_t byte_offset = 0u;
+    for (std::size_t i = 0u; i < _seg_index; ++i)
+        byte_offset += _pages[_page_index].segment_table[i];
+
+    bool spans_pages = false;
+    o_storage.clear();
+
+    for (;;)
+    {
+        PageDesc const& page = _pages[_page_index];
+
+        std::size_t run_size = 0u;
+        bool packet_end = false;
+        while (_seg_index < page.segment_count && !packet_end)
+        {
+            std::uint8_t const lacing_value = page.segment_table[_seg_index++];
+            run_size += lacing_value;
+            packet_end = (lacing_value < 255u);
+        }
+
+        if (packet_end && !spans_pages)
+        {
+            o_packet = page.stream_begin + byte_offset;
+            o_packet_size = run_size;
+            break;
+        }
+
+        spans_pages = true;
+        o_storage.insert(o_storage.end(),
+                         page.stream_begin + byte_offset,
+                         page.stream_begin + byte_offset + run_size);
+        if (packet_end)
+            break;
+
+        if (++_page_index >= _pages.size())
+            return EVorbisError::kInvalidStream;
+        _seg_index = 0u;
+        byte_offset = 0u;
+    }
+
+    if (spans_pages)
+    {
+        o_packet_size = o_storage.size();
+        o_storage.resize(o_packet_size + VorbisDecodeBuffers::kPacketPadding, 0u);
+        o_packet = o_storage.data();
+    }
+
+    o_page_end = _page_index;
+    o_seg_end = _seg_index;
+    if (o_seg_end == _pages[o_page_end].segment_count)
+    {
+        o_page_end++;
+        o_seg_end = 0u;
+    }
+
+    return EVorbisError::kNoError;
+}
+
 std::uint32_t ReadBits(int _count,
                        std::uint8_t const* &_base_address,
                        int &_bit_offset)
@@ -604,6 +1286,26 @@ std::uint32_t ReadBits(int _count,
     return result;
 }
 
+// NOTE: reads 4 bytes from _base_address, buffers must be padded accordingly.
+inline std::uint32_t PeekBits(int _count,
+                              std::uint8_t const* _base_address,
+                              int _bit_offset)
+{
+    assert(_count <= 24);
+    std::uint32_t word;
+    std::memcpy(&word, _base_address, 4u);
+    return (word >> _bit_offset) & ((1u << _count) - 1u);
+}
+
+inline void SkipBits(int _count,
+                     std::uint8_t const* &_base_address,
+                     int &_bit_offset)
+{
+    _bit_offset += _count;
+    _base_address += _bit_offset >> 3;
+    _bit_offset &= 7;
+}
+
 #if 0
 // Single field, N fields
 // biased (+1, -1), unbiased
@@ -642,9 +1344,9 @@ EVorbisError ReadFields(std::uint8_t const* &_base_address,
 EVorbisError VorbisCodebookDecode(std::uint8_t const* &_base_address,
                                   int &_bit_offset,
                                   int &_remaining_bits,
-                                  VorbisCodebook &o_codebook)
+                                  VorbisCodebookDesc &o_codebook)
 {
-    std::cout << "Remaining bits " << _remaining_bits << std::endl;
+    VORBIS_TRACE(kTraceVerbose, kTraceCodebooks, "codebook remaining bits %d", _remaining_bits);
 
     if (_remaining_bits < 24)
         return EVorbisError::kIncompleteHeader;
@@ -679,7 +1381,7 @@ EVorbisError VorbisCodebookDecode(std::uint8_t const* &_base_address,
 
         if (o_codebook.sparse)
         {
-            std::cout << "sparse" << std::endl;
+            VORBIS_TRACE(kTraceVerbose, kTraceCodebooks, "sparse");
 
             for (std::size_t entry_index = 0u;
                  entry_index < o_codebook.entry_count; ++entry_index)
@@ -721,7 +1423,7 @@ EVorbisError VorbisCodebookDecode(std::uint8_t const* &_base_address,
         if (_remaining_bits < 5)
             return EVorbisError::kIncompleteHeader;
         _remaining_bits -= 5;
-        std::uint8_t current_length = (std::uint8_t)ReadBits(5, _base_address, _bit_offset);
+        std::uint8_t current_length = 1u + (std::uint8_t)ReadBits(5, _base_address, _bit_offset);
 
         std::uint32_t entry_index = 0u;
         while (entry_index < o_codebook.entry_count)
@@ -749,7 +1451,7 @@ EVorbisError VorbisCodebookDecode(std::uint8_t const* &_base_address,
     _remaining_bits -= 4;
     o_codebook.lookup_type = (std::uint8_t)ReadBits(4, _base_address, _bit_offset);
 
-    std::cout << "Lookup type " << (unsigned)o_codebook.lookup_type << std::endl;
+    VORBIS_TRACE(kTraceVerbose, kTraceCodebooks, "lookup type %u", (unsigned)o_codebook.lookup_type);
 
     if (o_codebook.lookup_type > 2u)
         return EVorbisError::kInvalidSetupHeader;
@@ -787,7 +1489,7 @@ EVorbisError VorbisCodebookDecode(std::uint8_t const* &_base_address,
             float res; memcpy(&res, &ieee_bin, 4u);
 
             if (ref != res)
-                std::cout << "[WARNING] incorrect float32_unpack" << std::endl;
+                VORBIS_TRACE(kTraceWarning, kTraceCodebooks, "incorrect float32_unpack %08x", _v);
             return res;
         };
 
@@ -803,8 +1505,8 @@ EVorbisError VorbisCodebookDecode(std::uint8_t const* &_base_address,
         std::uint32_t binary_delta_value = ReadBits(32, _base_address, _bit_offset);
         o_codebook.delta_value = float32_unpack(binary_delta_value);
 
-        std::cout << "Min value " << o_codebook.min_value << std::endl;
-        std::cout << "Delta value " << o_codebook.delta_value << std::endl;
+        VORBIS_TRACE(kTraceVerbose, kTraceCodebooks, "min value %g delta value %g",
+                     (double)o_codebook.min_value, (double)o_codebook.delta_value);
 
         if (_remaining_bits < 4)
             return EVorbisError::kIncompleteHeader;
@@ -831,33 +1533,455 @@ EVorbisError VorbisCodebookDecode(std::uint8_t const* &_base_address,
             o_codebook.multiplicands[value_index] =
                 (std::uint16_t)ReadBits(o_codebook.multiplicand_bit_size, _base_address, _bit_offset);
         }
+
+        o_codebook.vq_values.resize((std::size_t)o_codebook.entry_count * o_codebook.dimensions);
+        for (std::uint32_t entry_index = 0u; entry_index < o_codebook.entry_count; ++entry_index)
+        {
+            float last = 0.f;
+            std::uint32_t index_divisor = 1u;
+            for (std::uint16_t dimension_index = 0u;
+                 dimension_index < o_codebook.dimensions; ++dimension_index)
+            {
+                std::uint32_t multiplicand_offset = entry_index * o_codebook.dimensions + dimension_index;
+                if (o_codebook.lookup_type == 1u)
+                {
+                    multiplicand_offset = (entry_index / index_divisor) % value_count;
+                    index_divisor *= value_count;
+                }
+
+                float const value = (float)o_codebook.multiplicands[multiplicand_offset]
+                    * o_codebook.delta_value + o_codebook.min_value + last;
+                o_codebook.vq_values[entry_index * o_codebook.dimensions + dimension_index] = value;
+                if (o_codebook.sequence_p)
+                    last = value;
+            }
+        }
     }
 
+    bool const has_entries = std::any_of(o_codebook.entry_lengths.begin(),
+                                         o_codebook.entry_lengths.end(),
+                                         [](std::uint8_t _length) { return _length != 0u; });
+    HuffmanTable huffman = Huffman_BuildTable(o_codebook.entry_lengths);
+    if (has_entries && huffman.slots.empty())
+        return EVorbisError::kInvalidSetupHeader;
+    o_codebook.huffman_slots = std::move(huffman.slots);
+    o_codebook.huffman_bits = huffman.primary_bits;
+
     return EVorbisError::kNoError;
 }
 
-std::uint32_t VorbisHeaders(PageContainer const &_pages,
-                            std::size_t &_page_index,
-                            std::size_t &_seg_index,
-                            VorbisIDHeader &o_id_header,
-                            VorbisSetupHeader &o_setup_header)
+// Returns false on end of packet or unknown codeword.
+inline bool VorbisReadEntry(VorbisCodebook const& _codebook,
+                            std::uint8_t const* &_base_address,
+                            int &_bit_offset,
+                            int &_remaining_bits,
+                            std::uint32_t &o_entry)
 {
-    EVorbisError error_code = EVorbisError::kNoError;
-    std::uint16_t error_flags = 0u;
-
+    int bits_read = 0;
+    o_entry = Huffman_DecodeEntry(_codebook.huffman_slots.data(), _codebook.huffman_bits,
+                                  _base_address, _bit_offset, bits_read);
+    if (bits_read < 0 || bits_read > _remaining_bits)
     {
-        std::size_t packet_size = _pages[_page_index].segment_table[_seg_index];
+        _remaining_bits = 0;
+        return false;
+    }
+    _remaining_bits -= bits_read;
+#if VORBIS_PROFILE
+    if (t_codeword_profile)
+    {
+        ++t_codeword_profile->codeword_lengths[bits_read];
+        t_codeword_profile->secondary_lookups += (bits_read > _codebook.huffman_bits) ? 1u : 0u;
+    }
+#endif
+    return true;
+}
 
-        if (packet_size == 255u)
-            return PackError(EVorbisError::kMissingHeader, 0u);
+struct VorbisSetupLayout
+{
+    std::uint8_t* base = nullptr;
+    std::size_t capacity = 0u;
+    std::size_t size = 0u;
+};
 
-        if (std::strncmp((char const*)_pages[_page_index].stream_begin, "\x01vorbis", 7u))
-            return PackError(EVorbisError::kMissingHeader, 0u);
+// Upper bound of the arena bytes _count values of T take, alignment included.
+template <typename T>
+std::size_t VorbisSetupBytes(std::size_t _count)
+{
+    return _count * sizeof(T) + alignof(T) - 1u;
+}
 
-        if (packet_size < VorbisIDHeader::kSizeOnStream + 7u)
+template <typename T>
+std::size_t VorbisSetupBytes(std::vector<T> const& _source)
+{
+    return VorbisSetupBytes<T>(_source.size());
+}
+
+std::size_t VorbisSetupBytes(VorbisSetupDesc const& _desc)
+{
+    std::size_t bytes = VorbisSetupBytes<VorbisSetupHeader>(1u)
+        + VorbisSetupBytes<VorbisCodebook>(_desc.codebooks.size())
+        + VorbisSetupBytes<VorbisFloor>(_desc.floors.size())
+        + VorbisSetupBytes<VorbisResidue>(_desc.residues.size())
+        + VorbisSetupBytes<VorbisMapping>(_desc.mappings.size())
+        + VorbisSetupBytes(_desc.modes);
+
+    for (VorbisCodebookDesc const& codebook : _desc.codebooks)
+        bytes += VorbisSetupBytes(codebook.huffman_slots) + VorbisSetupBytes(codebook.vq_values)
+            + VorbisSetupBytes(codebook.entry_lengths) + VorbisSetupBytes(codebook.multiplicands);
+
+    for (VorbisFloorDesc const& floor : _desc.floors)
+    {
+        if (floor.type == 0u)
+        {
+            VorbisFloorDesc::Floor0 const& floor0 = std::get<0>(floor.data);
+            bytes += VorbisSetupBytes(floor0.codebooks)
+                + VorbisSetupBytes(floor0.bark_map[0]) + VorbisSetupBytes(floor0.bark_map[1]);
+            continue;
+        }
+
+        VorbisFloorDesc::Floor1 const& floor1 = std::get<1>(floor.data);
+        bytes += VorbisSetupBytes(floor1.partition_classes)
+            + VorbisSetupBytes<VorbisFloor::Floor1::Class>(floor1.classes.size())
+            + VorbisSetupBytes(floor1.values) + VorbisSetupBytes(floor1.sorted_indices);
+        for (VorbisFloorDesc::Floor1::Class const& floor_class : floor1.classes)
+            bytes += VorbisSetupBytes(floor_class.subclass_codebooks);
+    }
+
+    for (VorbisResidueDesc const& residue : _desc.residues)
+        bytes += VorbisSetupBytes(residue.cascade) + VorbisSetupBytes(residue.books)
+            + VorbisSetupBytes(residue.classifications);
+
+    for (VorbisMappingDesc const& mapping : _desc.mappings)
+        bytes += VorbisSetupBytes(mapping.magnitudes) + VorbisSetupBytes(mapping.angles)
+            + VorbisSetupBytes(mapping.muxes) + VorbisSetupBytes(mapping.submap_floors)
+            + VorbisSetupBytes(mapping.submap_residues);
+
+    return bytes;
+}
+
+// Value-initialises _count records of T at the end of the layout and points
+// o_array at them.
+template <typename T>
+T* VorbisSetupPlace(VorbisSetupLayout &_layout, VorbisSetupArray<T> &o_array, std::size_t _count)
+{
+    std::size_t const offset = (_layout.size + alignof(T) - 1u) & ~(alignof(T) - 1u);
+    assert(offset + _count * sizeof(T) <= _layout.capacity);
+    _layout.size = offset + _count * sizeof(T);
+
+    T* const data = reinterpret_cast<T*>(_layout.base + offset);
+    for (std::size_t i = 0u; i < _count; ++i)
+        new (data + i) T{};
+    o_array.offset = (std::int32_t)(reinterpret_cast<std::uint8_t*>(data)
+                                    - reinterpret_cast<std::uint8_t*>(&o_array));
+    o_array.count = (std::uint32_t)_count;
+    return data;
+}
+
+template <typename T>
+void VorbisSetupCopy(VorbisSetupLayout &_layout, VorbisSetupArray<T> &o_array, std::vector<T> const& _source)
+{
+    T* const data = VorbisSetupPlace(_layout, o_array, _source.size());
+    std::copy(_source.begin(), _source.end(), data);
+}
+
+// Lays the parsed setup out in o_setup, see VorbisSetupArena for the order.
+EVorbisError VorbisSetupFlatten(VorbisSetupDesc const& _desc, VorbisSetupArena &o_setup)
+{
+    std::size_t const capacity = VorbisSetupBytes(_desc);
+    if (capacity > (std::size_t)INT32_MAX)
+        return EVorbisError::kInvalidSetupHeader;
+
+    std::size_t const count = (capacity + sizeof(std::max_align_t) - 1u) / sizeof(std::max_align_t);
+    o_setup.storage.assign(count, std::max_align_t{});
+
+    VorbisSetupLayout layout;
+    layout.base = reinterpret_cast<std::uint8_t*>(o_setup.storage.data());
+    layout.capacity = count * sizeof(std::max_align_t);
+    layout.size = sizeof(VorbisSetupHeader);
+
+    VorbisSetupHeader &setup = *new (layout.base) VorbisSetupHeader{};
+    VorbisSetupPlace(layout, setup.codebooks, _desc.codebooks.size());
+    VorbisSetupPlace(layout, setup.floors, _desc.floors.size());
+    VorbisSetupPlace(layout, setup.residues, _desc.residues.size());
+    VorbisSetupPlace(layout, setup.mappings, _desc.mappings.size());
+    VorbisSetupCopy(layout, setup.modes, _desc.modes);
+
+    for (std::size_t i = 0u; i < _desc.codebooks.size(); ++i)
+    {
+        VorbisCodebookDesc const& in = _desc.codebooks[i];
+        VorbisCodebook &out = setup.codebooks[i];
+        out.dimensions = in.dimensions;
+        out.entry_count = in.entry_count;
+        out.ordered = in.ordered;
+        out.sparse = in.sparse;
+        out.lookup_type = in.lookup_type;
+        out.min_value = in.min_value;
+        out.delta_value = in.delta_value;
+        out.multiplicand_bit_size = in.multiplicand_bit_size;
+        out.sequence_p = in.sequence_p;
+        out.huffman_bits = in.huffman_bits;
+        VorbisSetupCopy(layout, out.huffman_slots, in.huffman_slots);
+        VorbisSetupCopy(layout, out.vq_values, in.vq_values);
+    }
+
+    for (std::size_t i = 0u; i < _desc.floors.size(); ++i)
+    {
+        VorbisFloorDesc const& in = _desc.floors[i];
+        VorbisFloor &out = setup.floors[i];
+        out.type = in.type;
+        if (in.type == 0u)
+        {
+            VorbisFloorDesc::Floor0 const& in0 = std::get<0>(in.data);
+            VorbisFloor::Floor0 &out0 = std::get<0>(out.data);
+            out0.order = in0.order;
+            out0.rate = in0.rate;
+            out0.bark_map_size = in0.bark_map_size;
+            out0.amplitude_bits = in0.amplitude_bits;
+            out0.amplitude_offset = in0.amplitude_offset;
+            out0.book_count = in0.book_count;
+            VorbisSetupCopy(layout, out0.codebooks, in0.codebooks);
+            VorbisSetupCopy(layout, out0.bark_map[0], in0.bark_map[0]);
+            VorbisSetupCopy(layout, out0.bark_map[1], in0.bark_map[1]);
+            continue;
+        }
+
+        VorbisFloorDesc::Floor1 const& in1 = std::get<1>(in.data);
+        VorbisFloor::Floor1 &out1 = out.data.emplace<1>();
+        out1.partition_count = in1.partition_count;
+        out1.multiplier = in1.multiplier;
+        out1.value_count = in1.value_count;
+        VorbisSetupCopy(layout, out1.partition_classes, in1.partition_classes);
+        VorbisSetupPlace(layout, out1.classes, in1.classes.size());
+        for (std::size_t j = 0u; j < in1.classes.size(); ++j)
+        {
+            VorbisFloorDesc::Floor1::Class const& in_class = in1.classes[j];
+            VorbisFloor::Floor1::Class &out_class = out1.classes[j];
+            out_class.dimensions = in_class.dimensions;
+            out_class.subclass_logcount = in_class.subclass_logcount;
+            out_class.masterbook = in_class.masterbook;
+            VorbisSetupCopy(layout, out_class.subclass_codebooks, in_class.subclass_codebooks);
+        }
+        VorbisSetupCopy(layout, out1.values, in1.values);
+        VorbisSetupCopy(layout, out1.sorted_indices, in1.sorted_indices);
+    }
+
+    for (std::size_t i = 0u; i < _desc.residues.size(); ++i)
+    {
+        VorbisResidueDesc const& in = _desc.residues[i];
+        VorbisResidue &out = setup.residues[i];
+        out.type = in.type;
+        out.begin = in.begin;
+        out.end = in.end;
+        out.partition_size = in.partition_size;
+        out.classif_count = in.classif_count;
+        out.classbook = in.classbook;
+        VorbisSetupCopy(layout, out.books, in.books);
+        VorbisSetupCopy(layout, out.classifications, in.classifications);
+    }
+
+    for (std::size_t i = 0u; i < _desc.mappings.size(); ++i)
+    {
+        VorbisMappingDesc const& in = _desc.mappings[i];
+        VorbisMapping &out = setup.mappings[i];
+        out.type = in.type;
+        out.submap_flag = in.submap_flag;
+        out.submap_count = in.submap_count;
+        out.coupling_flag = in.coupling_flag;
+        out.coupling_step_count = in.coupling_step_count;
+        out.reserved_field = in.reserved_field;
+        VorbisSetupCopy(layout, out.magnitudes, in.magnitudes);
+        VorbisSetupCopy(layout, out.angles, in.angles);
+        VorbisSetupCopy(layout, out.muxes, in.muxes);
+        VorbisSetupCopy(layout, out.submap_floors, in.submap_floors);
+        VorbisSetupCopy(layout, out.submap_residues, in.submap_residues);
+    }
+
+    // cold, only kept for inspection
+    for (std::size_t i = 0u; i < _desc.codebooks.size(); ++i)
+    {
+        VorbisSetupCopy(layout, setup.codebooks[i].entry_lengths, _desc.codebooks[i].entry_lengths);
+        VorbisSetupCopy(layout, setup.codebooks[i].multiplicands, _desc.codebooks[i].multiplicands);
+    }
+    for (std::size_t i = 0u; i < _desc.residues.size(); ++i)
+        VorbisSetupCopy(layout, setup.residues[i].cascade, _desc.residues[i].cascade);
+
+    o_setup.size = layout.size;
+    return EVorbisError::kNoError;
+}
+
+// Prepared setups shared by every decoder in the process. Streams produced
+// with the same encoder settings carry byte-identical setup packets, so the
+// codebooks and tables are built once and then handed out read-only. The
+// tables also depend on the channel count and blocksizes, which are part of
+// the key. Entries only observe their setup; the decoder releasing the last
+// reference also removes the entry.
+struct VorbisSetupCacheEntry
+{
+    std::uint8_t audio_channels = 0u;
+    std::uint8_t blocksize_0 = 0u;
+    std::uint8_t blocksize_1 = 0u;
+    std::vector<std::uint8_t> packet;
+    std::weak_ptr<VorbisSetupArena const> setup;
+};
+
+struct VorbisSetupCache
+{
+    std::mutex mutex;
+    std::unordered_map<std::uint64_t, VorbisSetupCacheEntry> entries;
+    std::uint64_t hits = 0u;
+    std::uint64_t misses = 0u;
+};
+
+VorbisSetupCache& VorbisGetSetupCache()
+{
+    static VorbisSetupCache s_cache;
+    return s_cache;
+}
+
+// FNV-1a over the ID header fields the tables depend on, then the packet.
+std::uint64_t VorbisSetupHash(VorbisIDHeader const& _id,
+                              std::uint8_t const* _packet,
+                              std::size_t _size)
+{
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    auto const mix = [&hash](std::uint8_t _byte)
+    {
+        hash = (hash ^ _byte) * 0x100000001b3ull;
+    };
+
+    mix(_id.audio_channels);
+    mix(_id.blocksize_0);
+    mix(_id.blocksize_1);
+    for (std::size_t i = 0u; i < _size; ++i)
+        mix(_packet[i]);
+    return hash;
+}
+
+bool VorbisSetupCacheMatch(VorbisSetupCacheEntry const& _entry,
+                           VorbisIDHeader const& _id,
+                           std::uint8_t const* _packet,
+                           std::size_t _size)
+{
+    return _entry.audio_channels == _id.audio_channels
+        && _entry.blocksize_0 == _id.blocksize_0
+        && _entry.blocksize_1 == _id.blocksize_1
+        && _entry.packet.size() == _size
+        && std::equal(_packet, _packet + _size, _entry.packet.begin());
+}
+
+// Returns nullptr when the setup has not been prepared yet or was released.
+std::shared_ptr<VorbisSetupArena const> VorbisSetupCacheFind(std::uint64_t _hash,
+                                                             VorbisIDHeader const& _id,
+                                                             std::uint8_t const* _packet,
+                                                             std::size_t _size)
+{
+    VorbisSetupCache &cache = VorbisGetSetupCache();
+    // declared before the lock so a last reference is dropped unlocked
+    std::shared_ptr<VorbisSetupArena const> setup;
+    std::lock_guard<std::mutex> const lock(cache.mutex);
+
+    auto const it = cache.entries.find(_hash);
+    if (it != cache.entries.end() && VorbisSetupCacheMatch(it->second, _id, _packet, _size))
+        setup = it->second.setup.lock();
+    if (!setup)
+    {
+        ++cache.misses;
+        return nullptr;
+    }
+
+    ++cache.hits;
+    return setup;
+}
+
+// Publishes a freshly prepared setup and returns the cached one, which is not
+// _setup when another thread got there first. Hash collisions with a live
+// setup are left uncached, released entries are replaced.
+std::shared_ptr<VorbisSetupArena const> VorbisSetupCacheInsert(std::uint64_t _hash,
+                                                               VorbisIDHeader const& _id,
+                                                               std::uint8_t const* _packet,
+                                                               std::size_t _size,
+                                                               std::shared_ptr<VorbisSetupArena const> _setup)
+{
+    VorbisSetupCache &cache = VorbisGetSetupCache();
+    std::shared_ptr<VorbisSetupArena const> cached;
+    std::lock_guard<std::mutex> const lock(cache.mutex);
+
+    VorbisSetupCacheEntry &entry = cache.entries[_hash];
+    cached = entry.setup.lock();
+    if (cached)
+        return VorbisSetupCacheMatch(entry, _id, _packet, _size) ? cached : _setup;
+
+    entry.audio_channels = _id.audio_channels;
+    entry.blocksize_0 = _id.blocksize_0;
+    entry.blocksize_1 = _id.blocksize_1;
+    entry.packet.assign(_packet, _packet + _size);
+    entry.setup = _setup;
+    return _setup;
+}
+
+// Deleter of the prepared setups: frees the tables and drops the entry unless
+// a newer setup was published under the same hash meanwhile.
+void VorbisSetupCacheRelease(std::uint64_t _hash, VorbisSetupArena const* _setup)
+{
+    {
+        VorbisSetupCache &cache = VorbisGetSetupCache();
+        std::lock_guard<std::mutex> const lock(cache.mutex);
+
+        auto const it = cache.entries.find(_hash);
+        if (it != cache.entries.end() && it->second.setup.expired())
+            cache.entries.erase(it);
+    }
+    delete _setup;
+}
+
+// Maps the n/2 spectrum positions of both blocksizes to bark scale indices.
+void Floor0ComputeBarkMaps(std::uint8_t _blocksize_0,
+                           std::uint8_t _blocksize_1,
+                           VorbisFloorDesc::Floor0 &o_floor)
+{
+    auto bark = [](double _x)
+    {
+        return 13.1 * std::atan(.00074 * _x) + 2.24 * std::atan(.0000000185 * _x * _x) + .0001 * _x;
+    };
+
+    std::uint8_t const blocksizes[2] = { _blocksize_0, _blocksize_1 };
+    for (int block_index = 0; block_index < 2; ++block_index)
+    {
+        std::uint32_t const n = (1u << blocksizes[block_index]) / 2u;
+        std::vector<std::int32_t> &bark_map = o_floor.bark_map[block_index];
+        bark_map.resize(n);
+        for (std::uint32_t i = 0u; i < n; ++i)
+        {
+            std::int32_t const foobar = (std::int32_t)std::floor(
+                bark((double)o_floor.rate * i / (2.0 * n)) * o_floor.bark_map_size
+                / bark(.5 * o_floor.rate));
+            bark_map[i] = std::min((std::int32_t)o_floor.bark_map_size - 1, foobar);
+        }
+    }
+}
+
+std::uint32_t VorbisHeaders(PageContainer const &_pages,
+                            std::size_t &_page_index,
+                            std::size_t &_seg_index,
+                            VorbisIDHeader &o_id_header,
+                            std::shared_ptr<VorbisSetupArena const> &o_setup)
+{
+    EVorbisError error_code = EVorbisError::kNoError;
+    std::uint16_t error_flags = 0u;
+
+    {
+        std::size_t packet_size = _pages[_page_index].segment_table[_seg_index];
+
+        if (packet_size == 255u)
+            return PackError(EVorbisError::kMissingHeader, 0u);
+
+        if (std::strncmp((char const*)_pages[_page_index].stream_begin, "\x01vorbis", 7u))
+            return PackError(EVorbisError::kMissingHeader, 0u);
+
+        if (packet_size < VorbisIDHeader::kSizeOnStream + 7u)
             return PackError(EVorbisError::kIncompleteHeader, 0u);
         if (packet_size > VorbisIDHeader::kSizeOnStream + 7u)
-            std::cout << "[WARNING] Unexpected size for Vorbis ID header" << std::endl;
+            VORBIS_TRACE(kTraceWarning, kTraceHeaders, "unexpected size for Vorbis ID header %zu", packet_size);
 
         std::uint8_t const* read_position = _pages[_page_index].stream_begin + 7u;
         std::uint16_t error_flags = 0u;
@@ -894,7 +2018,8 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
             error_flags |= FInvalidIDHeader::kAudioChannels;
         if (!o_id_header.audio_sample_rate)
             error_flags |= FInvalidIDHeader::kSampleRate;
-        if (o_id_header.blocksize_0 > o_id_header.blocksize_1)
+        if (o_id_header.blocksize_0 > o_id_header.blocksize_1 ||
+            o_id_header.blocksize_0 < 6u || o_id_header.blocksize_1 > 13u)
             error_flags |= FInvalidIDHeader::kBlocksize;
 
         if (error_flags)
@@ -907,7 +2032,7 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
         }
     }
 
-    std::cout << "Page index " << _page_index << " segment index " << _seg_index << std::endl;
+    VORBIS_TRACE(kTraceInfo, kTraceHeaders, "ID header done, page %zu segment %zu", _page_index, _seg_index);
 
     std::size_t stream_offset = 0u;
     {
@@ -917,13 +2042,13 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
         if (error_code != EVorbisError::kNoError)
             return PackError(error_code, 0u);
 
-        std::cout << std::dec << "Page end " << page_end << " segment end " << seg_end << std::endl;
+        VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "page end %zu segment end %zu", page_end, seg_end);
 
         if (std::strncmp((char const*)_pages[_page_index].stream_begin, "\x03vorbis", 7))
             return PackError(EVorbisError::kMissingHeader, 0u);
 
-        std::cout << std::dec << "Comment header found page " << _page_index << " segment " << _seg_index << std::endl;
-        std::cout << std::dec << "Size is " << packet_size << " bytes" << std::endl;
+        VORBIS_TRACE(kTraceInfo, kTraceHeaders, "comment header page %zu segment %zu, %zu bytes",
+                     _page_index, _seg_index, packet_size);
 
         _page_index = page_end;
         _seg_index = seg_end;
@@ -937,37 +2062,46 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
         if (error_code != EVorbisError::kNoError)
             return PackError(error_code, 0u);
 
-        std::cout << std::dec << "Page end " << page_end << " segment end " << seg_end << std::endl;
+        VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "page end %zu segment end %zu", page_end, seg_end);
 
         if (std::strncmp((char const*)_pages[_page_index].stream_begin + stream_offset, "\x05vorbis", 7))
             return PackError(EVorbisError::kMissingHeader, 0u);
 
-        std::cout << std::dec << "Setup header found page " << _page_index << " segment " << _seg_index << std::endl;
-        std::cout << std::dec << "Size is " << packet_size << " bytes" << std::endl;
+        VORBIS_TRACE(kTraceInfo, kTraceHeaders, "setup header page %zu segment %zu, %zu bytes",
+                     _page_index, _seg_index, packet_size);
+
+        std::uint8_t const* const packet = _pages[_page_index].stream_begin + stream_offset;
+        std::uint64_t const setup_hash = VorbisSetupHash(o_id_header, packet, packet_size);
+        o_setup = VorbisSetupCacheFind(setup_hash, o_id_header, packet, packet_size);
+        if (o_setup)
+        {
+            VORBIS_TRACE(kTraceInfo, kTraceHeaders, "setup header %016llx cached",
+                         (unsigned long long)setup_hash);
+            _page_index = page_end;
+            _seg_index = seg_end;
+            return 0u;
+        }
 
-        std::uint8_t const* read_position = _pages[_page_index].stream_begin + stream_offset + 7u;
+        std::uint8_t const* read_position = packet + 7u;
         int bit_offset = 0;
         int remaining_bits = (packet_size - 7) * 8;
 
-        o_setup_header.page_index = _page_index;
-        o_setup_header.segment_index = _seg_index;
+        VorbisSetupDesc setup_desc;
 
         // =====================================================================
         // CODEBOOKS
         // =====================================================================
 
-        std::cout << "CODEBOOKS BEGIN "
-                  << std::hex << (read_position - debug_baseBuff)
-                  << " offset " << bit_offset << std::endl;
-        std::cout << "Remaining bits " << std::dec << remaining_bits << std::endl;
+        VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "codebooks begin, bit offset %d, remaining bits %d",
+                     bit_offset, remaining_bits);
 
         if (remaining_bits < 8)
             return PackError(EVorbisError::kIncompleteHeader, 0u);
         remaining_bits -= 8;
         std::size_t const codebook_count = 1u + (std::size_t)ReadBits(8, read_position, bit_offset);
 
-        std::cout << std::dec << "Codebook count " << codebook_count << std::endl;
-        o_setup_header.codebooks.resize(codebook_count);
+        VORBIS_TRACE(kTraceInfo, kTraceHeaders, "codebook count %u", (unsigned)codebook_count);
+        setup_desc.codebooks.resize(codebook_count);
         for (std::size_t codebook_index = 0u;
              error_code == EVorbisError::kNoError && codebook_index < codebook_count;
              ++codebook_index)
@@ -975,20 +2109,17 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
             error_code = VorbisCodebookDecode(read_position,
                                               bit_offset,
                                               remaining_bits,
-                                              o_setup_header.codebooks[codebook_index]);
+                                              setup_desc.codebooks[codebook_index]);
 
-            VorbisCodebook const& codebook = o_setup_header.codebooks[codebook_index];
+            VorbisCodebookDesc const& codebook = setup_desc.codebooks[codebook_index];
 
-#if 1
-            std::cout << "Codebook " << std::dec << codebook_index << std::endl
-                      << std::dec << codebook.dimensions << " "
-                      << std::dec << codebook.entry_count << std::endl;
+            VORBIS_TRACE(kTraceVerbose, kTraceCodebooks, "codebook %u, %u dimensions, %u entries",
+                         (unsigned)codebook_index, (unsigned)codebook.dimensions,
+                         (unsigned)codebook.entry_count);
             for (std::uint32_t entry_index = 0u;
                  entry_index < codebook.entry_count; ++entry_index)
-                std::cout << std::dec
-                          << (unsigned)codebook.entry_lengths[entry_index] << " ";
-            std::cout << std::endl;
-#endif
+                VORBIS_TRACE(kTraceVerbose, kTraceCodebooks, "entry %u length %u",
+                             entry_index, (unsigned)codebook.entry_lengths[entry_index]);
         }
 
         if (error_code != EVorbisError::kNoError)
@@ -1014,36 +2145,34 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
         // FLOORS
         // =====================================================================
 
-        std::cout << "FLOORS BEGIN "
-                  << std::hex << (read_position - debug_baseBuff)
-                  << " offset " << bit_offset << std::endl;
-        std::cout << "Remaining bits " << std::dec << remaining_bits << std::endl;
+        VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "floors begin, bit offset %d, remaining bits %d",
+                     bit_offset, remaining_bits);
 
         if (remaining_bits < 6)
             return PackError(EVorbisError::kIncompleteHeader, 0u);
         remaining_bits -= 6;
         std::uint8_t vorbis_floor_count = (std::uint8_t)ReadBits(6, read_position, bit_offset) + 1u;
 
-        std::cout << std::dec << "floor count " << (unsigned)vorbis_floor_count << std::endl;
-        o_setup_header.floors.resize(vorbis_floor_count);
+        VORBIS_TRACE(kTraceInfo, kTraceHeaders, "floor count %u", (unsigned)vorbis_floor_count);
+        setup_desc.floors.resize(vorbis_floor_count);
 
         for (std::uint8_t floor_index = 0u;
              floor_index < vorbis_floor_count; ++floor_index)
         {
-            VorbisFloor &floor = o_setup_header.floors[floor_index];
+            VorbisFloorDesc &floor = setup_desc.floors[floor_index];
 
             if (remaining_bits < 16)
                 return PackError(EVorbisError::kIncompleteHeader, 0u);
             remaining_bits -= 16;
             floor.type = (std::uint16_t)ReadBits(16, read_position, bit_offset);
-            std::cout << std::dec << "floor type " << (unsigned)floor.type << std::endl;
+            VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "floor type %u", (unsigned)floor.type);
 
             if (floor.type == 0u)
             {
-                floor.data = VorbisFloor::Floor0{};
-                VorbisFloor::Floor0 &floor0 = std::get<0>(floor.data);
+                floor.data = VorbisFloorDesc::Floor0{};
+                VorbisFloorDesc::Floor0 &floor0 = std::get<0>(floor.data);
 
-                std::cout << "[WARNING] floor0 detected, anything may happen" << std::endl;
+                VORBIS_TRACE(kTraceWarning, kTraceHeaders, "floor0 detected");
 
                 if (remaining_bits < 8)
                     return PackError(EVorbisError::kIncompleteHeader, 0u);
@@ -1084,12 +2213,17 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
                     remaining_bits -= 8;
                     floor0.codebooks[book_index] = (std::uint8_t)ReadBits(8, read_position, bit_offset);
                 }
+
+                if (!floor0.rate || !floor0.bark_map_size)
+                    return PackError(EVorbisError::kInvalidSetupHeader, 0u);
+
+                Floor0ComputeBarkMaps(o_id_header.blocksize_0, o_id_header.blocksize_1, floor0);
             }
 
             else if (floor.type == 1u)
             {
-                floor.data = VorbisFloor::Floor1{};
-                VorbisFloor::Floor1 &floor1 = std::get<1>(floor.data);
+                floor.data = VorbisFloorDesc::Floor1{};
+                VorbisFloorDesc::Floor1 &floor1 = std::get<1>(floor.data);
 
                 if (remaining_bits < 5)
                     return PackError(EVorbisError::kIncompleteHeader, 0u);
@@ -1115,7 +2249,7 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
                 for (int class_index = 0;
                      class_index <= maximum_class; ++class_index)
                 {
-                    VorbisFloor::Floor1::Class &floor_class = floor1.classes[class_index];
+                    VorbisFloorDesc::Floor1::Class &floor_class = floor1.classes[class_index];
 
                     if (remaining_bits < 3)
                         return PackError(EVorbisError::kIncompleteHeader, 0u);
@@ -1199,6 +2333,15 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
                     for (int j = i+1; j < floor1_value_index; ++j)
                         if (floor1.values[i] == floor1.values[j])
                             return PackError(EVorbisError::kInvalidSetupHeader, 0u);
+
+                floor1.sorted_indices.resize(floor1.value_count);
+                for (std::uint8_t i = 0u; i < floor1.value_count; ++i)
+                    floor1.sorted_indices[i] = i;
+                std::sort(floor1.sorted_indices.begin(), floor1.sorted_indices.end(),
+                          [&floor1](std::uint8_t _lhs, std::uint8_t _rhs)
+                          {
+                              return floor1.values[_lhs] < floor1.values[_rhs];
+                          });
             }
 
             else
@@ -1209,23 +2352,21 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
         // RESIDUES
         // =====================================================================
 
-        std::cout << "RESIDUES BEGIN "
-                  << std::hex << (read_position - debug_baseBuff)
-                  << " offset " << bit_offset << std::endl;
-        std::cout << "Remaining bits " << std::dec << remaining_bits << std::endl;
+        VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "residues begin, bit offset %d, remaining bits %d",
+                     bit_offset, remaining_bits);
 
         if (remaining_bits < 6)
             return PackError(EVorbisError::kIncompleteHeader, 0u);
         remaining_bits -= 6;
         std::uint8_t residue_count = 1u + (std::uint8_t)ReadBits(6, read_position, bit_offset);
 
-        std::cout << "Residue count " << std::dec << (unsigned)residue_count << std::endl;
-        o_setup_header.residues.resize(residue_count);
+        VORBIS_TRACE(kTraceInfo, kTraceHeaders, "residue count %u", (unsigned)residue_count);
+        setup_desc.residues.resize(residue_count);
 
         for (std::uint8_t residue_index = 0u;
              residue_index < residue_count; ++residue_index)
         {
-            VorbisResidue &residue = o_setup_header.residues[residue_index];
+            VorbisResidueDesc &residue = setup_desc.residues[residue_index];
 
             if (remaining_bits < 16)
                 return PackError(EVorbisError::kIncompleteHeader, 0u);
@@ -1260,23 +2401,34 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
             remaining_bits -= 8;
             residue.classbook = (std::uint8_t)ReadBits(8, read_position, bit_offset);
 
-            if (residue.classbook >= o_setup_header.codebooks.size())
+            if (residue.classbook >= setup_desc.codebooks.size())
                 return PackError(EVorbisError::kInvalidSetupHeader, 0u);
 
             {
-                VorbisCodebook const& classbook = o_setup_header.codebooks[residue.classbook];
+                VorbisCodebookDesc const& classbook = setup_desc.codebooks[residue.classbook];
                 if (std::pow((float)residue.classif_count, (float)classbook.dimensions)
                     > (float)classbook.entry_count)
                     return PackError(EVorbisError::kInvalidSetupHeader, 0u);
+
+                std::size_t const dimensions = classbook.dimensions;
+                residue.classifications.resize(classbook.entry_count * dimensions);
+                for (std::uint32_t entry_index = 0u; entry_index < classbook.entry_count; ++entry_index)
+                {
+                    std::uint32_t temp = entry_index;
+                    for (std::size_t i = dimensions; i-- > 0u;)
+                    {
+                        residue.classifications[entry_index * dimensions + i] =
+                            (std::uint8_t)(temp % residue.classif_count);
+                        temp /= residue.classif_count;
+                    }
+                }
             }
 
-            std::cout << "Residue " << std::endl
-                      << std::dec << residue.type << " "
-                      << std::dec << residue.begin << " "
-                      << std::dec << residue.end << " "
-                      << std::dec << residue.partition_size << " "
-                      << std::dec << (unsigned)residue.classif_count << " "
-                      << std::dec << (unsigned)residue.classbook << std::endl;
+            VORBIS_TRACE(kTraceVerbose, kTraceHeaders,
+                         "residue type %u, begin %u end %u, partition size %u, %u classifications, classbook %u",
+                         (unsigned)residue.type, (unsigned)residue.begin, (unsigned)residue.end,
+                         (unsigned)residue.partition_size, (unsigned)residue.classif_count,
+                         (unsigned)residue.classbook);
 
             residue.cascade.resize(residue.classif_count);
             for (std::uint8_t classif_index = 0u;
@@ -1302,15 +2454,10 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
                 }
 
                 residue.cascade[classif_index] = (high_bits << 3) | low_bits;
+                VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "residue cascade %u : %02x",
+                             (unsigned)classif_index, (unsigned)residue.cascade[classif_index]);
             }
 
-            std::cout << "Residue cascades " << std::endl;
-            std::for_each(residue.cascade.begin(), residue.cascade.end(), [](std::uint8_t const& _v)
-            {
-                std::cout << std::hex << (unsigned)_v << " ";
-            });
-            std::cout << std::endl;
-
             residue.books.resize(residue.classif_count * 8u);
             for (std::uint8_t classif_index = 0u;
                  classif_index < residue.classif_count; ++classif_index)
@@ -1325,42 +2472,36 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
 
                         if (residue_book_index >= codebook_count)
                             return PackError(EVorbisError::kInvalidSetupHeader, 0u);
-                        if (!o_setup_header.codebooks[residue_book_index].entry_count)
+                        if (!setup_desc.codebooks[residue_book_index].entry_count)
                             return PackError(EVorbisError::kInvalidSetupHeader, 0u);
 
                         residue.books[classif_index * 8u + stage_index] = residue_book_index;
+                        VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "residue book %u stage %u : %u",
+                                     (unsigned)classif_index, (unsigned)stage_index,
+                                     (unsigned)residue_book_index);
                     }
                     else
                         residue.books[classif_index * 8u + stage_index] = VorbisResidue::kUnusedBook;
-
-            std::cout << "Residue books " << std::endl;
-            std::for_each(residue.books.begin(), residue.books.end(), [](std::uint16_t const& _v)
-            {
-                std::cout << std::dec << _v << " ";
-            });
-            std::cout << std::endl;
         }
 
         // =====================================================================
         // MAPPINGS
         // =====================================================================
 
-        std::cout << "MAPPINGS BEGIN "
-                  << std::hex << (read_position - debug_baseBuff)
-                  << " offset " << bit_offset << std::endl;
-        std::cout << "Remaining bits " << std::dec << remaining_bits << std::endl;
+        VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "mappings begin, bit offset %d, remaining bits %d",
+                     bit_offset, remaining_bits);
 
         if (remaining_bits < 6)
             return PackError(EVorbisError::kIncompleteHeader, 0u);
         remaining_bits -= 6;
         std::uint8_t mapping_count = 1u + (std::uint8_t)ReadBits(6, read_position, bit_offset);
 
-        o_setup_header.mappings.resize(mapping_count);
+        setup_desc.mappings.resize(mapping_count);
 
         for (std::uint8_t mapping_index = 0u;
              mapping_index < mapping_count; ++mapping_index)
         {
-            VorbisMapping &mapping = o_setup_header.mappings[mapping_index];
+            VorbisMappingDesc &mapping = setup_desc.mappings[mapping_index];
 
             if (remaining_bits < 16)
                 return PackError(EVorbisError::kIncompleteHeader, 0u);
@@ -1392,7 +2533,7 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
             mapping.coupling_step_count = 0u;
             if (mapping.coupling_flag)
             {
-                std::cout << "coupled" << std::endl;
+                VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "coupled mapping");
 
                 if (remaining_bits < 8)
                     return PackError(EVorbisError::kIncompleteHeader, 0u);
@@ -1432,7 +2573,7 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
             if (mapping.reserved_field)
                 return PackError(EVorbisError::kInvalidSetupHeader, 0u);
 
-            std::cout << "Mapping submap count " << (unsigned)mapping.submap_count << std::endl;
+            VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "mapping submap count %u", (unsigned)mapping.submap_count);
 
             mapping.muxes.resize(o_id_header.audio_channels);
             if (mapping.submap_count > 1)
@@ -1469,7 +2610,8 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
                 remaining_bits -= 8;
                 std::uint8_t floor_index = (std::uint8_t)ReadBits(8, read_position, bit_offset);
 
-                std::cout << "Floor index " << (unsigned)floor_index << std::endl;
+                VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "submap %u floor %u",
+                             (unsigned)submap_index, (unsigned)floor_index);
                 if (floor_index >= vorbis_floor_count)
                     return PackError(EVorbisError::kInvalidSetupHeader, 0u);
 
@@ -1480,50 +2622,34 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
                 remaining_bits -= 8;
                 std::uint8_t residue_index = (std::uint8_t)ReadBits(8, read_position, bit_offset);
 
-                std::cout << "Residue index " << (unsigned)residue_index << std::endl;
+                VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "submap %u residue %u",
+                             (unsigned)submap_index, (unsigned)residue_index);
                 if (residue_index >= residue_count)
                     return PackError(EVorbisError::kInvalidSetupHeader, 0u);
 
                 mapping.submap_residues[submap_index] = residue_index;
             }
-
-            std::cout << "Mapping submap floors " << std::endl;
-            std::for_each(mapping.submap_floors.begin(), mapping.submap_floors.end(), [](std::uint16_t const& _v)
-            {
-                std::cout << std::dec << _v << " ";
-            });
-            std::cout << std::endl;
-
-
-            std::cout << "Mapping submap residues " << std::endl;
-            std::for_each(mapping.submap_residues.begin(), mapping.submap_residues.end(), [](std::uint16_t const& _v)
-            {
-                std::cout << std::dec << _v << " ";
-            });
-            std::cout << std::endl;
         }
 
         // =====================================================================
         // MODES
         // =====================================================================
 
-        std::cout << "MODES BEGIN "
-                  << std::hex << (read_position - debug_baseBuff)
-                  << " offset " << bit_offset << std::endl;
-        std::cout << "Remaining bits " << std::dec << remaining_bits << std::endl;
+        VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "modes begin, bit offset %d, remaining bits %d",
+                     bit_offset, remaining_bits);
 
         if (remaining_bits < 6)
             return PackError(EVorbisError::kIncompleteHeader, 0u);
         remaining_bits -= 6;
         std::uint8_t mode_count = 1u + (std::uint8_t)ReadBits(6, read_position, bit_offset);
 
-        std::cout << "Mode count " << (unsigned)mode_count << std::endl;
-        o_setup_header.modes.resize(mode_count);
+        VORBIS_TRACE(kTraceInfo, kTraceHeaders, "mode count %u", (unsigned)mode_count);
+        setup_desc.modes.resize(mode_count);
 
         for (std::uint8_t mode_index = 0u;
              mode_index < mode_count; ++mode_index)
         {
-            VorbisMode &mode = o_setup_header.modes[mode_index];
+            VorbisMode &mode = setup_desc.modes[mode_index];
 
             if (!remaining_bits)
                 return PackError(EVorbisError::kIncompleteHeader, 0u);
@@ -1562,7 +2688,17 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
             return PackError(EVorbisError::kInvalidSetupHeader, 0u);
 
         ReadBits(remaining_bits, read_position, bit_offset);
-        std::cout << "Final bit offset " << bit_offset << std::endl;
+        VORBIS_TRACE(kTraceVerbose, kTraceHeaders, "setup header done, bit offset %d", bit_offset);
+
+        std::shared_ptr<VorbisSetupArena> setup(new VorbisSetupArena,
+                                                [setup_hash](VorbisSetupArena const* _setup)
+                                                {
+                                                    VorbisSetupCacheRelease(setup_hash, _setup);
+                                                });
+        error_code = VorbisSetupFlatten(setup_desc, *setup);
+        if (error_code != EVorbisError::kNoError)
+            return PackError(error_code, 0u);
+        o_setup = VorbisSetupCacheInsert(setup_hash, o_id_header, packet, packet_size, std::move(setup));
 
         _page_index = page_end;
         _seg_index = seg_end;
@@ -1571,488 +2707,5263 @@ std::uint32_t VorbisHeaders(PageContainer const &_pages,
     return 0u;
 }
 
-std::uint32_t VorbisAudioDecode(PageContainer const &_pages,
-                                VorbisIDHeader const &_id,
-                                VorbisSetupHeader const &_setup,
-                                std::size_t &_page_index,
-                                std::size_t &_seg_index)
+template <typename PartitionDecoder>
+EVorbisError VorbisResiduePartitions(VorbisSetupHeader const& _setup,
+                                     VorbisResidue const& _residue,
+                                     std::uint32_t _vector_count,
+                                     std::uint8_t const* _do_not_decode,
+                                     std::uint32_t _actual_size,
+                                     std::uint8_t const* &_base_address,
+                                     int &_bit_offset,
+                                     int &_remaining_bits,
+                                     VorbisScratchArena &_scratch,
+                                     PartitionDecoder &&_decode_partition)
 {
-    EVorbisError error_code = EVorbisError::kNoError;
+    std::uint32_t const begin = std::min(_residue.begin, _actual_size);
+    std::uint32_t const end = std::min(_residue.end, _actual_size);
+    if (end <= begin)
+        return EVorbisError::kNoError;
 
-    PageDesc const& page = _pages[_page_index];
+    std::uint32_t const partitions_to_read = (end - begin) / _residue.partition_size;
+    VorbisCodebook const& classbook = _setup.codebooks[_residue.classbook];
+    std::uint32_t const classwords_per_codeword = classbook.dimensions;
+    if (!partitions_to_read || !classwords_per_codeword)
+        return EVorbisError::kNoError;
 
-    PrintPage(page);
-    std::cout << "Offset " << std::hex << debug_ComputeOffset(page, _seg_index) << std::endl;
+    std::uint32_t const classif_stride = partitions_to_read + classwords_per_codeword;
+    std::uint8_t* classifications = VorbisScratchAllocate<std::uint8_t>(_scratch,
+                                                                         _vector_count * classif_stride);
+    if (!classifications)
+        return EVorbisError::kInvalidStream;
 
-    if (_seg_index) { int* i = nullptr; *i = 0; }
-    std::uint8_t const* read_position = page.stream_begin;
-    int bit_offset = 0;
+    for (std::uint32_t pass = 0u; pass < 8u; ++pass)
+    {
+        std::uint32_t partition_count = 0u;
+        while (partition_count < partitions_to_read)
+        {
+            if (pass == 0u)
+            {
+                for (std::uint32_t j = 0u; j < _vector_count; ++j)
+                {
+                    if (_do_not_decode[j])
+                        continue;
+
+                    std::uint32_t temp = 0u;
+                    if (!VorbisReadEntry(classbook, _base_address, _bit_offset, _remaining_bits, temp))
+                        return EVorbisError::kNoError;
+
+                    std::uint8_t const* digits = &_residue.classifications[temp * classwords_per_codeword];
+                    std::copy(digits, digits + classwords_per_codeword,
+                              &classifications[j * classif_stride + partition_count]);
+                }
+            }
+
+            for (std::uint32_t i = 0u;
+                 i < classwords_per_codeword && partition_count < partitions_to_read;
+                 ++i, ++partition_count)
+            {
+                for (std::uint32_t j = 0u; j < _vector_count; ++j)
+                {
+                    if (_do_not_decode[j])
+                        continue;
 
-    std::size_t packet_size = 1;
-    while (packet_size == 1)
+                    std::uint8_t const vqclass = classifications[j * classif_stride + partition_count];
+                    std::uint16_t const vqbook = _residue.books[vqclass * 8u + pass];
+                    if (vqbook == VorbisResidue::kUnusedBook)
+                        continue;
+
+                    std::uint32_t const offset = begin + partition_count * _residue.partition_size;
+                    if (!_decode_partition(_setup.codebooks[vqbook], j, offset))
+                        return EVorbisError::kNoError;
+                }
+            }
+        }
+    }
+
+    return EVorbisError::kNoError;
+}
+
+// Residue type 2 partitions are laid out in an interleaved vector of
+// _channel_count * n values; they are scattered straight into the planar
+// channel vectors instead. kChannels == 0 selects the runtime channel count.
+template <std::uint32_t kChannels>
+bool VorbisResidue2Partition(VorbisCodebook const& _codebook,
+                             float* const* _vectors,
+                             std::uint32_t _channel_count,
+                             std::uint32_t _offset,
+                             std::uint32_t _partition_size,
+                             std::uint8_t const* &_base_address,
+                             int &_bit_offset,
+                             int &_remaining_bits)
+{
+    std::uint32_t const channel_count = kChannels ? kChannels : _channel_count;
+    std::uint32_t const dimensions = _codebook.dimensions;
+    std::uint32_t channel = _offset % channel_count;
+    std::uint32_t position = _offset / channel_count;
+
+    for (std::uint32_t i = 0u; i < _partition_size; i += dimensions)
     {
-        std::size_t page_end, seg_end;
-        error_code = ComputePacketSize(_pages, _page_index, _seg_index,
-                                       packet_size, page_end, seg_end);
-        if (error_code != EVorbisError::kNoError)
-            return PackError(error_code, 0u);
+        std::uint32_t entry = 0u;
+        if (!VorbisReadEntry(_codebook, _base_address, _bit_offset, _remaining_bits, entry))
+            return false;
 
-        if (packet_size == 1)
+        float const* values = &_codebook.vq_values[entry * dimensions];
+        std::uint32_t const count = std::min(dimensions, _partition_size - i);
+        for (std::uint32_t d = 0u; d < count; ++d)
         {
-            _page_index = page_end;
-            _seg_index = seg_end;
+            _vectors[channel][position] += values[d];
+            if (++channel == channel_count)
+            {
+                channel = 0u;
+                ++position;
+            }
         }
     }
 
-    std::cout << "Packet size " << packet_size << std::endl;
-
-    int remaining_bits = packet_size * 8;
+    return true;
+}
 
-    if (!remaining_bits)
-        return PackError(EVorbisError::kInvalidStream, FInvalidStream::kEndOfPacket);
-    --remaining_bits;
-    std::uint32_t packet_type = ReadBits(1, read_position, bit_offset);
-    if (packet_type)
-        return PackError(EVorbisError::kInvalidStream, FInvalidStream::kUnexpectedNonAudioPacket);
+// Decodes one submap worth of residue into _vector_count planar vectors of
+// _n values each. End of packet is not an error, decoded values are kept.
+// Vectors flagged in _do_not_decode are not written at all, except for type 2
+// where any decoded channel forces the whole interleaved vector.
+EVorbisError VorbisResidueDecode(VorbisSetupHeader const& _setup,
+                                 VorbisResidue const& _residue,
+                                 float* const* _vectors,
+                                 std::uint8_t const* _do_not_decode,
+                                 std::uint32_t _vector_count,
+                                 std::uint32_t _n,
+                                 std::uint8_t const* &_base_address,
+                                 int &_bit_offset,
+                                 int &_remaining_bits,
+                                 VorbisScratchArena &_scratch)
+{
+    std::uint32_t const partition_size = _residue.partition_size;
+    auto const has_vq = [](VorbisCodebook const& _codebook)
+    {
+        return !_codebook.vq_values.empty();
+    };
 
-    unsigned bits_read = ilog(_setup.modes.size() - 1u);
-    if (remaining_bits < bits_read)
-        return PackError(EVorbisError::kInvalidStream, FInvalidStream::kEndOfPacket);
-    remaining_bits -= bits_read;
-    std::uint32_t mode_index = ReadBits(bits_read, read_position, bit_offset);
-    std::cout << "Mode index " << mode_index << std::endl;
+    if (_residue.type == 2u)
+    {
+        if (std::all_of(_do_not_decode, _do_not_decode + _vector_count,
+                        [](std::uint8_t _v) { return _v != 0u; }))
+            return EVorbisError::kNoError;
 
-    VorbisMode const& mode = _setup.modes[mode_index];
+        for (std::uint32_t j = 0u; j < _vector_count; ++j)
+            std::fill(_vectors[j], _vectors[j] + _n, 0.f);
 
-    std::uint32_t blocksize = !mode.blockflag ?
-        1u << _id.blocksize_0 :
-        1u << _id.blocksize_1;
-    std::cout << "Blocksize " << std::dec << (unsigned)blocksize << std::endl;
+        std::uint8_t const decode_flag = 0u;
+        auto const decode = [&](auto _channels)
+        {
+            return VorbisResiduePartitions(
+                _setup, _residue, 1u, &decode_flag, _vector_count * _n,
+                _base_address, _bit_offset, _remaining_bits, _scratch,
+                [&](VorbisCodebook const& _codebook, std::uint32_t, std::uint32_t _offset)
+                {
+                    if (!has_vq(_codebook))
+                        return false;
+                    return VorbisResidue2Partition<decltype(_channels)::value>(
+                        _codebook, _vectors, _vector_count, _offset, partition_size,
+                        _base_address, _bit_offset, _remaining_bits);
+                });
+        };
 
-    // =========================================================================
-    // WINDOW PARAMETERS
-    // =========================================================================
+        if (_vector_count == 2u)
+            return decode(std::integral_constant<std::uint32_t, 2u>{});
+        if (_vector_count == 6u)
+            return decode(std::integral_constant<std::uint32_t, 6u>{});
+        return decode(std::integral_constant<std::uint32_t, 0u>{});
+    }
 
-    bool vorbis_mode_blockflag = mode.blockflag;
-    bool previous_window_flag = false;
-    bool next_window_flag = false;
+    for (std::uint32_t j = 0u; j < _vector_count; ++j)
+        if (!_do_not_decode[j])
+            std::fill(_vectors[j], _vectors[j] + _n, 0.f);
 
-    if (!mode.blockflag)
+    if (_residue.type == 0u)
     {
-        if (remaining_bits < 2)
-            return PackError(EVorbisError::kInvalidStream, FInvalidStream::kEndOfPacket);
-        remaining_bits -= 2;
+        return VorbisResiduePartitions(
+            _setup, _residue, _vector_count, _do_not_decode, _n,
+            _base_address, _bit_offset, _remaining_bits, _scratch,
+            [&](VorbisCodebook const& _codebook, std::uint32_t _j, std::uint32_t _offset)
+            {
+                if (!has_vq(_codebook))
+                    return false;
 
-        previous_window_flag = ReadBits(1, read_position, bit_offset);
-        next_window_flag = ReadBits(1, read_position, bit_offset);
-        std::cout << "Previous window " << (int)previous_window_flag << std::endl;
-        std::cout << "Next window " << (int)next_window_flag << std::endl;
+                std::uint32_t const dimensions = _codebook.dimensions;
+                std::uint32_t const step = partition_size / dimensions;
+                float* vector = _vectors[_j] + _offset;
+                for (std::uint32_t j = 0u; j < step; ++j)
+                {
+                    std::uint32_t entry = 0u;
+                    if (!VorbisReadEntry(_codebook, _base_address, _bit_offset, _remaining_bits, entry))
+                        return false;
+
+                    float const* values = &_codebook.vq_values[entry * dimensions];
+                    for (std::uint32_t i = 0u; i < dimensions; ++i)
+                        vector[j + i * step] += values[i];
+                }
+                return true;
+            });
     }
 
-    std::uint32_t window_center = blocksize / 2;
+    return VorbisResiduePartitions(
+        _setup, _residue, _vector_count, _do_not_decode, _n,
+        _base_address, _bit_offset, _remaining_bits, _scratch,
+        [&](VorbisCodebook const& _codebook, std::uint32_t _j, std::uint32_t _offset)
+        {
+            if (!has_vq(_codebook))
+                return false;
+
+            std::uint32_t const dimensions = _codebook.dimensions;
+            float* vector = _vectors[_j] + _offset;
+            for (std::uint32_t i = 0u; i < partition_size; i += dimensions)
+            {
+                std::uint32_t entry = 0u;
+                if (!VorbisReadEntry(_codebook, _base_address, _bit_offset, _remaining_bits, entry))
+                    return false;
+
+                float const* values = &_codebook.vq_values[entry * dimensions];
+                std::uint32_t const count = std::min(dimensions, partition_size - i);
+                for (std::uint32_t d = 0u; d < count; ++d)
+                    vector[i + d] += values[d];
+            }
+            return true;
+        });
+}
 
-    std::uint32_t left_window_start = 0u;
-    std::uint32_t left_window_end = window_center;
-    if (vorbis_mode_blockflag && !previous_window_flag)
+// Branch-free form of the spec's four-way decoupling :
+//   t = (m > 0) ? a : -a
+//   a > 0  : M = m,     A = m - t
+//   a <= 0 : M = m + t, A = m
+void VorbisInverseCouplingScalar(float* _magnitude,
+                                 float* _angle,
+                                 std::uint32_t _n)
+{
+    for (std::uint32_t j = 0u; j < _n; ++j)
     {
-        left_window_start = blocksize / 4 - _id.blocksize_0 / 4;
-        left_window_end = blocksize / 4 + _id.blocksize_0 / 4;
+        float const m = _magnitude[j];
+        float const a = _angle[j];
+        float const t = (m > 0.f) ? a : -a;
+        bool const a_positive = (a > 0.f);
+        _magnitude[j] = a_positive ? m : m + t;
+        _angle[j] = a_positive ? m - t : m;
     }
+}
+
+#if VORBIS_X86
+VORBIS_TARGET("sse2")
+void VorbisInverseCouplingSse2(float* _magnitude,
+                               float* _angle,
+                               std::uint32_t _n)
+{
+    assert(!((std::uintptr_t)_magnitude & 15u) && !((std::uintptr_t)_angle & 15u));
 
-    std::uint32_t right_window_start = window_center;
-    std::uint32_t right_window_end = blocksize;
-    if (vorbis_mode_blockflag && !next_window_flag)
+    std::uint32_t j = 0u;
+    __m128 const zero = _mm_setzero_ps();
+    __m128 const sign_bit = _mm_set1_ps(-0.f);
+    for (; j + 4u <= _n; j += 4u)
     {
-        right_window_start = blocksize*3 / 4 - _id.blocksize_0 / 4;
-        right_window_end = blocksize*3 / 4 + _id.blocksize_0 / 4;
+        __m128 const m = _mm_load_ps(_magnitude + j);
+        __m128 const a = _mm_load_ps(_angle + j);
+
+        __m128 const m_positive = _mm_cmpgt_ps(m, zero);
+        __m128 const a_positive = _mm_cmpgt_ps(a, zero);
+        __m128 const t = _mm_xor_ps(a, _mm_andnot_ps(m_positive, sign_bit));
+
+        __m128 const sum = _mm_add_ps(m, t);
+        __m128 const diff = _mm_sub_ps(m, t);
+
+        _mm_store_ps(_magnitude + j, _mm_or_ps(_mm_and_ps(a_positive, m),
+                                               _mm_andnot_ps(a_positive, sum)));
+        _mm_store_ps(_angle + j, _mm_or_ps(_mm_and_ps(a_positive, diff),
+                                           _mm_andnot_ps(a_positive, m)));
     }
+    VorbisInverseCouplingScalar(_magnitude + j, _angle + j, _n - j);
+}
 
-    std::cout << "Window " << std::endl;
-    std::cout << blocksize << std::endl;
-    std::cout << "[";
-    for (std::uint32_t i = 0u; i < blocksize; ++i)
+VORBIS_TARGET("avx2")
+void VorbisInverseCouplingAvx2(float* _magnitude,
+                               float* _angle,
+                               std::uint32_t _n)
+{
+    std::uint32_t j = 0u;
+    __m256 const zero = _mm256_setzero_ps();
+    __m256 const sign_bit = _mm256_set1_ps(-0.f);
+    for (; j + 8u <= _n; j += 8u)
     {
-        std::cout << WindowEval(i, left_window_start, left_window_end, right_window_start, right_window_end)
-                  << ", ";
+        __m256 const m = _mm256_loadu_ps(_magnitude + j);
+        __m256 const a = _mm256_loadu_ps(_angle + j);
+
+        __m256 const m_positive = _mm256_cmp_ps(m, zero, _CMP_GT_OQ);
+        __m256 const a_positive = _mm256_cmp_ps(a, zero, _CMP_GT_OQ);
+        __m256 const t = _mm256_xor_ps(a, _mm256_andnot_ps(m_positive, sign_bit));
+
+        __m256 const sum = _mm256_add_ps(m, t);
+        __m256 const diff = _mm256_sub_ps(m, t);
+
+        _mm256_storeu_ps(_magnitude + j, _mm256_blendv_ps(sum, m, a_positive));
+        _mm256_storeu_ps(_angle + j, _mm256_blendv_ps(m, diff, a_positive));
     }
-    std::cout << std::endl;
+    VorbisInverseCouplingScalar(_magnitude + j, _angle + j, _n - j);
+}
 
-    std::cout << "Remaining bits " << remaining_bits << std::endl;
+VORBIS_TARGET("avx512f")
+void VorbisInverseCouplingAvx512(float* _magnitude,
+                                 float* _angle,
+                                 std::uint32_t _n)
+{
+    std::uint32_t j = 0u;
+    __m512 const zero = _mm512_setzero_ps();
+    __m512i const sign_bit = _mm512_set1_epi32(INT32_MIN);
+    for (; j + 16u <= _n; j += 16u)
+    {
+        __m512 const m = _mm512_loadu_ps(_magnitude + j);
+        __m512 const a = _mm512_loadu_ps(_angle + j);
 
-    // =========================================================================
-    // FLOOR CURVE
-    // =========================================================================
+        __mmask16 const m_positive = _mm512_cmp_ps_mask(m, zero, _CMP_GT_OQ);
+        __mmask16 const a_positive = _mm512_cmp_ps_mask(a, zero, _CMP_GT_OQ);
+        __m512i const a_bits = _mm512_castps_si512(a);
+        __m512 const t = _mm512_castsi512_ps(
+            _mm512_mask_xor_epi32(a_bits, (__mmask16)~m_positive, a_bits, sign_bit));
 
-    VorbisMapping const& mapping = _setup.mappings[mode.mapping];
+        __m512 const sum = _mm512_add_ps(m, t);
+        __m512 const diff = _mm512_sub_ps(m, t);
 
-    while (remaining_bits) {
+        _mm512_storeu_ps(_magnitude + j, _mm512_mask_blend_ps(a_positive, sum, m));
+        _mm512_storeu_ps(_angle + j, _mm512_mask_blend_ps(a_positive, m, diff));
+    }
+    VorbisInverseCouplingScalar(_magnitude + j, _angle + j, _n - j);
+}
+#endif
 
-    for (unsigned i = 0; i < _id.audio_channels; ++i)
+#if defined(__ARM_NEON)
+void VorbisInverseCouplingNeon(float* _magnitude,
+                               float* _angle,
+                               std::uint32_t _n)
+{
+    std::uint32_t j = 0u;
+    float32x4_t const zero = vdupq_n_f32(0.f);
+    uint32x4_t const sign_bit = vdupq_n_u32(0x80000000u);
+    for (; j + 4u <= _n; j += 4u)
     {
-        std::uint8_t const submap_index = mapping.muxes[i];
-        std::uint8_t const floor_index = mapping.submap_floors[submap_index];
-        VorbisFloor const& floor_container = _setup.floors[floor_index];
+        float32x4_t const m = vld1q_f32(_magnitude + j);
+        float32x4_t const a = vld1q_f32(_angle + j);
 
-        bool unused = false;
-        // according to floor.type, call the appropriate floor decode function
-        switch (floor_container.type)
-        {
-        case 0:
-        {
-            VorbisFloor::Floor0 const& floor = std::get<0>(floor_container.data);
+        uint32x4_t const m_positive = vcgtq_f32(m, zero);
+        uint32x4_t const a_positive = vcgtq_f32(a, zero);
+        float32x4_t const t = vreinterpretq_f32_u32(
+            veorq_u32(vreinterpretq_u32_f32(a), vbicq_u32(sign_bit, m_positive)));
 
-            if (remaining_bits < floor.amplitude_bits)
-                return PackError(EVorbisError::kInvalidStream, FInvalidStream::kEndOfPacket);
-            std::uint32_t amplitude = ReadBits(floor.amplitude_bits, read_position, remaining_bits);
-            remaining_bits -= floor.amplitude_bits;
+        float32x4_t const sum = vaddq_f32(m, t);
+        float32x4_t const diff = vsubq_f32(m, t);
 
-            if (amplitude)
-            {
-                //std::vector<> coefficients;
-                unsigned bit_count = ilog(floor.book_count);
-                if (remaining_bits < bit_count)
-                    return PackError(EVorbisError::kInvalidStream, FInvalidStream::kEndOfPacket);
-                std::uint32_t book_index = ReadBits(bit_count, read_position, remaining_bits);
-                remaining_bits -= bit_count;
+        vst1q_f32(_magnitude + j, vbslq_f32(a_positive, m, sum));
+        vst1q_f32(_angle + j, vbslq_f32(a_positive, diff, m));
+    }
+    VorbisInverseCouplingScalar(_magnitude + j, _angle + j, _n - j);
+}
+#endif
 
-                if (book_index >= _setup.codebooks.size())
-                    return PackError(EVorbisError::kInvalidStream, FInvalidStream::kUndecodablePacket);
+// =============================================================================
+// INVERSE MDCT
+// =============================================================================
 
-                std::cout << "Offset " << std::hex << debug_ComputeOffset(page, _seg_index) + (read_position - &page.segment_table[_seg_index]) << std::endl;
-            }
-        } break;
+std::unique_ptr<VorbisMdct> VorbisBuildMdct(unsigned _log2_n)
+{
+    std::unique_ptr<VorbisMdct> result = std::make_unique<VorbisMdct>();
+    VorbisMdct &mdct = *result;
+
+    double const kPi = 3.14159265358979323846;
+    std::uint32_t const n = 1u << _log2_n;
+    std::uint32_t const n4 = n / 4u;
+    unsigned const fft_log2 = _log2_n - 2u;
+
+    mdct.n = n;
+    mdct.twiddle_re.resize(n4);
+    mdct.twiddle_im.resize(n4);
+    mdct.bit_reverse.resize(n4);
+    for (std::uint32_t j = 0u; j < n4; ++j)
+    {
+        double const angle = 2. * kPi / n * (j + .125);
+        mdct.twiddle_re[j] = (float)std::cos(angle);
+        mdct.twiddle_im[j] = (float)std::sin(angle);
+        mdct.bit_reverse[j] = bit_reverse(j, fft_log2);
+    }
 
-        case 1:
+    for (std::uint32_t h = (fft_log2 & 1u) ? 2u : 1u; h < n4; h *= 4u)
+    {
+        std::size_t const offset = mdct.stage_twiddles.size();
+        mdct.stage_twiddles.resize(offset + 4u * h);
+        for (std::uint32_t j = 0u; j < h; ++j)
         {
-            VorbisFloor::Floor1 const& floor = std::get<1>(floor_container.data);
+            double const angle = 2. * kPi * j / (4. * h);
+            mdct.stage_twiddles[offset + j] = (float)std::cos(2. * angle);
+            mdct.stage_twiddles[offset + h + j] = (float)std::sin(2. * angle);
+            mdct.stage_twiddles[offset + 2u * h + j] = (float)std::cos(angle);
+            mdct.stage_twiddles[offset + 3u * h + j] = (float)std::sin(angle);
+        }
+    }
 
-            bool nonzero = false;
-            if (remaining_bits)
+    return result;
+}
+
+// Read-only transform and window tables shared by every decoder in the
+// process. Each entry is built on first use under its own once flag, so
+// concurrent opens never build a table twice nor wait on unrelated ones.
+struct VorbisTableRegistry
+{
+    std::once_flag mdct_once[14];
+    std::unique_ptr<VorbisMdct const> mdct[14];
+    std::once_flag windows_once[14][14];
+    std::unique_ptr<VorbisWindows const> windows[14][14];
+};
+
+VorbisTableRegistry& VorbisGetTableRegistry()
+{
+    static VorbisTableRegistry s_registry;
+    return s_registry;
+}
+
+// Tables are built on first use and shared by every stream with that blocksize.
+VorbisMdct const& VorbisGetMdct(unsigned _log2_n)
+{
+    assert(_log2_n >= 6u && _log2_n <= 13u);
+    VorbisTableRegistry &registry = VorbisGetTableRegistry();
+
+    std::call_once(registry.mdct_once[_log2_n],
+                   [&]() { registry.mdct[_log2_n] = VorbisBuildMdct(_log2_n); });
+    return *registry.mdct[_log2_n];
+}
+
+// One radix-4 stage of VorbisInverseFft : two radix-2 layers fused, h points
+// apart then 2h points apart, over every group of 4h points.
+void VorbisFftPassScalar(float* _re,
+                         float* _im,
+                         std::uint32_t _size,
+                         std::uint32_t _h,
+                         float const* _twiddles)
+{
+    float const* t1_re = _twiddles;
+    float const* t1_im = _twiddles + _h;
+    float const* t2_re = _twiddles + 2u * _h;
+    float const* t2_im = _twiddles + 3u * _h;
+
+    for (std::uint32_t base = 0u; base < _size; base += 4u * _h)
+    {
+        float* re0 = _re + base; float* im0 = _im + base;
+        float* re1 = re0 + _h; float* im1 = im0 + _h;
+        float* re2 = re1 + _h; float* im2 = im1 + _h;
+        float* re3 = re2 + _h; float* im3 = im2 + _h;
+
+        for (std::uint32_t j = 0u; j < _h; ++j)
+        {
+            float const m1r = re1[j] * t1_re[j] - im1[j] * t1_im[j];
+            float const m1i = re1[j] * t1_im[j] + im1[j] * t1_re[j];
+            float const m3r = re3[j] * t1_re[j] - im3[j] * t1_im[j];
+            float const m3i = re3[j] * t1_im[j] + im3[j] * t1_re[j];
+            float const b0r = re0[j] + m1r, b0i = im0[j] + m1i;
+            float const b1r = re0[j] - m1r, b1i = im0[j] - m1i;
+            float const b2r = re2[j] + m3r, b2i = im2[j] + m3i;
+            float const b3r = re2[j] - m3r, b3i = im2[j] - m3i;
+
+            float const m2r = b2r * t2_re[j] - b2i * t2_im[j];
+            float const m2i = b2r * t2_im[j] + b2i * t2_re[j];
+            // i * (b3 * W_4h^j) = (-im, re)
+            float const n3r = b3r * t2_im[j] + b3i * t2_re[j];
+            float const n3i = b3r * t2_re[j] - b3i * t2_im[j];
+
+            re0[j] = b0r + m2r; im0[j] = b0i + m2i;
+            re2[j] = b0r - m2r; im2[j] = b0i - m2i;
+            re1[j] = b1r - n3r; im1[j] = b1i + n3i;
+            re3[j] = b1r + n3r; im3[j] = b1i - n3i;
+        }
+    }
+}
+
+#if VORBIS_X86
+VORBIS_TARGET("sse2")
+void VorbisFftPassSse2(float* _re,
+                       float* _im,
+                       std::uint32_t _size,
+                       std::uint32_t _h,
+                       float const* _twiddles)
+{
+    if (_h < 4u)
+        return VorbisFftPassScalar(_re, _im, _size, _h, _twiddles);
+
+    float const* t1_re = _twiddles;
+    float const* t1_im = _twiddles + _h;
+    float const* t2_re = _twiddles + 2u * _h;
+    float const* t2_im = _twiddles + 3u * _h;
+
+    for (std::uint32_t base = 0u; base < _size; base += 4u * _h)
+    {
+        float* re0 = _re + base; float* im0 = _im + base;
+        float* re1 = re0 + _h; float* im1 = im0 + _h;
+        float* re2 = re1 + _h; float* im2 = im1 + _h;
+        float* re3 = re2 + _h; float* im3 = im2 + _h;
+
+        for (std::uint32_t j = 0u; j + 4u <= _h; j += 4u)
+        {
+            __m128 const w1r = _mm_load_ps(t1_re + j), w1i = _mm_load_ps(t1_im + j);
+            __m128 const w2r = _mm_load_ps(t2_re + j), w2i = _mm_load_ps(t2_im + j);
+            __m128 const a0r = _mm_load_ps(re0 + j), a0i = _mm_load_ps(im0 + j);
+            __m128 const a1r = _mm_load_ps(re1 + j), a1i = _mm_load_ps(im1 + j);
+            __m128 const a2r = _mm_load_ps(re2 + j), a2i = _mm_load_ps(im2 + j);
+            __m128 const a3r = _mm_load_ps(re3 + j), a3i = _mm_load_ps(im3 + j);
+
+            // first radix-2 layer, W_2h^j
+            __m128 const m1r = _mm_sub_ps(_mm_mul_ps(a1r, w1r), _mm_mul_ps(a1i, w1i));
+            __m128 const m1i = _mm_add_ps(_mm_mul_ps(a1r, w1i), _mm_mul_ps(a1i, w1r));
+            __m128 const m3r = _mm_sub_ps(_mm_mul_ps(a3r, w1r), _mm_mul_ps(a3i, w1i));
+            __m128 const m3i = _mm_add_ps(_mm_mul_ps(a3r, w1i), _mm_mul_ps(a3i, w1r));
+            __m128 const b0r = _mm_add_ps(a0r, m1r), b0i = _mm_add_ps(a0i, m1i);
+            __m128 const b1r = _mm_sub_ps(a0r, m1r), b1i = _mm_sub_ps(a0i, m1i);
+            __m128 const b2r = _mm_add_ps(a2r, m3r), b2i = _mm_add_ps(a2i, m3i);
+            __m128 const b3r = _mm_sub_ps(a2r, m3r), b3i = _mm_sub_ps(a2i, m3i);
+
+            // second radix-2 layer, W_4h^j and i * W_4h^j
+            __m128 const m2r = _mm_sub_ps(_mm_mul_ps(b2r, w2r), _mm_mul_ps(b2i, w2i));
+            __m128 const m2i = _mm_add_ps(_mm_mul_ps(b2r, w2i), _mm_mul_ps(b2i, w2r));
+            __m128 const n3r = _mm_add_ps(_mm_mul_ps(b3r, w2i), _mm_mul_ps(b3i, w2r));
+            __m128 const n3i = _mm_sub_ps(_mm_mul_ps(b3r, w2r), _mm_mul_ps(b3i, w2i));
+
+            _mm_store_ps(re0 + j, _mm_add_ps(b0r, m2r)); _mm_store_ps(im0 + j, _mm_add_ps(b0i, m2i));
+            _mm_store_ps(re2 + j, _mm_sub_ps(b0r, m2r)); _mm_store_ps(im2 + j, _mm_sub_ps(b0i, m2i));
+            _mm_store_ps(re1 + j, _mm_sub_ps(b1r, n3r)); _mm_store_ps(im1 + j, _mm_add_ps(b1i, n3i));
+            _mm_store_ps(re3 + j, _mm_add_ps(b1r, n3r)); _mm_store_ps(im3 + j, _mm_sub_ps(b1i, n3i));
+        }
+    }
+}
+
+VORBIS_TARGET("avx2")
+void VorbisFftPassAvx2(float* _re,
+                       float* _im,
+                       std::uint32_t _size,
+                       std::uint32_t _h,
+                       float const* _twiddles)
+{
+    if (_h < 8u)
+        return VorbisFftPassSse2(_re, _im, _size, _h, _twiddles);
+
+    float const* t1_re = _twiddles;
+    float const* t1_im = _twiddles + _h;
+    float const* t2_re = _twiddles + 2u * _h;
+    float const* t2_im = _twiddles + 3u * _h;
+
+    for (std::uint32_t base = 0u; base < _size; base += 4u * _h)
+    {
+        float* re0 = _re + base; float* im0 = _im + base;
+        float* re1 = re0 + _h; float* im1 = im0 + _h;
+        float* re2 = re1 + _h; float* im2 = im1 + _h;
+        float* re3 = re2 + _h; float* im3 = im2 + _h;
+
+        for (std::uint32_t j = 0u; j + 8u <= _h; j += 8u)
+        {
+            __m256 const w1r = _mm256_loadu_ps(t1_re + j), w1i = _mm256_loadu_ps(t1_im + j);
+            __m256 const w2r = _mm256_loadu_ps(t2_re + j), w2i = _mm256_loadu_ps(t2_im + j);
+            __m256 const a0r = _mm256_loadu_ps(re0 + j), a0i = _mm256_loadu_ps(im0 + j);
+            __m256 const a1r = _mm256_loadu_ps(re1 + j), a1i = _mm256_loadu_ps(im1 + j);
+            __m256 const a2r = _mm256_loadu_ps(re2 + j), a2i = _mm256_loadu_ps(im2 + j);
+            __m256 const a3r = _mm256_loadu_ps(re3 + j), a3i = _mm256_loadu_ps(im3 + j);
+
+            // first radix-2 layer, W_2h^j
+            __m256 const m1r = _mm256_sub_ps(_mm256_mul_ps(a1r, w1r), _mm256_mul_ps(a1i, w1i));
+            __m256 const m1i = _mm256_add_ps(_mm256_mul_ps(a1r, w1i), _mm256_mul_ps(a1i, w1r));
+            __m256 const m3r = _mm256_sub_ps(_mm256_mul_ps(a3r, w1r), _mm256_mul_ps(a3i, w1i));
+            __m256 const m3i = _mm256_add_ps(_mm256_mul_ps(a3r, w1i), _mm256_mul_ps(a3i, w1r));
+            __m256 const b0r = _mm256_add_ps(a0r, m1r), b0i = _mm256_add_ps(a0i, m1i);
+            __m256 const b1r = _mm256_sub_ps(a0r, m1r), b1i = _mm256_sub_ps(a0i, m1i);
+            __m256 const b2r = _mm256_add_ps(a2r, m3r), b2i = _mm256_add_ps(a2i, m3i);
+            __m256 const b3r = _mm256_sub_ps(a2r, m3r), b3i = _mm256_sub_ps(a2i, m3i);
+
+            // second radix-2 layer, W_4h^j and i * W_4h^j
+            __m256 const m2r = _mm256_sub_ps(_mm256_mul_ps(b2r, w2r), _mm256_mul_ps(b2i, w2i));
+            __m256 const m2i = _mm256_add_ps(_mm256_mul_ps(b2r, w2i), _mm256_mul_ps(b2i, w2r));
+            __m256 const n3r = _mm256_add_ps(_mm256_mul_ps(b3r, w2i), _mm256_mul_ps(b3i, w2r));
+            __m256 const n3i = _mm256_sub_ps(_mm256_mul_ps(b3r, w2r), _mm256_mul_ps(b3i, w2i));
+
+            _mm256_storeu_ps(re0 + j, _mm256_add_ps(b0r, m2r)); _mm256_storeu_ps(im0 + j, _mm256_add_ps(b0i, m2i));
+            _mm256_storeu_ps(re2 + j, _mm256_sub_ps(b0r, m2r)); _mm256_storeu_ps(im2 + j, _mm256_sub_ps(b0i, m2i));
+            _mm256_storeu_ps(re1 + j, _mm256_sub_ps(b1r, n3r)); _mm256_storeu_ps(im1 + j, _mm256_add_ps(b1i, n3i));
+            _mm256_storeu_ps(re3 + j, _mm256_add_ps(b1r, n3r)); _mm256_storeu_ps(im3 + j, _mm256_sub_ps(b1i, n3i));
+        }
+    }
+}
+
+VORBIS_TARGET("avx512f")
+void VorbisFftPassAvx512(float* _re,
+                         float* _im,
+                         std::uint32_t _size,
+                         std::uint32_t _h,
+                         float const* _twiddles)
+{
+    if (_h < 16u)
+        return VorbisFftPassAvx2(_re, _im, _size, _h, _twiddles);
+
+    float const* t1_re = _twiddles;
+    float const* t1_im = _twiddles + _h;
+    float const* t2_re = _twiddles + 2u * _h;
+    float const* t2_im = _twiddles + 3u * _h;
+
+    for (std::uint32_t base = 0u; base < _size; base += 4u * _h)
+    {
+        float* re0 = _re + base; float* im0 = _im + base;
+        float* re1 = re0 + _h; float* im1 = im0 + _h;
+        float* re2 = re1 + _h; float* im2 = im1 + _h;
+        float* re3 = re2 + _h; float* im3 = im2 + _h;
+
+        for (std::uint32_t j = 0u; j + 16u <= _h; j += 16u)
+        {
+            __m512 const w1r = _mm512_loadu_ps(t1_re + j), w1i = _mm512_loadu_ps(t1_im + j);
+            __m512 const w2r = _mm512_loadu_ps(t2_re + j), w2i = _mm512_loadu_ps(t2_im + j);
+            __m512 const a0r = _mm512_loadu_ps(re0 + j), a0i = _mm512_loadu_ps(im0 + j);
+            __m512 const a1r = _mm512_loadu_ps(re1 + j), a1i = _mm512_loadu_ps(im1 + j);
+            __m512 const a2r = _mm512_loadu_ps(re2 + j), a2i = _mm512_loadu_ps(im2 + j);
+            __m512 const a3r = _mm512_loadu_ps(re3 + j), a3i = _mm512_loadu_ps(im3 + j);
+
+            // first radix-2 layer, W_2h^j
+            __m512 const m1r = _mm512_sub_ps(_mm512_mul_ps(a1r, w1r), _mm512_mul_ps(a1i, w1i));
+            __m512 const m1i = _mm512_add_ps(_mm512_mul_ps(a1r, w1i), _mm512_mul_ps(a1i, w1r));
+            __m512 const m3r = _mm512_sub_ps(_mm512_mul_ps(a3r, w1r), _mm512_mul_ps(a3i, w1i));
+            __m512 const m3i = _mm512_add_ps(_mm512_mul_ps(a3r, w1i), _mm512_mul_ps(a3i, w1r));
+            __m512 const b0r = _mm512_add_ps(a0r, m1r), b0i = _mm512_add_ps(a0i, m1i);
+            __m512 const b1r = _mm512_sub_ps(a0r, m1r), b1i = _mm512_sub_ps(a0i, m1i);
+            __m512 const b2r = _mm512_add_ps(a2r, m3r), b2i = _mm512_add_ps(a2i, m3i);
+            __m512 const b3r = _mm512_sub_ps(a2r, m3r), b3i = _mm512_sub_ps(a2i, m3i);
+
+            // second radix-2 layer, W_4h^j and i * W_4h^j
+            __m512 const m2r = _mm512_sub_ps(_mm512_mul_ps(b2r, w2r), _mm512_mul_ps(b2i, w2i));
+            __m512 const m2i = _mm512_add_ps(_mm512_mul_ps(b2r, w2i), _mm512_mul_ps(b2i, w2r));
+            __m512 const n3r = _mm512_add_ps(_mm512_mul_ps(b3r, w2i), _mm512_mul_ps(b3i, w2r));
+            __m512 const n3i = _mm512_sub_ps(_mm512_mul_ps(b3r, w2r), _mm512_mul_ps(b3i, w2i));
+
+            _mm512_storeu_ps(re0 + j, _mm512_add_ps(b0r, m2r)); _mm512_storeu_ps(im0 + j, _mm512_add_ps(b0i, m2i));
+            _mm512_storeu_ps(re2 + j, _mm512_sub_ps(b0r, m2r)); _mm512_storeu_ps(im2 + j, _mm512_sub_ps(b0i, m2i));
+            _mm512_storeu_ps(re1 + j, _mm512_sub_ps(b1r, n3r)); _mm512_storeu_ps(im1 + j, _mm512_add_ps(b1i, n3i));
+            _mm512_storeu_ps(re3 + j, _mm512_add_ps(b1r, n3r)); _mm512_storeu_ps(im3 + j, _mm512_sub_ps(b1i, n3i));
+        }
+    }
+}
+#endif
+
+// In-place inverse FFT (positive exponent, unscaled) on bit-reversed input.
+void VorbisInverseFft(VorbisKernels const& _kernels,
+                      VorbisMdct const& _mdct,
+                      float* _re,
+                      float* _im)
+{
+    std::uint32_t const size = _mdct.n / 4u;
+    std::uint32_t h = 1u;
+
+    if (ilog(size - 1u) & 1u)
+    {
+        for (std::uint32_t i = 0u; i < size; i += 2u)
+        {
+            float const re = _re[i + 1u], im = _im[i + 1u];
+            _re[i + 1u] = _re[i] - re; _im[i + 1u] = _im[i] - im;
+            _re[i] += re; _im[i] += im;
+        }
+        h = 2u;
+    }
+
+    float const* twiddles = _mdct.stage_twiddles.data();
+    for (; h < size; twiddles += 4u * h, h *= 4u)
+        _kernels.fft_pass(_re, _im, size, h, twiddles);
+}
+
+// u[k] = sum_j X[j] cos(pi/(N/2) (k + 1/2)(j + 1/2)), N/2 points, unscaled.
+// _scratch holds N/2 floats.
+void VorbisDct4(VorbisKernels const& _kernels,
+                VorbisMdct const& _mdct,
+                float const* _in,
+                float* _out,
+                float* _scratch)
+{
+    std::uint32_t const n2 = _mdct.n / 2u;
+    std::uint32_t const n4 = _mdct.n / 4u;
+    float* re = _scratch;
+    float* im = _scratch + n4;
+    float* u = _out;
+
+    // DCT-IV pre-twiddle, z_j = (X[2j] - i X[N/2-1-2j]) * w_j
+    for (std::uint32_t j = 0u; j < n4; ++j)
+    {
+        float const a = _in[2u * j];
+        float const b = _in[n2 - 1u - 2u * j];
+        std::uint32_t const k = _mdct.bit_reverse[j];
+        re[k] = a * _mdct.twiddle_re[j] + b * _mdct.twiddle_im[j];
+        im[k] = a * _mdct.twiddle_im[j] - b * _mdct.twiddle_re[j];
+    }
+
+    VorbisInverseFft(_kernels, _mdct, re, im);
+
+    for (std::uint32_t j = 0u; j < n4; ++j)
+    {
+        u[2u * j] = re[j] * _mdct.twiddle_re[j] - im[j] * _mdct.twiddle_im[j];
+        u[n2 - 1u - 2u * j] = re[j] * _mdct.twiddle_im[j] + im[j] * _mdct.twiddle_re[j];
+    }
+}
+
+// Unfolds the DCT-IV output with u[N-1-k] = -u[k] and u[N+k] = -u[k].
+void VorbisImdctUnfoldScalar(float const* _u,
+                             float const* _window,
+                             float* o_out,
+                             std::uint32_t _n)
+{
+    std::uint32_t const n4 = _n / 4u;
+    for (std::uint32_t k = 0u; k < n4; ++k)
+        o_out[k] = _u[k + n4] * _window[k];
+    for (std::uint32_t k = n4; k < 3u * n4; ++k)
+        o_out[k] = -_u[3u * n4 - 1u - k] * _window[k];
+    for (std::uint32_t k = 3u * n4; k < _n; ++k)
+        o_out[k] = -_u[k - 3u * n4] * _window[k];
+}
+
+// N/4 is a multiple of 16 for every legal blocksize.
+#if VORBIS_X86
+VORBIS_TARGET("sse2")
+void VorbisImdctUnfoldSse2(float const* _u,
+                           float const* _window,
+                           float* o_out,
+                           std::uint32_t _n)
+{
+    std::uint32_t const n4 = _n / 4u;
+    __m128 const sign_bit = _mm_set1_ps(-0.f);
+    for (std::uint32_t k = 0u; k < n4; k += 4u)
+        _mm_storeu_ps(o_out + k, _mm_mul_ps(_mm_loadu_ps(_u + k + n4), _mm_loadu_ps(_window + k)));
+    for (std::uint32_t k = n4; k < 3u * n4; k += 4u)
+    {
+        __m128 const u = _mm_loadu_ps(_u + 3u * n4 - 4u - k);
+        __m128 const reversed = _mm_shuffle_ps(u, u, _MM_SHUFFLE(0, 1, 2, 3));
+        _mm_storeu_ps(o_out + k, _mm_mul_ps(_mm_xor_ps(reversed, sign_bit), _mm_loadu_ps(_window + k)));
+    }
+    for (std::uint32_t k = 3u * n4; k < _n; k += 4u)
+    {
+        __m128 const u = _mm_loadu_ps(_u + k - 3u * n4);
+        _mm_storeu_ps(o_out + k, _mm_mul_ps(_mm_xor_ps(u, sign_bit), _mm_loadu_ps(_window + k)));
+    }
+}
+
+VORBIS_TARGET("avx2")
+void VorbisImdctUnfoldAvx2(float const* _u,
+                           float const* _window,
+                           float* o_out,
+                           std::uint32_t _n)
+{
+    std::uint32_t const n4 = _n / 4u;
+    __m256 const sign_bit = _mm256_set1_ps(-0.f);
+    __m256i const reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    for (std::uint32_t k = 0u; k < n4; k += 8u)
+        _mm256_storeu_ps(o_out + k, _mm256_mul_ps(_mm256_loadu_ps(_u + k + n4), _mm256_loadu_ps(_window + k)));
+    for (std::uint32_t k = n4; k < 3u * n4; k += 8u)
+    {
+        __m256 const reversed = _mm256_permutevar8x32_ps(_mm256_loadu_ps(_u + 3u * n4 - 8u - k), reverse);
+        _mm256_storeu_ps(o_out + k, _mm256_mul_ps(_mm256_xor_ps(reversed, sign_bit), _mm256_loadu_ps(_window + k)));
+    }
+    for (std::uint32_t k = 3u * n4; k < _n; k += 8u)
+    {
+        __m256 const u = _mm256_loadu_ps(_u + k - 3u * n4);
+        _mm256_storeu_ps(o_out + k, _mm256_mul_ps(_mm256_xor_ps(u, sign_bit), _mm256_loadu_ps(_window + k)));
+    }
+}
+
+VORBIS_TARGET("avx512f")
+void VorbisImdctUnfoldAvx512(float const* _u,
+                             float const* _window,
+                             float* o_out,
+                             std::uint32_t _n)
+{
+    std::uint32_t const n4 = _n / 4u;
+    __m512i const sign_bit = _mm512_set1_epi32(INT32_MIN);
+    __m512i const reverse = _mm512_setr_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    auto const negate = [sign_bit](__m512 _v)
+    {
+        return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(_v), sign_bit));
+    };
+    for (std::uint32_t k = 0u; k < n4; k += 16u)
+        _mm512_storeu_ps(o_out + k, _mm512_mul_ps(_mm512_loadu_ps(_u + k + n4), _mm512_loadu_ps(_window + k)));
+    for (std::uint32_t k = n4; k < 3u * n4; k += 16u)
+    {
+        __m512 const u = _mm512_loadu_ps(_u + 3u * n4 - 16u - k);
+        __m512 const reversed = _mm512_mask_permutexvar_ps(u, 0xffff, reverse, u);
+        _mm512_storeu_ps(o_out + k, _mm512_mul_ps(negate(reversed), _mm512_loadu_ps(_window + k)));
+    }
+    for (std::uint32_t k = 3u * n4; k < _n; k += 16u)
+        _mm512_storeu_ps(o_out + k, _mm512_mul_ps(negate(_mm512_loadu_ps(_u + k - 3u * n4)),
+                                                  _mm512_loadu_ps(_window + k)));
+}
+#endif
+
+// y[k] = w[k] * sum_j X[j] cos(2pi/N (k + 1/2 + N/4)(j + 1/2)), N/2 inputs,
+// N outputs. The window is applied while unfolding. _scratch holds N floats.
+void VorbisImdct(VorbisKernels const& _kernels,
+                 VorbisMdct const& _mdct,
+                 float const* _in,
+                 float const* _window,
+                 float* _out,
+                 float* _scratch)
+{
+    float* u = _scratch + _mdct.n / 2u;
+    VorbisDct4(_kernels, _mdct, _in, u, _scratch);
+    _kernels.imdct_unfold(u, _window, _out, _mdct.n);
+}
+
+// =============================================================================
+// WINDOWS
+// =============================================================================
+
+std::unique_ptr<VorbisWindows> VorbisBuildWindows(unsigned _blocksize_0,
+                                                  unsigned _blocksize_1)
+{
+    std::unique_ptr<VorbisWindows> result = std::make_unique<VorbisWindows>();
+
+    double const kPiOver2 = 3.14159265358979323846 * .5;
+    auto fill = [kPiOver2](std::vector<float> &o_window, std::uint32_t _n,
+                           std::uint32_t _lws, std::uint32_t _lwe,
+                           std::uint32_t _rws, std::uint32_t _rwe)
+    {
+        auto slope = [kPiOver2](double _x)
+        {
+            double const t0 = std::sin(_x * kPiOver2);
+            return (float)std::sin(kPiOver2 * t0 * t0);
+        };
+
+        o_window.assign(_n, 0.f);
+        for (std::uint32_t i = _lws; i < _lwe; ++i)
+            o_window[i] = slope(((i - _lws) + .5) / (_lwe - _lws));
+        for (std::uint32_t i = _lwe; i < _rws; ++i)
+            o_window[i] = 1.f;
+        for (std::uint32_t i = _rws; i < _rwe; ++i)
+            o_window[i] = slope(((_rwe - i) - .5) / (_rwe - _rws));
+    };
+
+    std::uint32_t const short_n = 1u << _blocksize_0;
+    std::uint32_t const long_n = 1u << _blocksize_1;
+    fill(result->shapes[0], short_n, 0u, short_n / 2u, short_n / 2u, short_n);
+
+    for (int previous_window_flag = 0; previous_window_flag < 2; ++previous_window_flag)
+        for (int next_window_flag = 0; next_window_flag < 2; ++next_window_flag)
+        {
+            std::uint32_t lws = 0u, lwe = long_n / 2u;
+            if (!previous_window_flag)
             {
-                nonzero = ReadBits(1, read_position, bit_offset);
-                --remaining_bits;
+                lws = long_n / 4u - short_n / 4u;
+                lwe = long_n / 4u + short_n / 4u;
             }
 
-            if (nonzero)
+            std::uint32_t rws = long_n / 2u, rwe = long_n;
+            if (!next_window_flag)
+            {
+                rws = long_n * 3u / 4u - short_n / 4u;
+                rwe = long_n * 3u / 4u + short_n / 4u;
+            }
+
+            fill(result->shapes[1 + previous_window_flag * 2 + next_window_flag],
+                 long_n, lws, lwe, rws, rwe);
+        }
+
+    return result;
+}
+
+// Built on first use and shared by every stream with that blocksize pair.
+VorbisWindows const& VorbisGetWindows(unsigned _blocksize_0,
+                                      unsigned _blocksize_1)
+{
+    assert(_blocksize_0 <= 13u && _blocksize_1 <= 13u);
+    VorbisTableRegistry &registry = VorbisGetTableRegistry();
+
+    std::unique_ptr<VorbisWindows const> &windows = registry.windows[_blocksize_0][_blocksize_1];
+    std::call_once(registry.windows_once[_blocksize_0][_blocksize_1],
+                   [&]() { windows = VorbisBuildWindows(_blocksize_0, _blocksize_1); });
+    return *windows;
+}
+
+inline float const* VorbisWindowShape(VorbisWindows const& _windows,
+                                      bool _blockflag,
+                                      bool _previous_window_flag,
+                                      bool _next_window_flag)
+{
+    if (!_blockflag)
+        return _windows.shapes[0].data();
+    return _windows.shapes[1 + _previous_window_flag * 2 + _next_window_flag].data();
+}
+
+// =============================================================================
+// FLOOR CURVE SYNTHESIS
+// =============================================================================
+
+float const* Floor1InverseDBTable()
+{
+    static float const* s_table = []()
+    {
+        static float table[256];
+        for (int i = 0; i < 256; ++i)
+            table[i] = (float)std::pow(10., (i - 255) * (140. / 256.) / 20.);
+        return table;
+    }();
+    return s_table;
+}
+
+// render_line from the spec, multiplying the spectrum by the curve in place.
+void Floor1RenderLine(std::int32_t _x0, std::int32_t _y0,
+                      std::int32_t _x1, std::int32_t _y1,
+                      std::int32_t _n,
+                      float const* _inverse_db,
+                      float* _spectrum)
+{
+    std::int32_t const dy = _y1 - _y0;
+    std::int32_t const adx = _x1 - _x0;
+    std::int32_t const base = dy / adx;
+    std::int32_t const sy = (dy < 0) ? base - 1 : base + 1;
+    std::int32_t const ady = std::abs(dy) - std::abs(base) * adx;
+    std::int32_t const x_end = std::min(_x1, _n);
+
+    std::int32_t y = _y0;
+    std::int32_t err = 0;
+    if (_x0 < x_end)
+        _spectrum[_x0] *= _inverse_db[std::min(255, std::max(0, y))];
+    for (std::int32_t x = _x0 + 1; x < x_end; ++x)
+    {
+        err += ady;
+        if (err >= adx)
+        {
+            err -= adx;
+            y += sy;
+        }
+        else
+            y += base;
+        _spectrum[x] *= _inverse_db[std::min(255, std::max(0, y))];
+    }
+}
+
+void Floor1Synthesis(VorbisFloor::Floor1 const& _floor,
+                     std::int32_t const* _final_y,
+                     std::uint8_t const* _step2,
+                     std::uint32_t _n,
+                     float* _spectrum)
+{
+    float const* inverse_db = Floor1InverseDBTable();
+    std::int32_t const n = (std::int32_t)_n;
+
+    std::int32_t lx = 0;
+    std::int32_t ly = _final_y[_floor.sorted_indices[0]] * _floor.multiplier;
+    std::int32_t hx = 0;
+    std::int32_t hy = 0;
+    for (std::size_t i = 1u; i < _floor.value_count; ++i)
+    {
+        std::uint8_t const value_index = _floor.sorted_indices[i];
+        if (!_step2[value_index])
+            continue;
+
+        hy = _final_y[value_index] * _floor.multiplier;
+        hx = (std::int32_t)_floor.values[value_index];
+        Floor1RenderLine(lx, ly, hx, hy, n, inverse_db, _spectrum);
+        lx = hx;
+        ly = hy;
+    }
+
+    if (hx < n)
+        Floor1RenderLine(hx, hy, n, hy, n, inverse_db, _spectrum);
+}
+
+// Floor0 is VorbisFloor::Floor0, or VorbisFloorDesc::Floor0 for the encoder.
+template <typename Floor0>
+void Floor0Synthesis(Floor0 const& _floor,
+                     std::uint32_t _amplitude,
+                     float const* _coefficients,
+                     bool _blockflag,
+                     std::uint32_t _n,
+                     float* _spectrum)
+{
+    auto const& bark_map = _floor.bark_map[_blockflag ? 1 : 0];
+    float cos_coefficients[VorbisDecodeBuffers::kFloor0MaxOrder];
+    for (std::uint32_t j = 0u; j < _floor.order; ++j)
+        cos_coefficients[j] = std::cos(_coefficients[j]);
+
+    float const amplitude_scale = (float)_amplitude * _floor.amplitude_offset
+        / (float)((1u << _floor.amplitude_bits) - 1u);
+
+    std::uint32_t i = 0u;
+    while (i < _n)
+    {
+        std::int32_t const map_value = bark_map[i];
+        float const omega = 3.1415926536f * map_value / _floor.bark_map_size;
+        float const cos_omega = std::cos(omega);
+
+        float p = 1.f, q = 1.f;
+        if (_floor.order & 1u)
+        {
+            for (std::uint32_t j = 0u; j + 1u < _floor.order; j += 2u)
+            {
+                float const dp = cos_coefficients[j + 1u] - cos_omega;
+                p *= 4.f * dp * dp;
+            }
+            for (std::uint32_t j = 0u; j < _floor.order; j += 2u)
+            {
+                float const dq = cos_coefficients[j] - cos_omega;
+                q *= 4.f * dq * dq;
+            }
+            p *= 1.f - cos_omega * cos_omega;
+            q *= .25f;
+        }
+        else
+        {
+            for (std::uint32_t j = 0u; j < _floor.order; j += 2u)
             {
-                static const std::uint32_t kRanges[] = { 256, 128, 86, 64 };
+                float const dp = cos_coefficients[j + 1u] - cos_omega;
+                float const dq = cos_coefficients[j] - cos_omega;
+                p *= 4.f * dp * dp;
+                q *= 4.f * dq * dq;
+            }
+            p *= (1.f - cos_omega) * .5f;
+            q *= (1.f + cos_omega) * .5f;
+        }
+
+        float const linear_floor_value = std::exp(.11512925f *
+            (amplitude_scale / std::sqrt(p + q) - _floor.amplitude_offset));
+
+        for (; i < _n && bark_map[i] == map_value; ++i)
+            _spectrum[i] *= linear_floor_value;
+    }
+}
+
+// Upper bound of the scratch one audio packet can take: a floor1 Y vector per
+// channel and the residue classifications of every submap.
+std::size_t VorbisScratchBytes(VorbisIDHeader const& _id,
+                               VorbisSetupHeader const& _setup)
+{
+    std::size_t const channel_count = _id.audio_channels;
+    std::size_t const n = (1u << _id.blocksize_1) / 2u;
+
+    std::size_t max_partitions = 0u;
+    for (VorbisResidue const& residue : _setup.residues)
+    {
+        if (!residue.partition_size || residue.classbook >= _setup.codebooks.size())
+            continue;
+        std::size_t const end = std::min<std::size_t>(residue.end, channel_count * n);
+        std::size_t const partitions = end / residue.partition_size
+            + _setup.codebooks[residue.classbook].dimensions;
+        max_partitions = std::max(max_partitions, partitions);
+    }
+
+    std::size_t const floor_bytes = channel_count * VorbisDecodeBuffers::kFloor1MaxValues * sizeof(std::uint32_t);
+    std::size_t const residue_bytes = channel_count * max_partitions;
+    return floor_bytes + residue_bytes + 4u * sizeof(std::max_align_t);
+}
+
+void VorbisAllocateBuffers(VorbisIDHeader const& _id,
+                           VorbisSetupHeader const& _setup,
+                           VorbisDecodeBuffers &o_buffers)
+{
+    std::size_t const channel_count = _id.audio_channels;
+
+    o_buffers.channel_stride = (1u << _id.blocksize_1) / 2u;
+    o_buffers.spectrum.assign(channel_count * o_buffers.channel_stride, 0.f);
+    o_buffers.floor_unused.assign(channel_count, 0u);
+    o_buffers.no_residue.assign(channel_count, 0u);
+    o_buffers.floor1_y.assign(channel_count * VorbisDecodeBuffers::kFloor1MaxValues, 0);
+    o_buffers.floor1_step2.assign(channel_count * VorbisDecodeBuffers::kFloor1MaxValues, 0u);
+    o_buffers.floor0_amplitude.assign(channel_count, 0u);
+    o_buffers.floor0_coefficients.assign(channel_count * VorbisDecodeBuffers::kFloor0MaxOrder, 0.f);
+
+    o_buffers.kernels = &VorbisGetKernels();
+    o_buffers.mdct[0] = &VorbisGetMdct(_id.blocksize_0);
+    o_buffers.mdct[1] = &VorbisGetMdct(_id.blocksize_1);
+    o_buffers.windows = &VorbisGetWindows(_id.blocksize_0, _id.blocksize_1);
+    o_buffers.imdct_scratch.assign(2u * o_buffers.channel_stride, 0.f);
+
+    o_buffers.channel_count = (std::uint32_t)channel_count;
+    o_buffers.block_stride = 1u << _id.blocksize_1;
+    o_buffers.block.assign(2u * channel_count * o_buffers.block_stride, 0.f);
+    o_buffers.ring_slot = 0u;
+    o_buffers.previous_blocksize = 0u;
+    o_buffers.pcm = VorbisPcmRange{};
+    VorbisScratchReserve(o_buffers.scratch, VorbisScratchBytes(_id, _setup));
+}
+
+// =============================================================================
+// OVERLAP-ADD
+// =============================================================================
+
+inline float* VorbisBlock(VorbisDecodeBuffers &_buffers,
+                          std::uint32_t _slot,
+                          std::uint32_t _channel)
+{
+    return &_buffers.block[(_slot * _buffers.channel_count + _channel) * _buffers.block_stride];
+}
+
+inline float const* VorbisBlock(VorbisDecodeBuffers const& _buffers,
+                                std::uint32_t _slot,
+                                std::uint32_t _channel)
+{
+    return &_buffers.block[(_slot * _buffers.channel_count + _channel) * _buffers.block_stride];
+}
+
+// Output of a block of _current samples following one of _previous samples.
+// It runs from the center of the previous block to the center of the current
+// one, and lives in the larger of the two blocks so that it stays contiguous.
+VorbisPcmRange VorbisOverlapRange(std::uint32_t _previous,
+                                  std::uint32_t _current,
+                                  std::uint32_t _previous_slot,
+                                  std::uint32_t _current_slot)
+{
+    VorbisPcmRange pcm{};
+    if (_previous != 0u)
+    {
+        pcm.size = _previous / 4u + _current / 4u;
+        if (_current >= _previous)
+        {
+            pcm.slot = _current_slot;
+            pcm.offset = _current / 4u - _previous / 4u;
+            pcm.overlap_start = 0u;
+            pcm.overlap_size = _previous / 2u;
+            pcm.overlap_slot = _previous_slot;
+            pcm.overlap_offset = _previous / 2u;
+        }
+        else
+        {
+            pcm.slot = _previous_slot;
+            pcm.offset = _previous / 2u;
+            pcm.overlap_start = _previous / 4u - _current / 4u;
+            pcm.overlap_size = _current / 2u;
+            pcm.overlap_slot = _current_slot;
+            pcm.overlap_offset = 0u;
+        }
+    }
+    return pcm;
+}
+
+// Called once the current packet is in ring_slot.
+void VorbisOverlapAdvance(VorbisDecodeBuffers &_buffers)
+{
+    std::uint32_t const current = _buffers.blocksize;
+    std::uint32_t const previous_slot = _buffers.ring_slot ^ 1u;
+    _buffers.pcm = VorbisOverlapRange(_buffers.previous_blocksize, current,
+                                      previous_slot, _buffers.ring_slot);
+    _buffers.previous_blocksize = current;
+    _buffers.ring_slot = previous_slot;
+}
+
+// Drops the overlap, the next packet yields no frames and only primes it.
+void VorbisOverlapReset(VorbisDecodeBuffers &_buffers)
+{
+    _buffers.previous_blocksize = 0u;
+    _buffers.pcm = VorbisPcmRange{};
+}
+
+void VorbisOverlapAddScalar(float* o_out,
+                            float const* _a,
+                            float const* _b,
+                            std::uint32_t _n)
+{
+    for (std::uint32_t j = 0u; j < _n; ++j)
+        o_out[j] = _a[j] + _b[j];
+}
+
+#if VORBIS_X86
+VORBIS_TARGET("sse2")
+void VorbisOverlapAddSse2(float* o_out,
+                          float const* _a,
+                          float const* _b,
+                          std::uint32_t _n)
+{
+    std::uint32_t j = 0u;
+    for (; j + 4u <= _n; j += 4u)
+        _mm_storeu_ps(o_out + j, _mm_add_ps(_mm_loadu_ps(_a + j), _mm_loadu_ps(_b + j)));
+    VorbisOverlapAddScalar(o_out + j, _a + j, _b + j, _n - j);
+}
+
+VORBIS_TARGET("avx2")
+void VorbisOverlapAddAvx2(float* o_out,
+                          float const* _a,
+                          float const* _b,
+                          std::uint32_t _n)
+{
+    std::uint32_t j = 0u;
+    for (; j + 8u <= _n; j += 8u)
+        _mm256_storeu_ps(o_out + j, _mm256_add_ps(_mm256_loadu_ps(_a + j), _mm256_loadu_ps(_b + j)));
+    VorbisOverlapAddScalar(o_out + j, _a + j, _b + j, _n - j);
+}
+
+VORBIS_TARGET("avx512f")
+void VorbisOverlapAddAvx512(float* o_out,
+                            float const* _a,
+                            float const* _b,
+                            std::uint32_t _n)
+{
+    std::uint32_t j = 0u;
+    for (; j + 16u <= _n; j += 16u)
+        _mm512_storeu_ps(o_out + j, _mm512_add_ps(_mm512_loadu_ps(_a + j), _mm512_loadu_ps(_b + j)));
+    VorbisOverlapAddScalar(o_out + j, _a + j, _b + j, _n - j);
+}
+#endif
+
+#if defined(__ARM_NEON)
+void VorbisOverlapAddNeon(float* o_out,
+                          float const* _a,
+                          float const* _b,
+                          std::uint32_t _n)
+{
+    std::uint32_t j = 0u;
+    for (; j + 4u <= _n; j += 4u)
+        vst1q_f32(o_out + j, vaddq_f32(vld1q_f32(_a + j), vld1q_f32(_b + j)));
+    VorbisOverlapAddScalar(o_out + j, _a + j, _b + j, _n - j);
+}
+#endif
+
+// Finishes the overlap in place and points o_channels at the decoder owned
+// samples, valid until the next packet is decoded.
+std::uint32_t VorbisPcmSpans(VorbisDecodeBuffers &_buffers,
+                             float const** o_channels)
+{
+    VorbisPcmRange &pcm = _buffers.pcm;
+    for (std::uint32_t i = 0u; i < _buffers.channel_count; ++i)
+    {
+        float* samples = VorbisBlock(_buffers, pcm.slot, i) + pcm.offset;
+        float const* overlap = VorbisBlock(_buffers, pcm.overlap_slot, i) + pcm.overlap_offset;
+        _buffers.kernels->overlap_add(samples + pcm.overlap_start, samples + pcm.overlap_start,
+                                      overlap, pcm.overlap_size);
+        o_channels[i] = samples;
+    }
+    pcm.overlap_size = 0u;
+    return pcm.size;
+}
+
+// Writes samples [_first, _first + _count) of the last packet to caller owned
+// planar buffers, adding the overlap on the way.
+void VorbisWritePcm(VorbisDecodeBuffers const& _buffers,
+                    std::uint32_t _first,
+                    std::uint32_t _count,
+                    float* const* o_channels)
+{
+    VorbisPcmRange const& pcm = _buffers.pcm;
+    assert(_first + _count <= pcm.size);
+
+    std::uint32_t const end = _first + _count;
+    std::uint32_t const overlap_begin = std::min(end, std::max(_first, pcm.overlap_start));
+    std::uint32_t const overlap_end = std::min(end, std::max(_first, pcm.overlap_start + pcm.overlap_size));
+    for (std::uint32_t i = 0u; i < _buffers.channel_count; ++i)
+    {
+        float const* samples = VorbisBlock(_buffers, pcm.slot, i) + pcm.offset;
+        float* output = o_channels[i];
+
+        std::copy(samples + _first, samples + overlap_begin, output);
+        if (overlap_end > overlap_begin)
+        {
+            float const* overlap = VorbisBlock(_buffers, pcm.overlap_slot, i) + pcm.overlap_offset;
+            _buffers.kernels->overlap_add(output + (overlap_begin - _first), samples + overlap_begin,
+                                          overlap + (overlap_begin - pcm.overlap_start),
+                                          overlap_end - overlap_begin);
+        }
+        std::copy(samples + overlap_end, samples + end, output + (overlap_end - _first));
+    }
+}
+
+// Four xorshift32 lanes, two draws are summed into triangular noise of +-1 LSB.
+struct VorbisDither
+{
+    std::uint32_t state[4] = { 0x9e3779b9u, 0x7f4a7c15u, 0x85ebca6bu, 0xc2b2ae35u };
+};
+
+enum class EVorbisPcmFormat : std::uint8_t
+{
+    kInt16 = 0,
+    kInt24, // packed little endian
+};
+
+inline std::uint32_t VorbisXorshift(std::uint32_t &_state)
+{
+    _state ^= _state << 13;
+    _state ^= _state >> 17;
+    _state ^= _state << 5;
+    return _state;
+}
+
+// Maps the top 23 bits of _bits to [1, 2).
+inline float VorbisUnitNoise(std::uint32_t _bits)
+{
+    std::uint32_t const mantissa = (_bits >> 9) | 0x3f800000u;
+    float result;
+    std::memcpy(&result, &mantissa, sizeof(result));
+    return result;
+}
+
+// Maps the top 23 bits of _bits to [-0.5, 0.5).
+inline float VorbisUniformNoise(std::uint32_t _bits)
+{
+    return VorbisUnitNoise(_bits) - 1.5f;
+}
+
+template <EVorbisPcmFormat kFormat>
+inline void VorbisStoreSample(std::int32_t _value, std::uint8_t* o_output)
+{
+    if (kFormat == EVorbisPcmFormat::kInt16)
+    {
+        std::int16_t const value = (std::int16_t)_value;
+        std::memcpy(o_output, &value, sizeof(value));
+    }
+    else
+    {
+        o_output[0] = (std::uint8_t)(_value);
+        o_output[1] = (std::uint8_t)(_value >> 8);
+        o_output[2] = (std::uint8_t)(_value >> 16);
+    }
+}
+
+// Dither draws follow the SSE2 layout : sample _begin + j takes two draws from
+// lane j % 4, and their sum is rounded before the bias is taken off, so that
+// every variant dithers the same.
+
+// Overlaps, scales, dithers, clamps and interleaves samples [_begin, _end) of
+// one channel. _overlap is null outside of the overlapped region.
+template <EVorbisPcmFormat kFormat>
+void VorbisQuantizeRangeScalar(float const* _samples,
+                               float const* _overlap,
+                               std::uint32_t _begin,
+                               std::uint32_t _end,
+                               VorbisDither* _dither,
+                               std::uint8_t* o_output,
+                               std::size_t _output_stride)
+{
+    constexpr float kScale = (kFormat == EVorbisPcmFormat::kInt16) ? 32768.f : 8388608.f;
+    constexpr float kMax = kScale - 1.f;
+
+    for (std::uint32_t j = _begin; j < _end; ++j)
+    {
+        float value = _samples[j];
+        if (_overlap)
+            value += _overlap[j];
+        value *= kScale;
+        if (_dither)
+        {
+            std::uint32_t &lane = _dither->state[(j - _begin) & 3u];
+            float const u0 = VorbisUnitNoise(VorbisXorshift(lane));
+            float const u1 = VorbisUnitNoise(VorbisXorshift(lane));
+            value += (u0 + u1) - 3.f;
+        }
+        value = std::min(std::max(value, -kScale), kMax);
+        VorbisStoreSample<kFormat>((std::int32_t)std::lrint(value), o_output + j * _output_stride);
+    }
+}
+
+#if VORBIS_X86
+template <EVorbisPcmFormat kFormat>
+VORBIS_TARGET("sse2")
+void VorbisQuantizeRangeSse2(float const* _samples,
+                             float const* _overlap,
+                             std::uint32_t _begin,
+                             std::uint32_t _end,
+                             VorbisDither* _dither,
+                             std::uint8_t* o_output,
+                             std::size_t _output_stride)
+{
+    constexpr float kScale = (kFormat == EVorbisPcmFormat::kInt16) ? 32768.f : 8388608.f;
+    constexpr float kMax = kScale - 1.f;
+
+    std::uint32_t j = _begin;
+    __m128 const scale = _mm_set1_ps(kScale);
+    __m128 const lower = _mm_set1_ps(-kScale);
+    __m128 const upper = _mm_set1_ps(kMax);
+    __m128i const noise_bits = _mm_set1_epi32(0x3f800000);
+    __m128 const noise_bias = _mm_set1_ps(3.f);
+    __m128i state = _dither
+        ? _mm_loadu_si128((__m128i const*)_dither->state)
+        : _mm_setzero_si128();
+    auto xorshift = [&state, noise_bits]()
+    {
+        state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+        state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+        state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+        return _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(state, 9), noise_bits));
+    };
+
+    for (; j + 4u <= _end; j += 4u)
+    {
+        __m128 value = _mm_loadu_ps(_samples + j);
+        if (_overlap)
+            value = _mm_add_ps(value, _mm_loadu_ps(_overlap + j));
+        value = _mm_mul_ps(value, scale);
+        if (_dither)
+        {
+            __m128 const u0 = xorshift();
+            __m128 const u1 = xorshift();
+            value = _mm_add_ps(value, _mm_sub_ps(_mm_add_ps(u0, u1), noise_bias));
+        }
+        value = _mm_min_ps(_mm_max_ps(value, lower), upper);
+
+        alignas(16) std::int32_t quantized[4];
+        _mm_store_si128((__m128i*)quantized, _mm_cvtps_epi32(value));
+        for (std::uint32_t k = 0u; k < 4u; ++k)
+            VorbisStoreSample<kFormat>(quantized[k], o_output + (j + k) * _output_stride);
+    }
+
+    if (_dither)
+        _mm_storeu_si128((__m128i*)_dither->state, state);
+
+    VorbisQuantizeRangeScalar<kFormat>(_samples, _overlap, j, _end, _dither, o_output, _output_stride);
+}
+#endif
+
+// The PCM conversion stays on SSE2 for wider hosts, the wider variants would
+// only add lanes to the dither without a measurable gain.
+VorbisKernels const& VorbisSelectKernels(std::uint32_t _features)
+{
+    static VorbisKernels const kScalar = {
+        "scalar", 0u,
+        VorbisInverseCouplingScalar, VorbisFftPassScalar, VorbisImdctUnfoldScalar,
+        VorbisOverlapAddScalar,
+        VorbisQuantizeRangeScalar<EVorbisPcmFormat::kInt16>,
+        VorbisQuantizeRangeScalar<EVorbisPcmFormat::kInt24>
+    };
+#if VORBIS_X86
+    static VorbisKernels const kSse2 = {
+        "sse2", kCpuSse2,
+        VorbisInverseCouplingSse2, VorbisFftPassSse2, VorbisImdctUnfoldSse2,
+        VorbisOverlapAddSse2,
+        VorbisQuantizeRangeSse2<EVorbisPcmFormat::kInt16>,
+        VorbisQuantizeRangeSse2<EVorbisPcmFormat::kInt24>
+    };
+    static VorbisKernels const kAvx2 = {
+        "avx2", kCpuSse2 | kCpuAvx2,
+        VorbisInverseCouplingAvx2, VorbisFftPassAvx2, VorbisImdctUnfoldAvx2,
+        VorbisOverlapAddAvx2,
+        VorbisQuantizeRangeSse2<EVorbisPcmFormat::kInt16>,
+        VorbisQuantizeRangeSse2<EVorbisPcmFormat::kInt24>
+    };
+    static VorbisKernels const kAvx512 = {
+        "avx512", kCpuSse2 | kCpuAvx2 | kCpuAvx512,
+        VorbisInverseCouplingAvx512, VorbisFftPassAvx512, VorbisImdctUnfoldAvx512,
+        VorbisOverlapAddAvx512,
+        VorbisQuantizeRangeSse2<EVorbisPcmFormat::kInt16>,
+        VorbisQuantizeRangeSse2<EVorbisPcmFormat::kInt24>
+    };
+
+    if (_features & kCpuAvx512)
+        return kAvx512;
+    if (_features & kCpuAvx2)
+        return kAvx2;
+    if (_features & kCpuSse2)
+        return kSse2;
+#elif defined(__ARM_NEON)
+    static VorbisKernels const kNeon = {
+        "neon", kCpuNeon,
+        VorbisInverseCouplingNeon, VorbisFftPassScalar, VorbisImdctUnfoldScalar,
+        VorbisOverlapAddNeon,
+        VorbisQuantizeRangeScalar<EVorbisPcmFormat::kInt16>,
+        VorbisQuantizeRangeScalar<EVorbisPcmFormat::kInt24>
+    };
+
+    if (_features & kCpuNeon)
+        return kNeon;
+#endif
+    return kScalar;
+}
+
+// Same as VorbisWritePcm, but straight to interleaved integer frames.
+// _dither may be null to round without dithering.
+template <EVorbisPcmFormat kFormat>
+void VorbisWritePcmInterleaved(VorbisDecodeBuffers const& _buffers,
+                               std::uint32_t _first,
+                               std::uint32_t _count,
+                               VorbisDither* _dither,
+                               void* o_frames)
+{
+    VorbisPcmRange const& pcm = _buffers.pcm;
+    assert(_first + _count <= pcm.size);
+
+    constexpr std::size_t kSampleSize = (kFormat == EVorbisPcmFormat::kInt16) ? 2u : 3u;
+    std::size_t const frame_size = kSampleSize * _buffers.channel_count;
+    VorbisQuantizeFunc const quantize = (kFormat == EVorbisPcmFormat::kInt16)
+        ? _buffers.kernels->quantize_int16
+        : _buffers.kernels->quantize_int24;
+
+    std::uint32_t const end = _first + _count;
+    std::uint32_t const overlap_begin = std::min(end, std::max(_first, pcm.overlap_start));
+    std::uint32_t const overlap_end = std::min(end, std::max(_first, pcm.overlap_start + pcm.overlap_size));
+    for (std::uint32_t i = 0u; i < _buffers.channel_count; ++i)
+    {
+        float const* samples = VorbisBlock(_buffers, pcm.slot, i) + pcm.offset;
+        std::uint8_t* output = (std::uint8_t*)o_frames + i * kSampleSize;
+
+        quantize(samples + _first, nullptr, 0u, overlap_begin - _first, _dither, output, frame_size);
+        if (overlap_end > overlap_begin)
+        {
+            float const* overlap = VorbisBlock(_buffers, pcm.overlap_slot, i) + pcm.overlap_offset;
+            quantize(samples + overlap_begin, overlap + (overlap_begin - pcm.overlap_start),
+                     0u, overlap_end - overlap_begin, _dither,
+                     output + (overlap_begin - _first) * frame_size, frame_size);
+        }
+        quantize(samples + overlap_end, nullptr, 0u, end - overlap_end, _dither,
+                 output + (overlap_end - _first) * frame_size, frame_size);
+    }
+}
+
+// Zero template arguments read the channel count and blocksizes from the ID
+// header; nonzero ones give the compiler fixed trip counts to unroll.
+template <unsigned kChannels, unsigned kBlocksizeLog0, unsigned kBlocksizeLog1>
+std::uint32_t VorbisAudioDecodePath(PageContainer const &_pages,
+                                    VorbisIDHeader const &_id,
+                                    VorbisSetupHeader const &_setup,
+                                    VorbisDecodeBuffers &_buffers,
+                                    std::size_t &_page_index,
+                                    std::size_t &_seg_index)
+{
+    unsigned const channels = kChannels ? kChannels : _id.audio_channels;
+    unsigned const blocksize_log0 = kBlocksizeLog0 ? kBlocksizeLog0 : _id.blocksize_0;
+    unsigned const blocksize_log1 = kBlocksizeLog1 ? kBlocksizeLog1 : _id.blocksize_1;
+
+    EVorbisError error_code = EVorbisError::kNoError;
+    VorbisStageClock clock(_buffers.profile);
+    VorbisScratchReset(_buffers.scratch);
+#if VORBIS_PROFILE
+    VorbisCodewordProfileScope const codeword_scope(_buffers.profile);
+#endif
+
+    VORBIS_TRACE(kTraceVerbose, kTracePackets, "packet at page %zu (sequence %u) segment %zu",
+                 _page_index, _pages[_page_index].page_sequence_num, _seg_index);
+
+    std::uint8_t const* read_position = nullptr;
+    int bit_offset = 0;
+
+    std::size_t packet_size = 0u;
+    {
+        std::size_t page_end, seg_end;
+        error_code = AssemblePacket(_pages, _page_index, _seg_index, _buffers.packet,
+                                    read_position, packet_size, page_end, seg_end);
+        if (error_code != EVorbisError::kNoError)
+            return PackError(error_code, 0u);
+
+        _page_index = page_end;
+        _seg_index = seg_end;
+    }
+
+    clock.Lap(kStagePacketAssembly);
+    ++_buffers.profile.packets;
+    VORBIS_TRACE(kTraceVerbose, kTracePackets, "packet size %zu", packet_size);
+
+    int remaining_bits = packet_size * 8;
+
+    if (!remaining_bits)
+        return PackError(EVorbisError::kInvalidStream, FInvalidStream::kEndOfPacket);
+    --remaining_bits;
+    std::uint32_t packet_type = ReadBits(1, read_position, bit_offset);
+    if (packet_type)
+        return PackError(EVorbisError::kInvalidStream, FInvalidStream::kUnexpectedNonAudioPacket);
+
+    unsigned bits_read = ilog(_setup.modes.size() - 1u);
+    if (remaining_bits < bits_read)
+        return PackError(EVorbisError::kInvalidStream, FInvalidStream::kEndOfPacket);
+    remaining_bits -= bits_read;
+    std::uint32_t mode_index = ReadBits(bits_read, read_position, bit_offset);
+    VORBIS_TRACE(kTraceVerbose, kTracePackets, "mode %u", (unsigned)mode_index);
+
+    if (mode_index >= _setup.modes.size())
+        return PackError(EVorbisError::kInvalidStream, FInvalidStream::kUndecodablePacket);
+
+    VorbisMode const& mode = _setup.modes[mode_index];
+
+    std::uint32_t const blocksize = !mode.blockflag ?
+        1u << blocksize_log0 :
+        1u << blocksize_log1;
+    VORBIS_TRACE(kTraceVerbose, kTracePackets, "blocksize %u", (unsigned)blocksize);
+    _buffers.blocksize = blocksize;
+
+    // =========================================================================
+    // WINDOW PARAMETERS
+    // =========================================================================
+
+    bool previous_window_flag = false;
+    bool next_window_flag = false;
+
+    if (mode.blockflag)
+    {
+        if (remaining_bits < 2)
+            return PackError(EVorbisError::kInvalidStream, FInvalidStream::kEndOfPacket);
+        remaining_bits -= 2;
+
+        previous_window_flag = ReadBits(1, read_position, bit_offset);
+        next_window_flag = ReadBits(1, read_position, bit_offset);
+        VORBIS_TRACE(kTraceVerbose, kTracePackets, "previous window %d next window %d",
+                     (int)previous_window_flag, (int)next_window_flag);
+    }
+
+    float const* window = VorbisWindowShape(*_buffers.windows, mode.blockflag,
+                                            previous_window_flag, next_window_flag);
+
+    // =========================================================================
+    // FLOOR CURVE
+    // =========================================================================
+
+    VorbisMapping const& mapping = _setup.mappings[mode.mapping];
+
+    for (unsigned i = 0; i < channels; ++i)
+    {
+        std::uint8_t const submap_index = mapping.muxes[i];
+        std::uint8_t const floor_index = mapping.submap_floors[submap_index];
+        VorbisFloor const& floor_container = _setup.floors[floor_index];
+
+        bool unused = true;
+        // according to floor.type, call the appropriate floor decode function
+        switch (floor_container.type)
+        {
+        case 0:
+        {
+            VorbisFloor::Floor0 const& floor = std::get<0>(floor_container.data);
+
+            std::uint32_t amplitude = 0u;
+            if (remaining_bits >= floor.amplitude_bits)
+            {
+                amplitude = ReadBits(floor.amplitude_bits, read_position, bit_offset);
+                remaining_bits -= floor.amplitude_bits;
+            }
+            else
+                remaining_bits = 0;
+
+            if (amplitude)
+            {
+                unsigned bit_count = ilog(floor.book_count);
+                if (remaining_bits < bit_count)
+                {
+                    remaining_bits = 0;
+                    break;
+                }
+                std::uint32_t book_index = ReadBits(bit_count, read_position, bit_offset);
+                remaining_bits -= bit_count;
+
+                if (book_index >= floor.book_count ||
+                    floor.codebooks[book_index] >= _setup.codebooks.size())
+                    return PackError(EVorbisError::kInvalidStream, FInvalidStream::kUndecodablePacket);
+
+                VorbisCodebook const& codebook = _setup.codebooks[floor.codebooks[book_index]];
+                if (codebook.vq_values.empty())
+                    return PackError(EVorbisError::kInvalidStream, FInvalidStream::kUndecodablePacket);
+
+                float* coefficients = &_buffers.floor0_coefficients[i * VorbisDecodeBuffers::kFloor0MaxOrder];
+                std::uint32_t coefficient_count = 0u;
+                float last = 0.f;
+                bool end_of_packet = false;
+                while (coefficient_count < floor.order)
+                {
+                    std::uint32_t entry = 0u;
+                    if (!VorbisReadEntry(codebook, read_position, bit_offset, remaining_bits, entry))
+                    {
+                        end_of_packet = true;
+                        break;
+                    }
+
+                    float const* values = &codebook.vq_values[entry * codebook.dimensions];
+                    for (std::uint16_t d = 0u; d < codebook.dimensions; ++d)
+                        if (coefficient_count + d < floor.order)
+                            coefficients[coefficient_count + d] = values[d] + last;
+                    coefficient_count += codebook.dimensions;
+                    last += values[codebook.dimensions - 1u];
+                }
+
+                if (end_of_packet)
+                    break;
+
+                _buffers.floor0_amplitude[i] = amplitude;
+                unused = false;
+            }
+        } break;
+
+        case 1:
+        {
+            VorbisFloor::Floor1 const& floor = std::get<1>(floor_container.data);
+
+            bool nonzero = false;
+            if (remaining_bits)
+            {
+                nonzero = ReadBits(1, read_position, bit_offset);
+                --remaining_bits;
+            }
+
+            static const std::uint32_t kRanges[] = { 256, 128, 86, 64 };
+
+            std::uint32_t range = kRanges[floor.multiplier-1];
+            std::uint32_t bit_count = ilog(range-1);
+            std::uint32_t* yvalues = VorbisScratchAllocate<std::uint32_t>(_buffers.scratch, floor.value_count);
+            if (!yvalues)
+                return PackError(EVorbisError::kInvalidStream, FInvalidStream::kUndecodablePacket);
+
+            if (nonzero && remaining_bits >= 2 * (int)bit_count)
+            {
+                yvalues[0] = ReadBits(bit_count, read_position, bit_offset);
+                yvalues[1] = ReadBits(bit_count, read_position, bit_offset);
+                remaining_bits -= 2 * bit_count;
+            }
+            else
+                nonzero = false;
+
+            std::size_t yindex = 2;
+            for (std::uint8_t i = 0u; nonzero && i < floor.partition_count; ++i)
+            {
+                VorbisFloor::Floor1::Class const& partition_class = floor.classes[floor.partition_classes[i]];
+                std::uint8_t cdim = partition_class.dimensions;
+                std::uint8_t cbits = partition_class.subclass_logcount;
+                std::uint32_t csub = (1u << cbits) - 1u;
+                std::uint32_t cval = 0u;
+                if (cbits > 0)
+                {
+                    VorbisCodebook const& codebook = _setup.codebooks[partition_class.masterbook];
+                    if (!VorbisReadEntry(codebook, read_position, bit_offset, remaining_bits, cval))
+                    {
+                        nonzero = false;
+                        break;
+                    }
+                }
+
+                for (std::uint8_t j = 0u; j < cdim; ++j)
+                {
+                    std::uint32_t subbook_index = cval & csub;
+                    std::uint8_t codebook_index = partition_class.subclass_codebooks[subbook_index];
+                    cval = cval >> cbits;
+                    yvalues[yindex + j] = 0u;
+                    if (codebook_index != 0xff)
+                    {
+                        VorbisCodebook const& codebook = _setup.codebooks[codebook_index];
+                        if (!VorbisReadEntry(codebook, read_position, bit_offset, remaining_bits,
+                                             yvalues[yindex + j]))
+                        {
+                            nonzero = false;
+                            break;
+                        }
+                    }
+                }
+                yindex += cdim;
+            }
+
+            if (!nonzero)
+                break;
+
+            // Amplitude value synthesis, straight into the per-channel floor buffers
+            std::int32_t* final_yvalues = &_buffers.floor1_y[i * VorbisDecodeBuffers::kFloor1MaxValues];
+            std::uint8_t* step2_flag = &_buffers.floor1_step2[i * VorbisDecodeBuffers::kFloor1MaxValues];
+            step2_flag[0] = true; step2_flag[1] = true;
+            final_yvalues[0] = yvalues[0]; final_yvalues[1] = yvalues[1];
+            for (std::size_t i = 2; i < floor.value_count; ++i)
+            {
+                std::size_t ln_offset = low_neighbour(floor.values.data(), i);
+                std::size_t hn_offset = high_neighbour(floor.values.data(), i);
+
+                std::int32_t predicted = (std::int32_t)render_point(floor.values[ln_offset],
+                                                                    final_yvalues[ln_offset],
+                                                                    floor.values[hn_offset],
+                                                                    final_yvalues[hn_offset],
+                                                                    floor.values[i]);
+
+                std::int32_t val = (std::int32_t)yvalues[i];
+
+                std::int32_t highroom = (std::int32_t)range - predicted;
+                std::int32_t lowroom = (std::int32_t)predicted;
+                std::int32_t room = std::min(highroom, lowroom) * 2;
+
+                if (val)
+                {
+                    step2_flag[ln_offset] = true;
+                    step2_flag[hn_offset] = true;
+                    step2_flag[i] = true;
+                    if (val >= room)
+                    {
+                        if (highroom > lowroom)
+                            final_yvalues[i] = std::min(range, (std::uint32_t)std::max(0, val - lowroom + predicted));
+                        else
+                            final_yvalues[i] = std::min(range, (std::uint32_t)std::max(0, predicted - (val - highroom) - 1));
+                    }
+                    else
+                    {
+                        if (val & 0x1)
+                            final_yvalues[i] = std::min(range, (std::uint32_t)std::max(0, predicted - ((val + 1) / 2)));
+                        else
+                            final_yvalues[i] = std::min(range, (std::uint32_t)std::max(0, predicted + (val / 2)));
+                    }
+                }
+                else
+                {
+                    step2_flag[i] = false;
+                    final_yvalues[i] = std::min(range, (std::uint32_t)std::max(0, predicted));
+                }
+            }
+
+            unused = false;
+        } break;
+        default: break;
+        }
+
+        _buffers.floor_unused[i] = unused;
+        _buffers.no_residue[i] = unused;
+    }
+
+    _buffers.silent_packet = std::all_of(_buffers.floor_unused.begin(),
+                                         _buffers.floor_unused.begin() + channels,
+                                         [](std::uint8_t _v) { return _v != 0u; });
+    clock.Lap(kStageFloorDecode);
+    if (_buffers.silent_packet)
+    {
+        for (unsigned i = 0; i < channels; ++i)
+        {
+            float* block = VorbisBlock(_buffers, _buffers.ring_slot, i);
+            std::fill(block, block + blocksize, 0.f);
+        }
+        VorbisOverlapAdvance(_buffers);
+        clock.Lap(kStageOverlap);
+        return 0u;
+    }
+
+    // =========================================================================
+    // RESIDUE
+    // =========================================================================
+
+    for (std::uint8_t step_index = 0u; step_index < mapping.coupling_step_count; ++step_index)
+    {
+        std::uint32_t const magnitude = mapping.magnitudes[step_index];
+        std::uint32_t const angle = mapping.angles[step_index];
+        if (!_buffers.no_residue[magnitude] || !_buffers.no_residue[angle])
+        {
+            _buffers.no_residue[magnitude] = 0u;
+            _buffers.no_residue[angle] = 0u;
+        }
+    }
+
+    std::uint32_t const n = blocksize / 2u;
+    for (std::uint8_t submap_index = 0u; submap_index < mapping.submap_count; ++submap_index)
+    {
+        float* vectors[256];
+        std::uint8_t do_not_decode[256];
+        std::uint32_t vector_count = 0u;
+        for (unsigned j = 0; j < channels; ++j)
+        {
+            if (mapping.muxes[j] != submap_index)
+                continue;
+            vectors[vector_count] = &_buffers.spectrum[j * _buffers.channel_stride];
+            do_not_decode[vector_count] = _buffers.no_residue[j];
+            ++vector_count;
+        }
+
+        VorbisResidue const& residue = _setup.residues[mapping.submap_residues[submap_index]];
+        error_code = VorbisResidueDecode(_setup, residue, vectors, do_not_decode, vector_count, n,
+                                         read_position, bit_offset, remaining_bits, _buffers.scratch);
+        if (error_code != EVorbisError::kNoError)
+            return PackError(error_code, 0u);
+    }
+
+    clock.Lap(kStageResidue);
+
+    // =========================================================================
+    // INVERSE COUPLING
+    // =========================================================================
+
+    for (std::size_t step_index = mapping.coupling_step_count; step_index-- > 0u;)
+    {
+        std::uint32_t const magnitude = mapping.magnitudes[step_index];
+        std::uint32_t const angle = mapping.angles[step_index];
+
+        // no_residue has been propagated across the pair, both are silent
+        if (_buffers.no_residue[magnitude])
+            continue;
+
+        _buffers.kernels->inverse_coupling(&_buffers.spectrum[magnitude * _buffers.channel_stride],
+                              &_buffers.spectrum[angle * _buffers.channel_stride],
+                              n);
+    }
+
+    clock.Lap(kStageCoupling);
+
+    // =========================================================================
+    // FLOOR CURVE SYNTHESIS & INVERSE MDCT
+    // =========================================================================
+
+    VorbisMdct const& mdct = *_buffers.mdct[mode.blockflag ? 1 : 0];
+    for (unsigned i = 0; i < channels; ++i)
+    {
+        float* block = VorbisBlock(_buffers, _buffers.ring_slot, i);
+        if (_buffers.floor_unused[i])
+        {
+            std::fill(block, block + blocksize, 0.f);
+            clock.Lap(kStageImdct);
+            continue;
+        }
+
+        float* spectrum = &_buffers.spectrum[i * _buffers.channel_stride];
+        VorbisFloor const& floor_container = _setup.floors[mapping.submap_floors[mapping.muxes[i]]];
+        if (floor_container.type == 0u)
+            Floor0Synthesis(std::get<0>(floor_container.data),
+                            _buffers.floor0_amplitude[i],
+                            &_buffers.floor0_coefficients[i * VorbisDecodeBuffers::kFloor0MaxOrder],
+                            mode.blockflag, n, spectrum);
+        else
+            Floor1Synthesis(std::get<1>(floor_container.data),
+                            &_buffers.floor1_y[i * VorbisDecodeBuffers::kFloor1MaxValues],
+                            &_buffers.floor1_step2[i * VorbisDecodeBuffers::kFloor1MaxValues],
+                            n, spectrum);
+        clock.Lap(kStageFloorSynthesis);
+
+        VorbisImdct(*_buffers.kernels, mdct, spectrum, window, block, _buffers.imdct_scratch.data());
+        clock.Lap(kStageImdct);
+    }
+
+    VorbisOverlapAdvance(_buffers);
+    clock.Lap(kStageOverlap);
+    return 0u;
+}
+
+using VorbisAudioDecodeFunc = std::uint32_t(*)(PageContainer const&, VorbisIDHeader const&,
+                                                VorbisSetupHeader const&, VorbisDecodeBuffers&,
+                                                std::size_t&, std::size_t&);
+
+VorbisAudioDecodeFunc VorbisSelectAudioDecode(VorbisIDHeader const& _id)
+{
+    // 256/2048 mono and stereo cover nearly all streams in practice
+    if (_id.blocksize_0 == 8u && _id.blocksize_1 == 11u)
+    {
+        if (_id.audio_channels == 2u)
+            return &VorbisAudioDecodePath<2u, 8u, 11u>;
+        if (_id.audio_channels == 1u)
+            return &VorbisAudioDecodePath<1u, 8u, 11u>;
+    }
+    return &VorbisAudioDecodePath<0u, 0u, 0u>;
+}
+
+std::uint32_t VorbisAudioDecode(PageContainer const &_pages,
+                                VorbisIDHeader const &_id,
+                                VorbisSetupHeader const &_setup,
+                                VorbisDecodeBuffers &_buffers,
+                                std::size_t &_page_index,
+                                std::size_t &_seg_index)
+{
+    return VorbisSelectAudioDecode(_id)(_pages, _id, _setup, _buffers, _page_index, _seg_index);
+}
+
+// =============================================================================
+// DECODER
+// =============================================================================
+
+// Worst-case work of one read in real-time mode. The stream bounds are
+// measured at open, so they hold for every packet of the stream.
+struct VorbisRealtimeLimits
+{
+    std::uint32_t max_packets_per_read = 0u; // a read returns early past it
+    std::size_t max_packet_bytes = 0u; // also bounds the codewords of a packet
+    std::uint32_t max_packet_pages = 0u; // pages walked to assemble a packet
+    std::uint32_t max_imdct_per_packet = 0u; // one per channel, long blocks at most
+    std::uint32_t max_imdct_size = 0u;
+    std::uint32_t max_allocations_per_read = 0u; // all memory reserved at open
+    std::uint64_t max_ticks_per_read = 0u; // worst observed so far, VorbisProfileTicks
+};
+
+// Self contained decoding state for one stream, safe to use alongside any
+// number of other decoders. Pages point into the owned copy of the stream.
+struct VorbisDecoder
+{
+    std::vector<std::uint8_t> stream; // padded with kPacketPadding
+    OggContents ogg_pages;
+    PageContainer const* pages = nullptr;
+
+    VorbisIDHeader id_header;
+    std::shared_ptr<VorbisSetupArena const> setup; // shared through the setup cache
+    VorbisDecodeBuffers buffers;
+
+    std::size_t audio_page_index = 0u; // first audio packet
+    std::size_t audio_seg_index = 0u;
+    std::size_t page_index = 0u; // next packet
+    std::size_t seg_index = 0u;
+
+    std::uint32_t pcm_read = 0u; // frames of buffers.pcm already returned
+    std::uint64_t frames_read = 0u;
+    std::uint64_t frame_count = ~0ull; // from the last granule position, when known
+
+    VorbisDither dither;
+    bool dither_enabled = false;
+    std::uint32_t error = 0u; // packed error that stopped decoding
+    std::uint64_t packet_errors = 0u; // packets skipped as holes
+    std::uint32_t last_packet_error = 0u;
+
+    bool realtime = false; // see VorbisDecoderEnableRealtime
+    VorbisRealtimeLimits realtime_limits;
+};
+
+void VorbisDecoderReset(VorbisDecoder &_decoder)
+{
+    _decoder.page_index = _decoder.audio_page_index;
+    _decoder.seg_index = _decoder.audio_seg_index;
+    _decoder.buffers.ring_slot = 0u;
+    VorbisOverlapReset(_decoder.buffers);
+    _decoder.pcm_read = 0u;
+    _decoder.frames_read = 0u;
+    _decoder.dither = VorbisDither{};
+    _decoder.error = 0u;
+    _decoder.packet_errors = 0u;
+    _decoder.last_packet_error = 0u;
+}
+
+// Decodes the packet at the decoder position. A packet that fails to decode,
+// or is empty, leaves a hole : it yields no frames and the next packet starts
+// without overlap. A packet that cannot be reassembled, at the truncated end
+// of a stream, ends the stream instead. Returns the packet error.
+std::uint32_t VorbisDecoderNextPacket(VorbisDecoder &_decoder,
+                                      VorbisAudioDecodeFunc _decode)
+{
+    std::size_t const page_index = _decoder.page_index;
+    std::size_t const seg_index = _decoder.seg_index;
+    std::uint32_t const error = _decode(*_decoder.pages, _decoder.id_header, _decoder.setup->header(),
+                                        _decoder.buffers, _decoder.page_index, _decoder.seg_index);
+    _decoder.pcm_read = 0u;
+    if (!error)
+        return 0u;
+
+    VORBIS_TRACE(kTraceWarning, kTracePackets, "packet at page %zu segment %zu skipped, error %08x",
+                 page_index, seg_index, (unsigned)error);
+    VorbisOverlapReset(_decoder.buffers);
+    ++_decoder.packet_errors;
+    _decoder.last_packet_error = error;
+    if (_decoder.page_index == page_index && _decoder.seg_index == seg_index)
+    {
+        _decoder.page_index = _decoder.pages->size();
+        _decoder.seg_index = 0u;
+    }
+    return error;
+}
+
+std::uint32_t VorbisDecoderOpen(VorbisDecoder &o_decoder,
+                                std::uint8_t const* _data,
+                                std::size_t _size)
+{
+    o_decoder.stream.assign(_size + VorbisDecodeBuffers::kPacketPadding, 0u);
+    std::copy(_data, _data + _size, o_decoder.stream.begin());
+
+    VorbisStageClock clock(o_decoder.buffers.profile);
+    o_decoder.ogg_pages = DecodeOgg(o_decoder.stream.data(), _size);
+    clock.Lap(kStageDemux);
+    std::vector<std::uint32_t> const vorbis_serials = GetVorbisSerials(o_decoder.ogg_pages);
+    if (vorbis_serials.empty())
+        return PackError(EVorbisError::kMissingHeader, 0u);
+    o_decoder.pages = &o_decoder.ogg_pages.at(vorbis_serials.front());
+
+    std::size_t page_index = 0u;
+    std::size_t seg_index = 0u;
+    std::uint32_t const res = VorbisHeaders(*o_decoder.pages, page_index, seg_index,
+                                            o_decoder.id_header, o_decoder.setup);
+    if (res >> 16u != EVorbisError::kNoError)
+        return res;
+
+    VorbisAllocateBuffers(o_decoder.id_header, o_decoder.setup->header(), o_decoder.buffers);
+    o_decoder.audio_page_index = page_index;
+    o_decoder.audio_seg_index = seg_index;
+
+    std::int64_t const last_granule = o_decoder.pages->back().granule_position;
+    o_decoder.frame_count = (last_granule >= 0) ? (std::uint64_t)last_granule : ~0ull;
+
+    VorbisDecoderReset(o_decoder);
+    return 0u;
+}
+
+// Largest packet of the stream and the most pages a packet spans.
+void VorbisStreamPacketBounds(PageContainer const& _pages,
+                              std::size_t &o_max_bytes,
+                              std::uint32_t &o_max_pages)
+{
+    o_max_bytes = 0u;
+    o_max_pages = 0u;
+    std::size_t packet_bytes = 0u;
+    std::uint32_t packet_pages = 0u;
+    for (PageDesc const& page : _pages)
+    {
+        packet_pages = packet_bytes ? packet_pages + 1u : 1u;
+        for (std::uint8_t i = 0u; i < page.segment_count; ++i)
+        {
+            packet_bytes += page.segment_table[i];
+            if (page.segment_table[i] < 255u)
+            {
+                o_max_bytes = std::max(o_max_bytes, packet_bytes);
+                o_max_pages = std::max(o_max_pages, packet_pages);
+                packet_bytes = 0u;
+                packet_pages = 1u;
+            }
+        }
+    }
+}
+
+// Switches an open decoder to real-time use: reserves the packet reassembly
+// buffer for the largest packet of the stream and caps the packets decoded
+// per read, so a read neither allocates, locks nor runs unbounded. Reads may
+// then return fewer frames than requested, none at all when the budget went on
+// packets without frames (the first one, and the one after each hole), without
+// being at the end of the stream : VorbisDecoderEndOfStream tells them apart.
+// At least two packets are allowed, so that the read after the first packet
+// of the stream always yields frames.
+std::uint32_t VorbisDecoderEnableRealtime(VorbisDecoder &_decoder,
+                                          std::uint32_t _max_packets_per_read)
+{
+    if (!_decoder.pages || !_decoder.setup)
+        return PackError(EVorbisError::kMissingHeader, 0u);
+
+    VorbisRealtimeLimits &limits = _decoder.realtime_limits;
+    limits = VorbisRealtimeLimits{};
+    limits.max_packets_per_read = std::max(2u, _max_packets_per_read);
+    VorbisStreamPacketBounds(*_decoder.pages, limits.max_packet_bytes, limits.max_packet_pages);
+    limits.max_imdct_per_packet = _decoder.id_header.audio_channels;
+    limits.max_imdct_size = 1u << _decoder.id_header.blocksize_1;
+
+    _decoder.buffers.packet.reserve(limits.max_packet_bytes + VorbisDecodeBuffers::kPacketPadding);
+    _decoder.realtime = true;
+    return 0u;
+}
+
+VorbisRealtimeLimits const& VorbisDecoderRealtimeLimits(VorbisDecoder const& _decoder)
+{
+    return _decoder.realtime_limits;
+}
+
+// True once every frame of the stream was read, or decoding stopped on an
+// error. A read returning no frames does not imply it in real-time mode.
+bool VorbisDecoderEndOfStream(VorbisDecoder const& _decoder)
+{
+    if (_decoder.error || _decoder.frames_read >= _decoder.frame_count)
+        return true;
+    return _decoder.pcm_read == _decoder.buffers.pcm.size && _decoder.page_index >= _decoder.pages->size();
+}
+
+// Pulls up to _frame_count frames, decoding packets as needed, and hands each
+// run of finished frames to _write(first, count, output_offset).
+template <typename WriteFunc>
+std::size_t VorbisDecoderRead(VorbisDecoder &_decoder,
+                              std::size_t _frame_count,
+                              WriteFunc &&_write)
+{
+    std::uint64_t const begin_ticks = _decoder.realtime ? VorbisProfileTicks() : 0u;
+    std::uint32_t const max_packets = _decoder.realtime ? _decoder.realtime_limits.max_packets_per_read : ~0u;
+    std::uint32_t packets = 0u;
+
+    std::size_t frames_written = 0u;
+    while (frames_written < _frame_count && !_decoder.error &&
+           _decoder.frames_read < _decoder.frame_count)
+    {
+        VorbisDecodeBuffers &buffers = _decoder.buffers;
+        if (_decoder.pcm_read == buffers.pcm.size)
+        {
+            if (_decoder.page_index >= _decoder.pages->size() || packets == max_packets)
+                break;
+            ++packets;
+            VorbisDecoderNextPacket(_decoder, &VorbisAudioDecode);
+            continue;
+        }
+
+        std::uint64_t const available = std::min<std::uint64_t>(buffers.pcm.size - _decoder.pcm_read,
+                                                                 _decoder.frame_count - _decoder.frames_read);
+        std::uint32_t const count = (std::uint32_t)std::min<std::uint64_t>(available,
+                                                                           _frame_count - frames_written);
+        VorbisStageClock clock(buffers.profile);
+        _write(_decoder.pcm_read, count, frames_written);
+        clock.Lap(kStageOutput);
+        buffers.profile.frames += count;
+        _decoder.pcm_read += count;
+        _decoder.frames_read += count;
+        frames_written += count;
+    }
+
+    if (_decoder.realtime)
+    {
+        std::uint64_t const ticks = VorbisProfileTicks() - begin_ticks;
+        std::uint64_t &max_ticks = _decoder.realtime_limits.max_ticks_per_read;
+        max_ticks = std::max(max_ticks, ticks);
+    }
+    return frames_written;
+}
+
+// Frames a VorbisDecoderDecodePackets call for _packet_count packets can
+// write at most : what is left of the current packet, then half a long block
+// per packet.
+std::size_t VorbisDecoderBatchFrames(VorbisDecoder const& _decoder,
+                                     std::uint32_t _packet_count)
+{
+    std::size_t const pending = _decoder.buffers.pcm.size - _decoder.pcm_read;
+    return pending + (std::size_t)_packet_count * ((1u << _decoder.id_header.blocksize_1) / 2u);
+}
+
+// Decodes up to _packet_count packets in one call for offline use, appending
+// the finished frames to the planar o_channels of _frame_capacity frames each.
+// The decode path is selected once for the whole run. Frames left over from
+// the current packet come first. The run stops at the end of the stream or
+// before a packet that might not fit; packets that fail to decode are holes.
+// o_packet_frames, when given, receives the frames of each decoded packet.
+std::size_t VorbisDecoderDecodePackets(VorbisDecoder &_decoder,
+                                       std::uint32_t _packet_count,
+                                       float* const* o_channels,
+                                       std::size_t _frame_capacity,
+                                       std::uint32_t* o_packet_frames = nullptr,
+                                       std::uint32_t* o_packets_decoded = nullptr)
+{
+    VorbisAudioDecodeFunc const decode = VorbisSelectAudioDecode(_decoder.id_header);
+    PageContainer const& pages = *_decoder.pages;
+    VorbisIDHeader const& id = _decoder.id_header;
+    VorbisDecodeBuffers &buffers = _decoder.buffers;
+    std::uint32_t const channel_count = id.audio_channels;
+    std::uint32_t const max_packet_frames = (1u << id.blocksize_1) / 2u;
+
+    float* channels[256];
+    std::size_t frames_written = 0u;
+    auto const flush = [&]()
+    {
+        std::uint64_t const available = std::min<std::uint64_t>(buffers.pcm.size - _decoder.pcm_read,
+                                                                 _decoder.frame_count - _decoder.frames_read);
+        std::uint32_t const count = (std::uint32_t)std::min<std::uint64_t>(available,
+                                                                           _frame_capacity - frames_written);
+        VorbisStageClock clock(buffers.profile);
+        for (std::uint32_t i = 0u; i < channel_count; ++i)
+            channels[i] = o_channels[i] + frames_written;
+        VorbisWritePcm(buffers, _decoder.pcm_read, count, channels);
+        clock.Lap(kStageOutput);
+        buffers.profile.frames += count;
+        _decoder.pcm_read += count;
+        _decoder.frames_read += count;
+        frames_written += count;
+        return count;
+    };
+
+    flush();
+
+    std::uint32_t packets = 0u;
+    while (packets < _packet_count && !_decoder.error &&
+           _decoder.pcm_read == buffers.pcm.size &&
+           _decoder.frames_read < _decoder.frame_count &&
+           _decoder.page_index < pages.size() &&
+           _frame_capacity - frames_written >= max_packet_frames)
+    {
+        VorbisDecoderNextPacket(_decoder, decode);
+        std::uint32_t const count = flush();
+        if (o_packet_frames)
+            o_packet_frames[packets] = count;
+        ++packets;
+    }
+
+    if (o_packets_decoded)
+        *o_packets_decoded = packets;
+    return frames_written;
+}
+
+// Planar float output, one pointer per channel.
+std::size_t VorbisDecoderReadFrames(VorbisDecoder &_decoder,
+                                    float* const* o_channels,
+                                    std::size_t _frame_count)
+{
+    std::uint32_t const channel_count = _decoder.id_header.audio_channels;
+    float* channels[256];
+    return VorbisDecoderRead(_decoder, _frame_count,
+                             [&](std::uint32_t _first, std::uint32_t _count, std::size_t _offset)
+                             {
+                                 for (std::uint32_t i = 0u; i < channel_count; ++i)
+                                     channels[i] = o_channels[i] + _offset;
+                                 VorbisWritePcm(_decoder.buffers, _first, _count, channels);
+                             });
+}
+
+// Interleaved 16 bit output, dithered when dither_enabled is set.
+std::size_t VorbisDecoderReadFrames(VorbisDecoder &_decoder,
+                                    std::int16_t* o_frames,
+                                    std::size_t _frame_count)
+{
+    std::uint32_t const channel_count = _decoder.id_header.audio_channels;
+    VorbisDither* dither = _decoder.dither_enabled ? &_decoder.dither : nullptr;
+    return VorbisDecoderRead(_decoder, _frame_count,
+                             [&](std::uint32_t _first, std::uint32_t _count, std::size_t _offset)
+                             {
+                                 VorbisWritePcmInterleaved<EVorbisPcmFormat::kInt16>(
+                                     _decoder.buffers, _first, _count, dither,
+                                     o_frames + _offset * channel_count);
+                             });
+}
+
+// =============================================================================
+// PARALLEL DECODE
+// =============================================================================
+
+// Packets only depend on each other through the overlap-add, so their decode
+// down to the windowed IMDCT output can run on any thread once the packet
+// boundaries are known.
+
+struct VorbisPacketPosition
+{
+    std::size_t page_index = 0u;
+    std::size_t seg_index = 0u;
+    std::uint32_t blocksize = 0u; // from the mode, 0 when the packet cannot be decoded
+};
+
+// Start of every packet from the given position on, in the form AssemblePacket
+// takes, with the blocksize read from the mode number.
+std::vector<VorbisPacketPosition> VorbisPacketIndex(PageContainer const& _pages,
+                                                    VorbisIDHeader const& _id,
+                                                    VorbisSetupHeader const& _setup,
+                                                    std::size_t _page_index,
+                                                    std::size_t _seg_index)
+{
+    int const mode_bits = (int)ilog(_setup.modes.size() - 1u);
+
+    std::vector<VorbisPacketPosition> index;
+    bool packet_begin = true;
+    for (std::size_t page_index = _page_index; page_index < _pages.size(); ++page_index)
+    {
+        PageDesc const& page = _pages[page_index];
+        std::size_t byte_offset = 0u;
+        for (std::size_t seg_index = 0u; seg_index < page.segment_count; ++seg_index)
+        {
+            std::uint8_t const lacing_value = page.segment_table[seg_index];
+            if (page_index == _page_index && seg_index < _seg_index)
+            {
+                byte_offset += lacing_value;
+                continue;
+            }
+
+            if (packet_begin)
+            {
+                VorbisPacketPosition position{ page_index, seg_index, 0u };
+                std::uint8_t const* read_position = page.stream_begin + byte_offset;
+                int bit_offset = 0;
+                if (lacing_value && !ReadBits(1, read_position, bit_offset))
+                {
+                    std::uint32_t const mode_index = ReadBits(mode_bits, read_position, bit_offset);
+                    if (mode_index < _setup.modes.size())
+                        position.blocksize = 1u << (_setup.modes[mode_index].blockflag ? _id.blocksize_1
+                                                                                       : _id.blocksize_0);
+                }
+                index.push_back(position);
+            }
+            packet_begin = lacing_value < 255u;
+            byte_offset += lacing_value;
+        }
+    }
+    return index;
+}
+
+// Output frames of the index before each packet : o_offsets[i] is the first
+// frame of packet i, o_offsets[size] the frame count of the whole run. Packets
+// without a blocksize are holes, neither they nor the next packet have output.
+void VorbisPacketFrameOffsets(std::vector<VorbisPacketPosition> const& _index,
+                              std::vector<std::uint64_t> &o_offsets)
+{
+    o_offsets.assign(_index.size() + 1u, 0u);
+    for (std::size_t i = 1u; i < _index.size(); ++i)
+    {
+        std::uint32_t const previous = _index[i - 1u].blocksize;
+        std::uint32_t const current = _index[i].blocksize;
+        o_offsets[i + 1u] = o_offsets[i] + ((previous && current) ? previous / 4u + current / 4u : 0u);
+    }
+}
+
+// One round of the parallel decode : the windowed IMDCT blocks of packets
+// [begin, begin + size), each packed at offsets[i] with the channels blocksize
+// apart, so that short blocks only take the room they need.
+struct VorbisParallelRound
+{
+    std::size_t begin = 0u;
+    std::size_t size = 0u;
+    std::vector<std::size_t> offsets;
+    std::vector<float> blocks;
+    std::vector<std::uint32_t> blocksizes; // 0 for holes
+    std::vector<std::uint32_t> errors;
+};
+
+// Workers kept for all the rounds of a parallel decode. A round is published
+// by bumping the generation, every worker decodes ranges of it until none are
+// left and checks in, the last one wakes the calling thread.
+struct VorbisParallelPool
+{
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::uint64_t generation = 0u;
+    std::uint32_t busy = 0u;
+    bool quit = false;
+    VorbisParallelRound* round = nullptr;
+    std::atomic<std::size_t> next_range{ 0u };
+};
+
+// Decodes the stream from its first audio packet on _thread_count threads, one
+// per core for 0. Threads take contiguous ranges of the packet index and keep
+// the windowed IMDCT blocks un-overlapped; the calling thread overlap-adds each
+// round in stream order while the workers decode the next one, and hands the
+// finished frames of each packet to _write(channels, count). Output matches
+// the streaming path, and the decoder is left at the end of the stream.
+// Returns the frame count.
+template <typename WriteFunc>
+std::uint64_t VorbisDecoderDecodeParallel(VorbisDecoder &_decoder,
+                                          unsigned _thread_count,
+                                          WriteFunc &&_write)
+{
+    constexpr std::size_t kRangePackets = 32u;
+    constexpr std::size_t kRoundRanges = 4u; // per thread, so that threads finish together
+
+    VorbisDecoderReset(_decoder);
+    PageContainer const& pages = *_decoder.pages;
+    VorbisIDHeader const& id = _decoder.id_header;
+    VorbisSetupHeader const& setup = _decoder.setup->header();
+    VorbisAudioDecodeFunc const decode = VorbisSelectAudioDecode(id);
+    std::vector<VorbisPacketPosition> const index = VorbisPacketIndex(pages, id, setup,
+                                                                      _decoder.audio_page_index,
+                                                                      _decoder.audio_seg_index);
+
+    std::size_t const range_count = (index.size() + kRangePackets - 1u) / kRangePackets;
+    if (!_thread_count)
+        _thread_count = std::thread::hardware_concurrency();
+    _thread_count = (unsigned)std::max<std::size_t>(1u, std::min<std::size_t>(_thread_count, range_count));
+
+    std::vector<VorbisDecodeBuffers> thread_buffers(_thread_count);
+    for (VorbisDecodeBuffers &buffers : thread_buffers)
+        VorbisAllocateBuffers(id, setup, buffers);
+
+    std::uint32_t const channel_count = id.audio_channels;
+    std::size_t const round_packets = std::min(index.size(), _thread_count * kRoundRanges * kRangePackets);
+    VorbisParallelRound rounds[2];
+    auto const prepare_round = [&](VorbisParallelRound &o_round, std::size_t _begin)
+    {
+        o_round.begin = _begin;
+        o_round.size = std::min(round_packets, index.size() - _begin);
+        o_round.offsets.resize(o_round.size + 1u);
+        o_round.offsets[0] = 0u;
+        for (std::size_t i = 0u; i < o_round.size; ++i)
+            o_round.offsets[i + 1u] = o_round.offsets[i] + std::size_t(index[_begin + i].blocksize) * channel_count;
+        o_round.blocks.resize(o_round.offsets[o_round.size]);
+        o_round.blocksizes.assign(o_round.size, 0u);
+        o_round.errors.assign(o_round.size, 0u);
+    };
+
+    VorbisParallelPool pool;
+    auto const decode_ranges = [&](VorbisParallelRound &_round, VorbisDecodeBuffers &_buffers)
+    {
+        for (;;)
+        {
+            std::size_t const begin = pool.next_range.fetch_add(1u, std::memory_order_relaxed) * kRangePackets;
+            if (begin >= _round.size)
+                break;
+            std::size_t const end = std::min(_round.size, begin + kRangePackets);
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                VorbisPacketPosition position = index[_round.begin + i];
+                std::uint32_t error = decode(pages, id, setup, _buffers,
+                                             position.page_index, position.seg_index);
+                // the round only has room for the blocksize of the index
+                if (!error && _buffers.blocksize != position.blocksize)
+                    error = PackError(EVorbisError::kInvalidStream, FInvalidStream::kUndecodablePacket);
+                _round.errors[i] = error;
+                if (error)
+                    continue;
+
+                // the block was written in ring_slot before it advanced
+                std::uint32_t const slot = _buffers.ring_slot ^ 1u;
+                std::uint32_t const blocksize = _buffers.blocksize;
+                _round.blocksizes[i] = blocksize;
+                for (std::uint32_t channel = 0u; channel < channel_count; ++channel)
+                {
+                    float const* block = VorbisBlock(_buffers, slot, channel);
+                    std::copy(block, block + blocksize,
+                              _round.blocks.data() + _round.offsets[i] + channel * blocksize);
+                }
+            }
+        }
+    };
+
+    auto const run_worker = [&](unsigned _thread_index)
+    {
+        std::uint64_t generation = 0u;
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        for (;;)
+        {
+            pool.wake.wait(lock, [&] { return pool.quit || pool.generation != generation; });
+            if (pool.quit)
+                return;
+            generation = pool.generation;
+            VorbisParallelRound &round = *pool.round;
+            lock.unlock();
+            decode_ranges(round, thread_buffers[_thread_index]);
+            lock.lock();
+            if (!--pool.busy)
+                pool.done.notify_one();
+        }
+    };
+
+    auto const start_round = [&](VorbisParallelRound &_round)
+    {
+        {
+            std::lock_guard<std::mutex> const lock(pool.mutex);
+            pool.round = &_round;
+            pool.next_range.store(0u, std::memory_order_relaxed);
+            pool.busy = _thread_count - 1u;
+            ++pool.generation;
+        }
+        pool.wake.notify_all();
+    };
+
+    // the calling thread takes what is left of the round, then waits for the workers
+    auto const finish_round = [&](VorbisParallelRound &_round)
+    {
+        decode_ranges(_round, thread_buffers[0]);
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.done.wait(lock, [&] { return !pool.busy; });
+    };
+
+    VorbisKernels const& kernels = *_decoder.buffers.kernels;
+    VorbisProfile &profile = _decoder.buffers.profile;
+    std::uint64_t frames = 0u;
+    float const* channels[256];
+
+    // last block of the previous round, the overlap of the first packet of the next
+    std::vector<float> carry(channel_count * (std::size_t(1u) << id.blocksize_1));
+    std::uint32_t carry_blocksize = 0u;
+    auto const stitch_round = [&](VorbisParallelRound &_round)
+    {
+        VorbisStageClock clock(profile);
+        for (std::size_t i = 0u; i < _round.size && frames < _decoder.frame_count; ++i)
+        {
+            // a hole, the next packet only primes the overlap as in VorbisDecoderNextPacket
+            if (_round.errors[i])
+            {
+                ++_decoder.packet_errors;
+                _decoder.last_packet_error = _round.errors[i];
+                continue;
+            }
+
+            // slot 0 is the previous block, slot 1 this one
+            float* const blocks[2] = { i ? _round.blocks.data() + _round.offsets[i - 1u] : carry.data(),
+                                       _round.blocks.data() + _round.offsets[i] };
+            std::uint32_t const blocksizes[2] = { i ? _round.blocksizes[i - 1u] : carry_blocksize,
+                                                  _round.blocksizes[i] };
+            VorbisPcmRange const pcm = VorbisOverlapRange(blocksizes[0], blocksizes[1], 0u, 1u);
+            for (std::uint32_t channel = 0u; channel < channel_count; ++channel)
+            {
+                float* samples = blocks[pcm.slot] + channel * blocksizes[pcm.slot] + pcm.offset;
+                float const* overlap = blocks[pcm.overlap_slot] + channel * blocksizes[pcm.overlap_slot]
+                    + pcm.overlap_offset;
+                kernels.overlap_add(samples + pcm.overlap_start, samples + pcm.overlap_start,
+                                    overlap, pcm.overlap_size);
+                channels[channel] = samples;
+            }
+            clock.Lap(kStageOverlap);
+
+            std::uint32_t const count = (std::uint32_t)std::min<std::uint64_t>(pcm.size,
+                                                                               _decoder.frame_count - frames);
+            if (count)
+                _write(channels, count);
+            clock.Lap(kStageOutput);
+            frames += count;
+        }
+
+        if (_round.size)
+        {
+            carry_blocksize = _round.blocksizes[_round.size - 1u];
+            float const* last = _round.blocks.data() + _round.offsets[_round.size - 1u];
+            std::copy(last, last + channel_count * carry_blocksize, carry.begin());
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(_thread_count - 1u);
+    for (unsigned thread_index = 1u; thread_index < _thread_count; ++thread_index)
+        threads.emplace_back(run_worker, thread_index);
+
+    // round k + 1 is decoded while round k is stitched
+    std::uint32_t current = 0u;
+    if (!index.empty())
+    {
+        prepare_round(rounds[0], 0u);
+        start_round(rounds[0]);
+        finish_round(rounds[0]);
+    }
+    while (rounds[current].size && !_decoder.error && frames < _decoder.frame_count)
+    {
+        VorbisParallelRound &round = rounds[current];
+        VorbisParallelRound &next = rounds[current ^ 1u];
+        std::size_t const next_begin = round.begin + round.size;
+        next.size = 0u;
+        if (next_begin < index.size())
+        {
+            prepare_round(next, next_begin);
+            start_round(next);
+        }
+        stitch_round(round);
+        if (next.size)
+            finish_round(next);
+        current ^= 1u;
+    }
+
+    {
+        std::lock_guard<std::mutex> const lock(pool.mutex);
+        pool.quit = true;
+    }
+    pool.wake.notify_all();
+    for (std::thread &thread : threads)
+        thread.join();
+
+    for (VorbisDecodeBuffers const& buffers : thread_buffers)
+        VorbisProfileAccumulate(buffers.profile, profile);
+    profile.frames += frames;
+    _decoder.frames_read = frames;
+    _decoder.page_index = pages.size();
+    _decoder.seg_index = 0u;
+    return frames;
+}
+
+// =============================================================================
+// BATCH DECODE
+// =============================================================================
+
+// Decodes many files on a pool of workers. Files are dealt to the workers'
+// queues up front; files past kBatchSplitBytes are opened once and split into
+// packet ranges, pushed back on the queue of the worker that opened them. A
+// worker takes the newest task of its own queue and steals the oldest task of
+// another queue when it runs dry, so that long files do not leave cores idle
+// at the end of a batch.
+
+constexpr std::size_t kBatchSplitBytes = 1u << 20;
+constexpr std::size_t kBatchRangePackets = 256u;
+
+struct VorbisBatchResult
+{
+    std::uint64_t frames = 0u;
+    std::uint32_t error = 0u; // packed error of the headers, the file was not decoded
+    std::uint64_t packet_errors = 0u; // packets skipped as holes
+    std::uint32_t sample_rate = 0u;
+    std::uint8_t channels = 0u;
+    bool unreadable = false;
+};
+
+struct VorbisBatchStats
+{
+    std::uint64_t files = 0u;
+    std::uint64_t failed_files = 0u;
+    std::uint64_t packet_errors = 0u;
+    std::uint64_t frames = 0u;
+    std::uint64_t samples = 0u; // frames times channels
+    double audio_seconds = 0.0;
+    double wall_seconds = 0.0;
+    std::uint32_t threads = 0u;
+    std::uint64_t tasks = 0u;
+    std::uint64_t steals = 0u;
+};
+
+// A file task has range_begin == range_end.
+struct VorbisBatchTask
+{
+    std::uint32_t file_index = 0u;
+    std::uint32_t range_begin = 0u;
+    std::uint32_t range_end = 0u;
+};
+
+// A split file, shared by its range tasks until the last one completes.
+struct VorbisBatchStream
+{
+    std::unique_ptr<VorbisDecoder> decoder;
+    std::vector<VorbisPacketPosition> index;
+    std::vector<std::uint64_t> frame_offsets;
+    std::atomic<std::uint64_t> frames{ 0u };
+    std::atomic<std::uint64_t> packet_errors{ 0u };
+    std::atomic<std::uint32_t> pending_ranges{ 0u };
+};
+
+struct VorbisBatchWorker
+{
+    std::mutex mutex;
+    std::deque<VorbisBatchTask> tasks;
+
+    VorbisDecoder decoder; // reused from task to task, with its scratch arena
+    std::vector<std::uint8_t> file_data;
+    std::uint64_t tasks_run = 0u;
+    std::uint64_t steals = 0u;
+};
+
+bool VorbisBatchReadFile(char const* _path,
+                         std::vector<std::uint8_t> &o_data)
+{
+    std::ifstream file(_path, std::ios_base::binary | std::ios_base::ate);
+    if (!file)
+        return false;
+    std::streamsize const size = file.tellg();
+    file.seekg(0, std::ios_base::beg);
+    o_data.resize((std::size_t)std::max<std::streamsize>(0, size));
+    return (bool)file.read(reinterpret_cast<char*>(o_data.data()), size);
+}
+
+// Decodes packets [_begin, _end) of a split stream into _buffers. The packet
+// before the range is decoded first for its overlap, so that the output is the
+// same as the streaming path's. Packets that fail to decode are holes, as in
+// VorbisDecoderNextPacket.
+template <typename WriteFunc>
+void VorbisBatchDecodeRange(VorbisBatchStream &_stream,
+                            std::uint32_t _file_index,
+                            std::uint32_t _begin,
+                            std::uint32_t _end,
+                            VorbisDecodeBuffers &_buffers,
+                            WriteFunc &&_write)
+{
+    VorbisDecoder const& decoder = *_stream.decoder;
+    PageContainer const& pages = *decoder.pages;
+    VorbisIDHeader const& id = decoder.id_header;
+    VorbisSetupHeader const& setup = decoder.setup->header();
+    VorbisAudioDecodeFunc const decode = VorbisSelectAudioDecode(id);
+
+    VorbisAllocateBuffers(id, setup, _buffers);
+    float const* channels[256];
+    std::uint64_t frames = 0u;
+    std::uint64_t packet_errors = 0u;
+    for (std::uint32_t packet = _begin ? _begin - 1u : 0u; packet < _end; ++packet)
+    {
+        std::uint64_t const offset = _stream.frame_offsets[packet];
+        if (offset >= decoder.frame_count)
+            break;
+
+        VorbisPacketPosition position = _stream.index[packet];
+        if (decode(pages, id, setup, _buffers, position.page_index, position.seg_index))
+        {
+            VorbisOverlapReset(_buffers);
+            packet_errors += (packet >= _begin) ? 1u : 0u;
+            continue;
+        }
+        if (packet < _begin)
+            continue;
+
+        std::uint32_t const size = VorbisPcmSpans(_buffers, channels);
+        std::uint32_t const count = (std::uint32_t)std::min<std::uint64_t>(size, decoder.frame_count - offset);
+        if (count)
+            _write(_file_index, offset, channels, count);
+        frames += count;
+    }
+    _buffers.profile.frames += frames;
+    _stream.frames.fetch_add(frames, std::memory_order_relaxed);
+    _stream.packet_errors.fetch_add(packet_errors, std::memory_order_relaxed);
+}
+
+// Decodes _paths on _thread_count workers, one per core for 0, and fills
+// o_results in the order of _paths. _write(file_index, frame_offset, channels,
+// count) receives the planar output as it is decoded; it is called from all
+// workers at once, and the ranges of a split file come out of order. Frame
+// offsets of a split file come from its packet index: a packet that fails to
+// decode past its mode number leaves a gap there instead of closing it up.
+template <typename WriteFunc>
+VorbisBatchStats VorbisDecodeBatch(std::vector<char const*> const& _paths,
+                                   unsigned _thread_count,
+                                   std::vector<VorbisBatchResult> &o_results,
+                                   WriteFunc &&_write)
+{
+    using Clock_t = std::chrono::steady_clock;
+    Clock_t::time_point const begin = Clock_t::now();
+
+    if (!_thread_count)
+        _thread_count = std::thread::hardware_concurrency();
+    _thread_count = std::max(1u, _thread_count);
+
+    o_results.assign(_paths.size(), VorbisBatchResult{});
+    std::vector<std::unique_ptr<VorbisBatchStream>> streams(_paths.size());
+    std::vector<std::unique_ptr<VorbisBatchWorker>> workers(_thread_count);
+    for (std::unique_ptr<VorbisBatchWorker> &worker : workers)
+        worker = std::make_unique<VorbisBatchWorker>();
+    for (std::uint32_t file_index = 0u; file_index < _paths.size(); ++file_index)
+        workers[file_index % _thread_count]->tasks.push_back(VorbisBatchTask{ file_index, 0u, 0u });
+
+    // queued and running tasks, a task adds its subtasks before it completes
+    std::atomic<std::size_t> pending_tasks{ _paths.size() };
+
+    auto const run_file = [&](VorbisBatchWorker &_worker, std::uint32_t _file_index)
+    {
+        VorbisBatchResult &result = o_results[_file_index];
+        if (!VorbisBatchReadFile(_paths[_file_index], _worker.file_data))
+        {
+            result.unreadable = true;
+            return;
+        }
+
+        bool const split = _worker.file_data.size() > kBatchSplitBytes;
+        std::unique_ptr<VorbisDecoder> split_decoder = split ? std::make_unique<VorbisDecoder>() : nullptr;
+        VorbisDecoder &decoder = split ? *split_decoder : _worker.decoder;
+        result.error = VorbisDecoderOpen(decoder, _worker.file_data.data(), _worker.file_data.size());
+        if (result.error)
+            return;
+        result.channels = decoder.id_header.audio_channels;
+        result.sample_rate = decoder.id_header.audio_sample_rate;
+
+        if (!split)
+        {
+            VorbisAudioDecodeFunc const decode = VorbisSelectAudioDecode(decoder.id_header);
+            float const* channels[256];
+            std::uint64_t &frames = result.frames;
+            while (frames < decoder.frame_count && decoder.page_index < decoder.pages->size())
+            {
+                if (VorbisDecoderNextPacket(decoder, decode))
+                    continue;
+                std::uint32_t const size = VorbisPcmSpans(decoder.buffers, channels);
+                std::uint32_t const count = (std::uint32_t)std::min<std::uint64_t>(size,
+                                                                                   decoder.frame_count - frames);
+                if (count)
+                    _write(_file_index, frames, channels, count);
+                frames += count;
+            }
+            decoder.buffers.profile.frames += frames;
+            result.packet_errors = decoder.packet_errors;
+            return;
+        }
+
+        std::unique_ptr<VorbisBatchStream> &stream = streams[_file_index];
+        stream = std::make_unique<VorbisBatchStream>();
+        stream->index = VorbisPacketIndex(*decoder.pages, decoder.id_header, decoder.setup->header(),
+                                          decoder.audio_page_index, decoder.audio_seg_index);
+        VorbisPacketFrameOffsets(stream->index, stream->frame_offsets);
+        stream->decoder = std::move(split_decoder);
+
+        std::uint32_t const packet_count = (std::uint32_t)stream->index.size();
+        std::uint32_t const range_count = (packet_count + kBatchRangePackets - 1u) / kBatchRangePackets;
+        if (!range_count)
+        {
+            streams[_file_index].reset();
+            return;
+        }
+        stream->pending_ranges.store(range_count, std::memory_order_relaxed);
+
+        pending_tasks.fetch_add(range_count, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(_worker.mutex);
+        for (std::uint32_t range_begin = 0u; range_begin < packet_count; range_begin += kBatchRangePackets)
+        {
+            std::uint32_t const range_end = std::min<std::uint32_t>(packet_count, range_begin + kBatchRangePackets);
+            _worker.tasks.push_back(VorbisBatchTask{ _file_index, range_begin, range_end });
+        }
+    };
+
+    auto const run_range = [&](VorbisBatchWorker &_worker, VorbisBatchTask const& _task)
+    {
+        VorbisBatchStream &stream = *streams[_task.file_index];
+        VorbisBatchDecodeRange(stream, _task.file_index, _task.range_begin, _task.range_end,
+                               _worker.decoder.buffers, _write);
+        if (stream.pending_ranges.fetch_sub(1u, std::memory_order_acq_rel) != 1u)
+            return;
+
+        VorbisBatchResult &result = o_results[_task.file_index];
+        result.frames = stream.frames.load(std::memory_order_relaxed);
+        result.packet_errors = stream.packet_errors.load(std::memory_order_relaxed);
+        streams[_task.file_index].reset();
+    };
+
+    auto const run_worker = [&](std::uint32_t _worker_index)
+    {
+        VorbisBatchWorker &worker = *workers[_worker_index];
+        while (pending_tasks.load(std::memory_order_acquire))
+        {
+            VorbisBatchTask task;
+            bool found = false;
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                if (!worker.tasks.empty())
+                {
+                    task = worker.tasks.back();
+                    worker.tasks.pop_back();
+                    found = true;
+                }
+            }
+            for (std::uint32_t i = 1u; !found && i < _thread_count; ++i)
+            {
+                VorbisBatchWorker &victim = *workers[(_worker_index + i) % _thread_count];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.tasks.empty())
+                {
+                    task = victim.tasks.front();
+                    victim.tasks.pop_front();
+                    found = true;
+                    ++worker.steals;
+                }
+            }
+            if (!found)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            if (task.range_begin == task.range_end)
+                run_file(worker, task.file_index);
+            else
+                run_range(worker, task);
+            ++worker.tasks_run;
+            pending_tasks.fetch_sub(1u, std::memory_order_acq_rel);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::uint32_t worker_index = 1u; worker_index < _thread_count; ++worker_index)
+        threads.emplace_back(run_worker, worker_index);
+    run_worker(0u);
+    for (std::thread &thread : threads)
+        thread.join();
+
+    VorbisBatchStats stats;
+    stats.threads = _thread_count;
+    for (std::unique_ptr<VorbisBatchWorker> const& worker : workers)
+    {
+        stats.tasks += worker->tasks_run;
+        stats.steals += worker->steals;
+    }
+    for (VorbisBatchResult const& result : o_results)
+    {
+        ++stats.files;
+        stats.failed_files += (result.unreadable || result.error) ? 1u : 0u;
+        stats.packet_errors += result.packet_errors;
+        stats.frames += result.frames;
+        stats.samples += result.frames * result.channels;
+        if (result.sample_rate)
+            stats.audio_seconds += (double)result.frames / (double)result.sample_rate;
+    }
+    stats.wall_seconds = std::chrono::duration<double>(Clock_t::now() - begin).count();
+    return stats;
+}
+
+// =============================================================================
+// ENCODER
+// =============================================================================
+
+// Minimal encoder producing test streams : one floor, either floor 1 with only
+// the two end posts or floor 0 with a fixed order 2 LSP curve, one residue 2
+// over every channel with a cascade of 2-dimensional VQ books, no coupling.
+
+struct VorbisBitWriter
+{
+    std::vector<std::uint8_t> bytes;
+    int bit_offset = 8;
+};
+
+// LSB first, the reverse of ReadBits.
+void WriteBits(int _count,
+               std::uint32_t _value,
+               VorbisBitWriter &_writer)
+{
+    for (int i = 0; i < _count; ++i)
+    {
+        if (_writer.bit_offset == 8)
+        {
+            _writer.bytes.push_back(0u);
+            _writer.bit_offset = 0;
+        }
+        _writer.bytes.back() |= (std::uint8_t)(((_value >> i) & 1u) << _writer.bit_offset);
+        ++_writer.bit_offset;
+    }
+}
+
+void WriteBytes(char const* _bytes,
+                std::size_t _size,
+                VorbisBitWriter &_writer)
+{
+    for (std::size_t i = 0u; i < _size; ++i)
+        WriteBits(8, (std::uint8_t)_bytes[i], _writer);
+}
+
+// 21 bit mantissa, 10 bit exponent biased by 788, sign.
+std::uint32_t VorbisPackFloat32(float _value)
+{
+    if (_value == 0.f)
+        return 0u;
+
+    std::uint32_t const sign = (_value < 0.f) ? 0x80000000u : 0u;
+    int exponent = 0;
+    double const mantissa = std::frexp(std::fabs((double)_value), &exponent);
+    return sign
+        | ((std::uint32_t)(exponent - 1 + 768) << 21u)
+        | (std::uint32_t)std::lround(std::ldexp(mantissa, 21));
+}
+
+// Code lengths of a Huffman code over _weights, merging the two lightest
+// subtrees until one is left.
+std::vector<std::uint8_t> VorbisHuffmanLengths(std::vector<std::uint64_t> const& _weights)
+{
+    std::size_t const leaf_count = _weights.size();
+    std::vector<std::uint64_t> weights = _weights;
+    std::vector<std::size_t> parents(leaf_count, 0u);
+    std::vector<std::size_t> roots(leaf_count);
+    for (std::size_t i = 0u; i < leaf_count; ++i)
+        roots[i] = i;
+
+    while (roots.size() > 1u)
+    {
+        auto const lighter = [&](std::size_t _lhs, std::size_t _rhs)
+        {
+            return weights[_lhs] < weights[_rhs];
+        };
+        std::partial_sort(roots.begin(), roots.begin() + 2, roots.end(), lighter);
+
+        std::size_t const node = weights.size();
+        weights.push_back(weights[roots[0]] + weights[roots[1]]);
+        parents.push_back(0u);
+        parents[roots[0]] = node;
+        parents[roots[1]] = node;
+        roots.erase(roots.begin());
+        roots[0] = node;
+    }
+
+    std::vector<std::uint8_t> lengths(leaf_count, 1u);
+    if (leaf_count > 1u)
+    {
+        std::size_t const root = weights.size() - 1u;
+        for (std::size_t i = 0u; i < leaf_count; ++i)
+        {
+            std::uint8_t length = 0u;
+            for (std::size_t node = i; node != root; node = parents[node])
+                ++length;
+            lengths[i] = length;
+        }
+    }
+    return lengths;
+}
+
+struct VorbisEncoderParams
+{
+    std::uint8_t channels = 2u;
+    std::uint32_t sample_rate = 44100u;
+    std::uint8_t blocksize_0 = 8u;
+    std::uint8_t blocksize_1 = 11u;
+    std::uint32_t bitrate = 128000u;
+    std::uint8_t floor_type = 1u;
+    double seconds = 2.;
+    std::uint32_t seed = 1u;
+};
+
+// Only the amplitude of the floor 0 curve is coded, its single book holds the
+// LSP frequencies of kFloor0Lsp.
+constexpr float kFloor0Lsp[2] = { 1.f, 2.f };
+
+VorbisFloorDesc::Floor0 VorbisEncoderFloor0(VorbisEncoderParams const& _params,
+                                            std::uint8_t _book)
+{
+    VorbisFloorDesc::Floor0 floor;
+    floor.order = 2u;
+    floor.rate = (std::uint16_t)std::min(_params.sample_rate, 65535u);
+    floor.bark_map_size = 256u;
+    floor.amplitude_bits = 8u;
+    floor.amplitude_offset = 100u;
+    floor.book_count = 1u;
+    floor.codebooks = { _book };
+    Floor0ComputeBarkMaps(_params.blocksize_0, _params.blocksize_1, floor);
+    return floor;
+}
+
+// Residue values are written as kStages balanced base kValues digits, one
+// cascade pass per digit, most significant first. Partition class c codes the
+// last c digits only, class 0 partitions are silent.
+struct VorbisEncoderBooks
+{
+    static constexpr int kStages = 3;
+    static constexpr int kQuantRange = 7;
+    static constexpr std::uint32_t kValues = 2u * kQuantRange + 1u;
+    static constexpr int kMaxValue = (int)(kValues * kValues * kValues - 1u) / 2;
+    static constexpr std::uint32_t kPartitionFrames = 32u;
+
+    // MSB first codewords
+    std::vector<std::uint8_t> class_lengths;
+    std::vector<std::uint32_t> class_codewords;
+    std::vector<std::uint8_t> lengths[kStages];
+    std::vector<std::uint32_t> codewords[kStages];
+};
+
+VorbisEncoderBooks VorbisEncoderBuildBooks()
+{
+    VorbisEncoderBooks books;
+    books.class_lengths = { 1u, 2u, 3u, 3u };
+    Huffman_ComputeCodewords(books.class_lengths, books.class_codewords);
+
+    // Laplacian models of the digits, pairs are coded jointly
+    static double const kDecay[VorbisEncoderBooks::kStages] = { 3.0, 2.0, 0.9 };
+    std::uint32_t const values = VorbisEncoderBooks::kValues;
+    for (int stage = 0; stage < VorbisEncoderBooks::kStages; ++stage)
+    {
+        std::vector<std::uint64_t> weights(values * values);
+        for (std::uint32_t entry = 0u; entry < values * values; ++entry)
+        {
+            int const a = (int)(entry % values) - VorbisEncoderBooks::kQuantRange;
+            int const b = (int)(entry / values) - VorbisEncoderBooks::kQuantRange;
+            double const p = std::exp(-kDecay[stage] * (std::abs(a) + std::abs(b)));
+            weights[entry] = std::max<std::uint64_t>(1u, (std::uint64_t)(p * 65536.));
+        }
+        books.lengths[stage] = VorbisHuffmanLengths(weights);
+        Huffman_ComputeCodewords(books.lengths[stage], books.codewords[stage]);
+    }
+    return books;
+}
+
+// Digit of _value coded by cascade pass _stage, in [-kQuantRange, kQuantRange].
+inline int VorbisEncoderDigit(int _value, int _stage)
+{
+    int const values = (int)VorbisEncoderBooks::kValues;
+    int digit = 0;
+    for (int stage = VorbisEncoderBooks::kStages - 1; stage >= _stage; --stage)
+    {
+        digit = (_value % values + values + VorbisEncoderBooks::kQuantRange) % values
+            - VorbisEncoderBooks::kQuantRange;
+        _value = (_value - digit) / values;
+    }
+    return digit;
+}
+
+inline void VorbisWriteCodeword(std::uint32_t _codeword,
+                                std::uint8_t _length,
+                                VorbisBitWriter &_writer)
+{
+    for (int bit = _length - 1; bit >= 0; --bit)
+        WriteBits(1, (_codeword >> bit) & 1u, _writer);
+}
+
+std::vector<std::uint8_t> VorbisEncodeIDHeader(VorbisEncoderParams const& _params)
+{
+    VorbisBitWriter writer;
+    WriteBits(8, 1u, writer);
+    WriteBytes("vorbis", 6u, writer);
+    WriteBits(32, 0u, writer);
+    WriteBits(8, _params.channels, writer);
+    WriteBits(32, _params.sample_rate, writer);
+    WriteBits(32, 0u, writer);
+    WriteBits(32, _params.bitrate, writer);
+    WriteBits(32, 0u, writer);
+    WriteBits(4, _params.blocksize_0, writer);
+    WriteBits(4, _params.blocksize_1, writer);
+    WriteBits(1, 1u, writer);
+    return std::move(writer.bytes);
+}
+
+std::vector<std::uint8_t> VorbisEncodeCommentHeader()
+{
+    static char const kVendor[] = "vorbis_decoder test encoder";
+    VorbisBitWriter writer;
+    WriteBits(8, 3u, writer);
+    WriteBytes("vorbis", 6u, writer);
+    WriteBits(32, sizeof(kVendor) - 1u, writer);
+    WriteBytes(kVendor, sizeof(kVendor) - 1u, writer);
+    WriteBits(32, 0u, writer);
+    WriteBits(1, 1u, writer);
+    return std::move(writer.bytes);
+}
+
+std::vector<std::uint8_t> VorbisEncodeSetupHeader(VorbisEncoderParams const& _params,
+                                                  VorbisEncoderBooks const& _books)
+{
+    VorbisBitWriter writer;
+    WriteBits(8, 5u, writer);
+    WriteBytes("vorbis", 6u, writer);
+
+    // codebooks : classification, one per digit, then the floor 0 curve
+    int const stages = VorbisEncoderBooks::kStages;
+    bool const floor0 = (_params.floor_type == 0u);
+    WriteBits(8, floor0 ? stages + 1 : stages, writer);
+    WriteBits(24, 0x564342u, writer);
+    WriteBits(16, 1u, writer);
+    WriteBits(24, _books.class_lengths.size(), writer);
+    WriteBits(1, 0u, writer);
+    WriteBits(1, 0u, writer);
+    for (std::uint8_t length : _books.class_lengths)
+        WriteBits(5, length - 1u, writer);
+    WriteBits(4, 0u, writer);
+
+    std::uint32_t const values = VorbisEncoderBooks::kValues;
+    float delta = 1.f;
+    for (int stage = 1; stage < stages; ++stage)
+        delta *= (float)values;
+    for (int stage = 0; stage < stages; ++stage, delta /= (float)values)
+    {
+        WriteBits(24, 0x564342u, writer);
+        WriteBits(16, 2u, writer);
+        WriteBits(24, values * values, writer);
+        WriteBits(1, 0u, writer);
+        WriteBits(1, 0u, writer);
+        for (std::uint8_t length : _books.lengths[stage])
+            WriteBits(5, length - 1u, writer);
+        WriteBits(4, 1u, writer);
+        WriteBits(32, VorbisPackFloat32(-delta * VorbisEncoderBooks::kQuantRange), writer);
+        WriteBits(32, VorbisPackFloat32(delta), writer);
+        WriteBits(4, 3u, writer);
+        WriteBits(1, 0u, writer);
+        for (std::uint32_t value = 0u; value < values; ++value)
+            WriteBits(4, value, writer);
+    }
+
+    if (floor0)
+    {
+        // one entry, kFloor0Lsp as min + delta * { 0, 1 }
+        WriteBits(24, 0x564342u, writer);
+        WriteBits(16, 2u, writer);
+        WriteBits(24, 1u, writer);
+        WriteBits(1, 0u, writer);
+        WriteBits(1, 0u, writer);
+        WriteBits(5, 0u, writer);
+        WriteBits(4, 2u, writer);
+        WriteBits(32, VorbisPackFloat32(kFloor0Lsp[0]), writer);
+        WriteBits(32, VorbisPackFloat32(kFloor0Lsp[1] - kFloor0Lsp[0]), writer);
+        WriteBits(4, 0u, writer);
+        WriteBits(1, 0u, writer);
+        WriteBits(1, 0u, writer);
+        WriteBits(1, 1u, writer);
+    }
+
+    // time domain transforms
+    WriteBits(6, 0u, writer);
+    WriteBits(16, 0u, writer);
+
+    if (floor0)
+    {
+        VorbisFloorDesc::Floor0 const floor = VorbisEncoderFloor0(_params, (std::uint8_t)(stages + 1));
+        WriteBits(6, 0u, writer);
+        WriteBits(16, 0u, writer);
+        WriteBits(8, floor.order, writer);
+        WriteBits(16, floor.rate, writer);
+        WriteBits(16, floor.bark_map_size, writer);
+        WriteBits(6, floor.amplitude_bits, writer);
+        WriteBits(8, floor.amplitude_offset, writer);
+        WriteBits(4, floor.book_count - 1u, writer);
+        WriteBits(8, floor.codebooks[0], writer);
+    }
+    else
+    {
+        // floor 1, end posts only
+        WriteBits(6, 0u, writer);
+        WriteBits(16, 1u, writer);
+        WriteBits(5, 0u, writer);
+        WriteBits(2, 0u, writer);
+        WriteBits(4, _params.blocksize_1 - 1u, writer);
+    }
+
+    // residue 2 over every channel, class 0 partitions are silent
+    WriteBits(6, 0u, writer);
+    WriteBits(16, 2u, writer);
+    WriteBits(24, 0u, writer);
+    WriteBits(24, (1u << (_params.blocksize_1 - 1u)) * _params.channels, writer);
+    // partitions hold whole frames, libvorbis assumes it for type 2 residues
+    WriteBits(24, VorbisEncoderBooks::kPartitionFrames * _params.channels - 1u, writer);
+    WriteBits(6, stages, writer);
+    WriteBits(8, 0u, writer);
+    for (int partition_class = 0; partition_class <= stages; ++partition_class)
+    {
+        WriteBits(3, (1u << stages) - (1u << (stages - partition_class)), writer);
+        WriteBits(1, 0u, writer);
+    }
+    for (int partition_class = 1; partition_class <= stages; ++partition_class)
+    {
+        for (int stage = stages - partition_class; stage < stages; ++stage)
+            WriteBits(8, 1u + stage, writer);
+    }
+
+    // mapping
+    WriteBits(6, 0u, writer);
+    WriteBits(16, 0u, writer);
+    WriteBits(1, 0u, writer);
+    WriteBits(1, 0u, writer);
+    WriteBits(2, 0u, writer);
+    WriteBits(8, 0u, writer);
+    WriteBits(8, 0u, writer);
+    WriteBits(8, 0u, writer);
+
+    // modes : short, long
+    WriteBits(6, 1u, writer);
+    for (std::uint32_t blockflag = 0u; blockflag < 2u; ++blockflag)
+    {
+        WriteBits(1, blockflag, writer);
+        WriteBits(16, 0u, writer);
+        WriteBits(16, 0u, writer);
+        WriteBits(8, 0u, writer);
+    }
+
+    WriteBits(1, 1u, writer);
+    return std::move(writer.bytes);
+}
+
+struct OggPageWriter
+{
+    std::vector<std::uint8_t> stream;
+    std::vector<std::uint8_t> body;
+    PageDesc page;
+};
+
+std::uint32_t OggChecksum(std::uint8_t const* _data, std::size_t _size)
+{
+    static std::uint32_t const* s_table = []()
+    {
+        static std::uint32_t table[256];
+        for (std::uint32_t i = 0u; i < 256u; ++i)
+        {
+            std::uint32_t r = i << 24u;
+            for (int bit = 0; bit < 8; ++bit)
+                r = (r & 0x80000000u) ? (r << 1u) ^ 0x04c11db7u : (r << 1u);
+            table[i] = r;
+        }
+        return table;
+    }();
+
+    std::uint32_t crc = 0u;
+    for (std::size_t i = 0u; i < _size; ++i)
+        crc = (crc << 8u) ^ s_table[(crc >> 24u) ^ _data[i]];
+    return crc;
+}
+
+void OggFlushPage(OggPageWriter &_writer, bool _last)
+{
+    PageDesc &page = _writer.page;
+    if (_last)
+        page.header_type |= PageDesc::kLastPage;
+
+    std::size_t const begin = _writer.stream.size();
+    std::vector<std::uint8_t> &stream = _writer.stream;
+    auto const write = [&stream](std::uint64_t _value, int _bytes)
+    {
+        for (int i = 0; i < _bytes; ++i)
+            stream.push_back((std::uint8_t)(_value >> (8 * i)));
+    };
+    stream.insert(stream.end(), { 'O', 'g', 'g', 'S', 0u, page.header_type });
+    write((std::uint64_t)page.granule_position, 8);
+    write(page.stream_serial_num, 4);
+    write(page.page_sequence_num, 4);
+    write(0u, 4);
+    write(page.segment_count, 1);
+    stream.insert(stream.end(), page.segment_table, page.segment_table + page.segment_count);
+    stream.insert(stream.end(), _writer.body.begin(), _writer.body.end());
+
+    page.page_checksum = OggChecksum(stream.data() + begin, stream.size() - begin);
+    for (int i = 0; i < 4; ++i)
+        stream[begin + 22u + i] = (std::uint8_t)(page.page_checksum >> (8 * i));
+
+    _writer.body.clear();
+    page.header_type = 0u;
+    page.granule_position = -1;
+    page.segment_count = 0u;
+    ++page.page_sequence_num;
+}
+
+// Laces the packet onto the current page, flushing full pages along the way.
+void OggWritePacket(OggPageWriter &_writer,
+                    std::vector<std::uint8_t> const& _packet,
+                    std::int64_t _granule_position)
+{
+    std::size_t offset = 0u;
+    for (;;)
+    {
+        if (_writer.page.segment_count == 255u)
+        {
+            OggFlushPage(_writer, false);
+            if (offset)
+                _writer.page.header_type |= PageDesc::kContinuedPacket;
+        }
+
+        std::size_t const size = std::min<std::size_t>(255u, _packet.size() - offset);
+        _writer.page.segment_table[_writer.page.segment_count++] = (std::uint8_t)size;
+        _writer.body.insert(_writer.body.end(), _packet.begin() + offset, _packet.begin() + offset + size);
+        offset += size;
+        if (size < 255u)
+            break;
+    }
+    _writer.page.granule_position = _granule_position;
+}
+
+// Two tones per channel under a decaying envelope, plus white noise.
+void VorbisEncoderSignal(VorbisEncoderParams const& _params,
+                         std::uint64_t _sample_count,
+                         std::vector<std::vector<float>> &o_signal)
+{
+    double const kTwoPi = 6.283185307179586;
+    std::uint32_t noise = _params.seed ? _params.seed : 1u;
+    o_signal.assign(_params.channels, std::vector<float>(_sample_count));
+    for (std::uint32_t channel = 0u; channel < _params.channels; ++channel)
+    {
+        double const frequency = 220. * (1. + 0.25 * channel);
+        for (std::uint64_t i = 0u; i < _sample_count; ++i)
+        {
+            double const t = (double)i / _params.sample_rate;
+            double const phase = t * 2. - std::floor(t * 2.);
+            double const envelope = 0.3 + 0.7 * std::exp(-6. * phase);
+            o_signal[channel][i] = (float)(
+                envelope * (0.3 * std::sin(kTwoPi * frequency * t)
+                            + 0.1 * std::sin(kTwoPi * 5.5 * frequency * t + channel))
+                + 0.02 * VorbisUniformNoise(VorbisXorshift(noise)));
+        }
+    }
+}
+
+// Forward MDCT, the inverse of VorbisImdct up to the window. _scratch holds N
+// floats.
+void VorbisMdctForward(VorbisMdct const& _mdct,
+                       float const* _in,
+                       float const* _window,
+                       float* _out,
+                       float* _scratch)
+{
+    std::uint32_t const n = _mdct.n;
+    std::uint32_t const n4 = n / 4u;
+    float* u = _scratch + n / 2u;
+    for (std::uint32_t j = 0u; j < n4; ++j)
+    {
+        std::uint32_t const a = 3u * n4 - 1u - j;
+        std::uint32_t const b = 3u * n4 + j;
+        u[j] = -_in[a] * _window[a] - _in[b] * _window[b];
+    }
+    for (std::uint32_t j = n4; j < 2u * n4; ++j)
+    {
+        std::uint32_t const a = j - n4;
+        std::uint32_t const b = 3u * n4 - 1u - j;
+        u[j] = _in[a] * _window[a] - _in[b] * _window[b];
+    }
+
+    VorbisDct4(VorbisGetKernels(), _mdct, u, _out, _scratch);
+    float const scale = 4.f / (float)n;
+    for (std::uint32_t j = 0u; j < n / 2u; ++j)
+        _out[j] *= scale;
+}
+
+// Encodes a generated signal. Blocks follow a fixed pattern of long and short
+// blocks and the quantizer step tracks the requested bitrate.
+std::vector<std::uint8_t> VorbisEncode(VorbisEncoderParams const& _params)
+{
+    std::uint32_t const channel_count = _params.channels;
+    std::uint32_t const n0 = 1u << _params.blocksize_0;
+    std::uint32_t const n1 = 1u << _params.blocksize_1;
+    std::uint64_t const sample_count = (std::uint64_t)(_params.seconds * _params.sample_rate);
+
+    std::vector<std::vector<float>> signal;
+    VorbisEncoderSignal(_params, sample_count, signal);
+
+    VorbisEncoderBooks const books = VorbisEncoderBuildBooks();
+    VorbisWindows const& windows = VorbisGetWindows(_params.blocksize_0, _params.blocksize_1);
+    float const* inverse_db = Floor1InverseDBTable();
+    bool const floor0 = (_params.floor_type == 0u);
+    VorbisFloorDesc::Floor0 const floor0_desc =
+        VorbisEncoderFloor0(_params, (std::uint8_t)(VorbisEncoderBooks::kStages + 1));
+
+    OggPageWriter ogg;
+    ogg.page.header_type = PageDesc::kFirstPage;
+    ogg.page.granule_position = 0;
+    ogg.page.stream_serial_num = _params.seed;
+    OggWritePacket(ogg, VorbisEncodeIDHeader(_params), 0);
+    OggFlushPage(ogg, false);
+    OggWritePacket(ogg, VorbisEncodeCommentHeader(), 0);
+    OggWritePacket(ogg, VorbisEncodeSetupHeader(_params, books), 0);
+    OggFlushPage(ogg, false);
+
+    // 12 long blocks then 8 short ones
+    auto const is_long = [&](std::int64_t _block)
+    {
+        return n0 == n1 || (_block % 20) < 12;
+    };
+
+    std::vector<float> input(n1);
+    std::vector<float> scratch(n1);
+    std::vector<float> spectrum(n1 / 2u);
+    std::vector<std::int16_t> quantized(n1 / 2u * channel_count);
+    std::vector<std::uint8_t> classes(n1 / 2u / VorbisEncoderBooks::kPartitionFrames);
+    std::vector<std::uint8_t> floor_y(channel_count);
+    std::vector<std::uint32_t> floor_amplitude(channel_count);
+    std::vector<float> inverse_steps(n1 / 2u); // per position, 1 / floor value
+
+    // quantizer levels at the spectral peak, tracked per blocksize
+    double levels[2] = { 32., 32. };
+    std::int64_t center = 0;
+    bool finished = false;
+    for (std::int64_t block = 0; !finished; ++block)
+    {
+        bool const blockflag = is_long(block);
+        bool const previous_flag = is_long(block ? block - 1 : 0);
+        bool const next_flag = is_long(block + 1);
+        std::uint32_t const n = blockflag ? n1 : n0;
+        std::uint32_t const n2 = n / 2u;
+        VorbisMdct const& mdct = VorbisGetMdct(blockflag ? _params.blocksize_1 : _params.blocksize_0);
+        float const* window = VorbisWindowShape(windows, blockflag, previous_flag, next_flag);
+        std::int64_t const start = center - (std::int64_t)n2;
+
+        // quantize every channel into the interleaved residue 2 vector
+        for (std::uint32_t channel = 0u; channel < channel_count; ++channel)
+        {
+            for (std::uint32_t k = 0u; k < n; ++k)
+            {
+                std::int64_t const t = start + k;
+                input[k] = (t >= 0 && t < (std::int64_t)sample_count) ? signal[channel][t] : 0.f;
+            }
+            VorbisMdctForward(mdct, input.data(), window, spectrum.data(), scratch.data());
+
+            float peak = 0.f;
+            for (std::uint32_t j = 0u; j < n2; ++j)
+                peak = std::max(peak, std::fabs(spectrum[j]));
+
+            if (floor0)
+            {
+                // smallest amplitude whose curve keeps every position within
+                // the levels
+                float const level = (float)levels[blockflag];
+                auto const fits = [&](std::uint32_t _amplitude)
+                {
+                    std::fill(inverse_steps.begin(), inverse_steps.begin() + n2, 1.f);
+                    Floor0Synthesis(floor0_desc, _amplitude, kFloor0Lsp, blockflag, n2, inverse_steps.data());
+                    for (std::uint32_t j = 0u; j < n2; ++j)
+                    {
+                        if (std::fabs(spectrum[j]) > inverse_steps[j] * level)
+                            return false;
+                    }
+                    return true;
+                };
+
+                std::uint32_t low = 1u;
+                std::uint32_t high = (1u << floor0_desc.amplitude_bits) - 1u;
+                while (low < high)
+                {
+                    std::uint32_t const amplitude = (low + high) / 2u;
+                    if (fits(amplitude))
+                        high = amplitude;
+                    else
+                        low = amplitude + 1u;
+                }
+                fits(low);
+                for (std::uint32_t j = 0u; j < n2; ++j)
+                    inverse_steps[j] = 1.f / inverse_steps[j];
+                floor_amplitude[channel] = low;
+            }
+            else
+            {
+                // smallest floor value at least as coarse as the step, so that
+                // the peak still fits in kMaxValue
+                float const step = peak / (float)levels[blockflag];
+                std::uint8_t const y = (std::uint8_t)std::min<std::ptrdiff_t>(
+                    255, std::lower_bound(inverse_db, inverse_db + 256, step) - inverse_db);
+                floor_y[channel] = (peak > 0.f) ? y : 0u;
+                std::fill(inverse_steps.begin(), inverse_steps.begin() + n2, 1.f / inverse_db[y]);
+            }
+
+            for (std::uint32_t j = 0u; j < n2; ++j)
+            {
+                long const q = (peak > 0.f) ? std::lround(spectrum[j] * inverse_steps[j]) : 0;
+                quantized[j * channel_count + channel] = (std::int16_t)std::max<long>(
+                    -VorbisEncoderBooks::kMaxValue, std::min<long>(VorbisEncoderBooks::kMaxValue, q));
+            }
+        }
+
+        VorbisBitWriter writer;
+        WriteBits(1, 0u, writer);
+        WriteBits(1, blockflag, writer);
+        if (blockflag)
+        {
+            WriteBits(1, previous_flag, writer);
+            WriteBits(1, next_flag, writer);
+        }
+
+        for (std::uint32_t channel = 0u; channel < channel_count; ++channel)
+        {
+            bool nonzero = false;
+            for (std::uint32_t j = 0u; j < n2 && !nonzero; ++j)
+                nonzero = (quantized[j * channel_count + channel] != 0);
+
+            if (floor0)
+            {
+                // amplitude 0 marks the channel unused, then book 0 and its
+                // single entry
+                WriteBits(floor0_desc.amplitude_bits, nonzero ? floor_amplitude[channel] : 0u, writer);
+                if (nonzero)
+                {
+                    WriteBits(ilog(floor0_desc.book_count), 0u, writer);
+                    VorbisWriteCodeword(0u, 1u, writer);
+                }
+                continue;
+            }
+
+            WriteBits(1, nonzero, writer);
+            if (nonzero)
+            {
+                WriteBits(8, floor_y[channel], writer);
+                WriteBits(8, floor_y[channel], writer);
+            }
+        }
+
+        std::uint32_t const vector_size = n2 * channel_count;
+        std::uint32_t const partition_size = VorbisEncoderBooks::kPartitionFrames * channel_count;
+        if (std::any_of(quantized.begin(), quantized.begin() + vector_size,
+                        [](std::int16_t _q) { return _q != 0; }))
+        {
+            int const stages = VorbisEncoderBooks::kStages;
+            std::uint32_t const partition_count = vector_size / partition_size;
+            for (std::uint32_t partition = 0u; partition < partition_count; ++partition)
+            {
+                int peak = 0;
+                for (std::uint32_t j = 0u; j < partition_size; ++j)
+                    peak = std::max(peak, std::abs((int)quantized[partition * partition_size + j]));
+
+                // class c reaches (kValues^c - 1) / 2
+                std::uint8_t partition_class = 0u;
+                for (int limit = 0; peak > limit; ++partition_class)
+                    limit = limit * (int)VorbisEncoderBooks::kValues + VorbisEncoderBooks::kQuantRange;
+                classes[partition] = partition_class;
+            }
+
+            for (int stage = 0; stage < stages; ++stage)
+            {
+                for (std::uint32_t partition = 0u; partition < partition_count; ++partition)
+                {
+                    std::uint8_t const partition_class = classes[partition];
+                    if (stage == 0)
+                        VorbisWriteCodeword(books.class_codewords[partition_class],
+                                            books.class_lengths[partition_class], writer);
+                    if (stage < stages - partition_class)
+                        continue;
+
+                    std::int16_t const* q = quantized.data() + partition * partition_size;
+                    for (std::uint32_t j = 0u; j < partition_size; j += 2u)
+                    {
+                        std::uint32_t const entry = (std::uint32_t)(
+                            VorbisEncoderDigit(q[j], stage) + VorbisEncoderBooks::kQuantRange
+                            + (VorbisEncoderDigit(q[j + 1u], stage) + VorbisEncoderBooks::kQuantRange)
+                            * (int)VorbisEncoderBooks::kValues);
+                        VorbisWriteCodeword(books.codewords[stage][entry], books.lengths[stage][entry], writer);
+                    }
+                }
+            }
+        }
+
+        // one step of rate control per packet, toward the nominal bits per block
+        std::uint32_t const previous_n = previous_flag ? n1 : n0;
+        double const target_bits = (double)_params.bitrate * (double)(previous_n / 4u + n / 4u)
+            / (double)_params.sample_rate;
+        double const bits = (double)writer.bytes.size() * 8.;
+        double &block_levels = levels[blockflag];
+        block_levels *= std::max(0.5, std::min(2., target_bits / std::max(bits, 1.)));
+        block_levels = std::max(0.5, std::min(VorbisEncoderBooks::kMaxValue + 0.5, block_levels));
+
+        if (ogg.body.size() >= 4096u)
+            OggFlushPage(ogg, false);
+        OggWritePacket(ogg, writer.bytes, std::min<std::int64_t>(center, (std::int64_t)sample_count));
+
+        // the packet ending on or past the last sample closes the stream
+        finished = block > 0 && center >= (std::int64_t)sample_count;
+        center += (std::int64_t)(n / 4u + (next_flag ? n1 : n0) / 4u);
+    }
+    ogg.page.granule_position = (std::int64_t)sample_count;
+    OggFlushPage(ogg, true);
+
+    return std::move(ogg.stream);
+}
+
+std::vector<BinaryNode> BuildHuffmanTree(std::vector<std::uint8_t> const& _lengths)
+{
+    std::vector<BinaryNode> tree(1);
+    tree.reserve(_lengths.size() * 2u);
+
+    std::uint32_t entry_count = 0u;
+    std::uint32_t entry_index = 0u;
+    for (std::uint8_t length : _lengths)
+    {
+        std::uint32_t const entry = entry_index++;
+        if (length == 0u) continue;
+        ++entry_count;
+
+        std::vector<std::size_t> path{ 0u };
+        while (path.back() < -2u)
+        {
+            std::size_t nindex = path.back();
+            if ((path.size() > 1u && !tree[nindex].left && !tree[nindex].right) ||
+                (path.size() == length+1))
+            {
+                path.pop_back();
+                while (!path.empty() && tree[path.back()].right == nindex)
+                {
+                    nindex = path.back();
+                    path.pop_back();
+                }
+                if (path.empty())
+                    return std::vector<BinaryNode>{};
+
+                nindex = path.back();
+
+                if (tree[nindex].right)
+                    path.push_back(tree[nindex].right);
+                else
+                    path.push_back(-2u);
+            }
+            else
+            {
+                if (tree[nindex].left)
+                    path.push_back(tree[nindex].left);
+                else
+                    path.push_back(-1u);
+            }
+
+            assert(path.back() <= -1u);
+            assert(path.size() <= length+1);
+        }
+
+        std::uint32_t codeword = 0u;
+        for (int i = 1; i < path.size()-1; ++i)
+        {
+            std::uint32_t bit = (path[i] == tree[path[i-1]].left) ? 0u : 1u;
+            codeword |= bit << (length-i);
+        }
+
+        std::size_t nindex = *std::next(path.rbegin(), 1);
+        tree.emplace_back();
+        if (path.back() == -2u)
+        {
+            codeword |= 1u << ((length+1)-path.size());
+            assert(!tree[nindex].right);
+            tree[nindex].right = tree.size()-1u;
+            nindex = tree[nindex].right;
+        }
+        else
+        {
+            assert(!tree[nindex].left);
+            tree[nindex].left = tree.size()-1u;
+            nindex = tree[nindex].left;
+        }
+
+        for (int i = 0; i < (length - (path.size()-1)); ++i)
+        {
+            tree.emplace_back();
+            tree[nindex].left = tree.size()-1u;
+            nindex = tree[nindex].left;
+        }
+
+        tree[nindex].v = codeword << (32 - length);
+        tree[nindex].length = length;
+        tree[nindex].entry = entry;
+        assert(!tree[nindex].left && !tree[nindex].right);
+    }
+
+    for (BinaryNode const &node : tree)
+    {
+        assert((!node.left && !node.right) ||
+               (node.left && node.right));
+    }
+    assert(tree.size() == (entry_count * 2u)-1u);
+
+    return tree;
+}
+
+HuffmanLUT Huffman_BuildLookupTable(std::vector<BinaryNode> const& _tree)
+{
+    HuffmanLUT result;
+    result.entries.reserve((_tree.size() + 1)/2);
+    result.lengths.reserve((_tree.size() + 1)/2);
+    result.indices.reserve((_tree.size() + 1)/2);
+
+    for (BinaryNode const& node : _tree)
+    {
+        if (node.v == -1u) continue;
+
+        auto entry_it = std::lower_bound(result.entries.begin(), result.entries.end(), node.v);
+        auto entry_index = std::distance(result.entries.begin(), entry_it);
+        auto lengths_it = std::next(result.lengths.begin(), entry_index);
+        auto indices_it = std::next(result.indices.begin(), entry_index);
+        result.entries.insert(entry_it, node.v);
+        result.lengths.insert(lengths_it, node.length);
+        result.indices.insert(indices_it, node.entry);
+    }
+
+    return result;
+}
+
+std::uint32_t Huffman_ReadEntry(HuffmanLUT const& _lut,
+                                std::uint8_t const* &_base_address,
+                                int &_bit_offset,
+                                int &o_bits_read)
+{
+    std::uint32_t buffer = 0u;
+    int bits_read = 0;
+    auto entry_it = std::prev(_lut.entries.end());
+    auto length_it = _lut.lengths.begin();
+
+    while (!(*length_it == bits_read && *entry_it == buffer))
+    {
+        if (bits_read == 32)
+        {
+            o_bits_read = -1;
+            return PackError(EVorbisError::kInvalidStream, FInvalidStream::kUnknownCodeword);
+        }
+
+        buffer |= (ReadBits(1, _base_address, _bit_offset) << (31-bits_read++));
+        entry_it = std::lower_bound(_lut.entries.begin(), _lut.entries.end(), buffer);
+        if (entry_it == _lut.entries.end())
+            --entry_it;
+        length_it = std::next(_lut.lengths.begin(), std::distance(_lut.entries.begin(), entry_it));
+    }
+
+    o_bits_read = bits_read;
+    return *std::next(_lut.indices.begin(), std::distance(_lut.entries.begin(), entry_it));
+}
+
+bool Huffman_ComputeCodewords(std::vector<std::uint8_t> const& _lengths,
+                              std::vector<std::uint32_t> &o_codewords)
+{
+    // available[l] holds the next free codeword of length l, MSB aligned
+    std::uint32_t available[33] = {};
+    bool first_entry = true;
+
+    o_codewords.assign(_lengths.size(), 0u);
+    for (std::size_t entry_index = 0u; entry_index < _lengths.size(); ++entry_index)
+    {
+        unsigned const length = _lengths[entry_index];
+        if (length == 0u) continue;
+
+        if (first_entry)
+        {
+            first_entry = false;
+            for (unsigned l = 1u; l <= length; ++l)
+                available[l] = 1u << (32u - l);
+            continue;
+        }
+
+        unsigned z = length;
+        while (z > 0u && !available[z]) --z;
+        if (z == 0u)
+            return false;
+
+        std::uint32_t const codeword = available[z];
+        available[z] = 0u;
+        for (unsigned l = length; l > z; --l)
+            available[l] = codeword + (1u << (32u - l));
+
+        o_codewords[entry_index] = codeword >> (32u - length);
+    }
+
+    return true;
+}
+
+struct HuffmanCode
+{
+    std::uint32_t bits; // stream order, first bit in the LSB
+    std::uint32_t length;
+    std::uint32_t entry;
+};
+
+void Huffman_FillTable(std::vector<std::uint32_t> &_slots,
+                       std::size_t _offset,
+                       int _width,
+                       int _shift,
+                       std::vector<HuffmanCode> &_codes)
+{
+    std::uint32_t const mask = (1u << _width) - 1u;
+    std::vector<HuffmanCode> long_codes;
+
+    for (HuffmanCode const& code : _codes)
+    {
+        std::uint32_t const remaining = code.length - _shift;
+        if (remaining <= (std::uint32_t)_width)
+        {
+            for (std::uint32_t k = code.bits >> _shift; k <= mask; k += 1u << remaining)
+                _slots[_offset + k] = (remaining << 24u) | code.entry;
+        }
+        else
+            long_codes.push_back(code);
+    }
+
+    std::stable_sort(long_codes.begin(), long_codes.end(),
+                     [_shift, mask](HuffmanCode const& _lhs, HuffmanCode const& _rhs)
+                     {
+                         return ((_lhs.bits >> _shift) & mask) < ((_rhs.bits >> _shift) & mask);
+                     });
+
+    auto group_begin = long_codes.begin();
+    while (group_begin != long_codes.end())
+    {
+        std::uint32_t const key = (group_begin->bits >> _shift) & mask;
+        auto const group_end = std::find_if(group_begin, long_codes.end(),
+                                            [_shift, mask, key](HuffmanCode const& _code)
+                                            {
+                                                return ((_code.bits >> _shift) & mask) != key;
+                                            });
+
+        std::uint32_t max_length = 0u;
+        for (auto it = group_begin; it != group_end; ++it)
+            max_length = std::max(max_length, it->length);
+
+        int const child_width = std::min((int)max_length - _shift - _width, HuffmanTable::kSecondaryBits);
+        std::size_t const child_offset = _slots.size();
+        _slots.resize(child_offset + (1u << child_width), 0u);
+        _slots[_offset + key] = HuffmanTable::kLinkFlag | ((std::uint32_t)child_width << 24u)
+            | (std::uint32_t)child_offset;
+
+        std::vector<HuffmanCode> group(group_begin, group_end);
+        Huffman_FillTable(_slots, child_offset, child_width, _shift + _width, group);
+
+        group_begin = group_end;
+    }
+}
+
+HuffmanTable Huffman_BuildTable(std::vector<std::uint8_t> const& _lengths,
+                                int _primary_bits)
+{
+    HuffmanTable result;
+
+    std::vector<std::uint32_t> codewords;
+    if (!Huffman_ComputeCodewords(_lengths, codewords))
+        return result;
+
+    std::vector<HuffmanCode> codes;
+    std::uint32_t max_length = 0u;
+    for (std::uint32_t entry_index = 0u; entry_index < _lengths.size(); ++entry_index)
+    {
+        std::uint32_t const length = _lengths[entry_index];
+        if (length == 0u) continue;
+        codes.push_back({ bit_reverse(codewords[entry_index], length), length, entry_index });
+        max_length = std::max(max_length, length);
+    }
+
+    if (codes.empty())
+        return result;
+
+    result.primary_bits = std::min((int)max_length, std::min(_primary_bits, 24));
+    result.slots.assign(1u << result.primary_bits, 0u);
+    Huffman_FillTable(result.slots, 0u, result.primary_bits, 0, codes);
+
+    if (result.slots.size() > 0x1000000u)
+        result.slots.clear();
+
+    return result;
+}
+
+std::uint32_t Huffman_DecodeEntry(std::uint32_t const* _slots,
+                                  int _primary_bits,
+                                  std::uint8_t const* &_base_address,
+                                  int &_bit_offset,
+                                  int &o_bits_read)
+{
+    std::uint32_t const* level = _slots;
+    int width = _primary_bits;
+    int bits_read = 0;
+
+    while (level)
+    {
+        std::uint32_t const slot = level[PeekBits(width, _base_address, _bit_offset)];
+        int const length = (int)((slot >> 24u) & 0x3fu);
+
+        if (!length)
+            break;
+
+        if (slot & HuffmanTable::kLinkFlag)
+        {
+            SkipBits(width, _base_address, _bit_offset);
+            bits_read += width;
+            level = _slots + (slot & 0xffffffu);
+            width = length;
+            continue;
+        }
+
+        SkipBits(length, _base_address, _bit_offset);
+        o_bits_read = bits_read + length;
+        return slot & 0xffffffu;
+    }
+
+    o_bits_read = -1;
+    return PackError(EVorbisError::kInvalidStream, FInvalidStream::kUnknownCodeword);
+}
+
+std::uint32_t Huffman_DecodeEntry(HuffmanTable const& _table,
+                                  std::uint8_t const* &_base_address,
+                                  int &_bit_offset,
+                                  int &o_bits_read)
+{
+    return Huffman_DecodeEntry(_table.slots.data(), _table.primary_bits,
+                               _base_address, _bit_offset, o_bits_read);
+}
+
+// =============================================================================
+// BENCHMARK
+// =============================================================================
+
+// Counts every allocation made through the global operator new, only when
+// built with VORBIS_COUNT_ALLOCATIONS=1 so that other builds keep the default
+// allocator. The replacements are kept out of line, inlined into callers gcc
+// mistakes them for a malloc / delete mismatch.
+#ifndef VORBIS_COUNT_ALLOCATIONS
+#define VORBIS_COUNT_ALLOCATIONS 0
+#endif
+
+#if VORBIS_COUNT_ALLOCATIONS
+
+#if defined(__GNUC__)
+#define BENCHMARK_NOINLINE __attribute__((noinline))
+#else
+#define BENCHMARK_NOINLINE
+#endif
+
+std::atomic<std::uint64_t> g_allocation_count{ 0u };
+
+// Retries through the new handler, as the default operator new does.
+void* BenchmarkAllocate(std::size_t _size, std::size_t _alignment)
+{
+    g_allocation_count.fetch_add(1u, std::memory_order_relaxed);
+    std::size_t const alignment = std::max(_alignment, alignof(std::max_align_t));
+    std::size_t const size = std::max<std::size_t>(1u, (_size + alignment - 1u) / alignment) * alignment;
+    for (;;)
+    {
+#if defined(_MSC_VER)
+        void* result = _aligned_malloc(size, alignment);
+#else
+        void* result = std::aligned_alloc(alignment, size);
+#endif
+        if (result)
+            return result;
+
+        std::new_handler const handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc{};
+        handler();
+    }
+}
+
+BENCHMARK_NOINLINE void* operator new(std::size_t _size)
+{
+    return BenchmarkAllocate(_size, 0u);
+}
+
+BENCHMARK_NOINLINE void* operator new(std::size_t _size, std::align_val_t _alignment)
+{
+    return BenchmarkAllocate(_size, (std::size_t)_alignment);
+}
+
+BENCHMARK_NOINLINE void* operator new(std::size_t _size, std::nothrow_t const&) noexcept
+{
+    try { return BenchmarkAllocate(_size, 0u); }
+    catch (std::bad_alloc const&) { return nullptr; }
+}
+
+BENCHMARK_NOINLINE void* operator new(std::size_t _size, std::align_val_t _alignment,
+                                      std::nothrow_t const&) noexcept
+{
+    try { return BenchmarkAllocate(_size, (std::size_t)_alignment); }
+    catch (std::bad_alloc const&) { return nullptr; }
+}
+
+void* operator new[](std::size_t _size) { return operator new(_size); }
+void* operator new[](std::size_t _size, std::align_val_t _alignment) { return operator new(_size, _alignment); }
+void* operator new[](std::size_t _size, std::nothrow_t const& _nothrow) noexcept
+{
+    return operator new(_size, _nothrow);
+}
+void* operator new[](std::size_t _size, std::align_val_t _alignment, std::nothrow_t const& _nothrow) noexcept
+{
+    return operator new(_size, _alignment, _nothrow);
+}
+
+BENCHMARK_NOINLINE void operator delete(void* _pointer) noexcept
+{
+#if defined(_MSC_VER)
+    _aligned_free(_pointer);
+#else
+    std::free(_pointer);
+#endif
+}
+
+void operator delete[](void* _pointer) noexcept { operator delete(_pointer); }
+void operator delete(void* _pointer, std::size_t) noexcept { operator delete(_pointer); }
+void operator delete[](void* _pointer, std::size_t) noexcept { operator delete(_pointer); }
+void operator delete(void* _pointer, std::nothrow_t const&) noexcept { operator delete(_pointer); }
+void operator delete[](void* _pointer, std::nothrow_t const&) noexcept { operator delete(_pointer); }
+void operator delete(void* _pointer, std::align_val_t) noexcept { operator delete(_pointer); }
+void operator delete[](void* _pointer, std::align_val_t) noexcept { operator delete(_pointer); }
+void operator delete(void* _pointer, std::size_t, std::align_val_t) noexcept { operator delete(_pointer); }
+void operator delete[](void* _pointer, std::size_t, std::align_val_t) noexcept { operator delete(_pointer); }
+void operator delete(void* _pointer, std::align_val_t, std::nothrow_t const&) noexcept { operator delete(_pointer); }
+void operator delete[](void* _pointer, std::align_val_t, std::nothrow_t const&) noexcept { operator delete(_pointer); }
+
+#endif
+
+// Allocations so far, 0 when they are not counted.
+inline std::uint64_t BenchmarkAllocationCount()
+{
+#if VORBIS_COUNT_ALLOCATIONS
+    return g_allocation_count.load(std::memory_order_relaxed);
+#else
+    return 0u;
+#endif
+}
+
+std::uint64_t BenchmarkPeakRssKb()
+{
+#if defined(__linux__)
+    rusage usage{};
+    if (!getrusage(RUSAGE_SELF, &usage))
+        return (std::uint64_t)usage.ru_maxrss;
+#endif
+    return 0u;
+}
+
+bool BenchmarkPinThread(int _cpu)
+{
+#if defined(__linux__)
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(_cpu, &cpu_set);
+    return !sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+#else
+    return false;
+#endif
+}
+
+struct BenchmarkTrial
+{
+    double open_seconds = 0.0;
+    double decode_seconds = 0.0;
+    std::uint64_t open_allocations = 0u;
+    std::uint64_t decode_allocations = 0u;
+    std::uint64_t max_read_allocations = 0u;
+    std::uint64_t frames = 0u;
+    std::uint32_t error = 0u;
+};
+
+// Streaming reads unless one of these is nonzero.
+struct BenchmarkMode
+{
+    std::uint32_t realtime_packets = 0u; // real-time mode with that cap
+    std::uint32_t batch_packets = 0u; // VorbisDecoderDecodePackets
+    std::uint32_t thread_count = 0u; // VorbisDecoderDecodeParallel
+};
+
+// Opens and fully decodes _data to planar floats, as a client would.
+BenchmarkTrial BenchmarkDecode(std::vector<std::uint8_t> const& _data,
+                               BenchmarkMode const& _mode,
+                               VorbisDecoder &o_decoder)
+{
+    using Clock_t = std::chrono::steady_clock;
+    BenchmarkTrial trial;
+
+    std::uint64_t allocations = BenchmarkAllocationCount();
+    Clock_t::time_point begin = Clock_t::now();
+    trial.error = VorbisDecoderOpen(o_decoder, _data.data(), _data.size());
+    if (!trial.error && _mode.realtime_packets)
+        trial.error = VorbisDecoderEnableRealtime(o_decoder, _mode.realtime_packets);
+    trial.open_seconds = std::chrono::duration<double>(Clock_t::now() - begin).count();
+    trial.open_allocations = BenchmarkAllocationCount() - allocations;
+    if (trial.error)
+        return trial;
+
+    std::size_t const chunk_frames = _mode.batch_packets
+        ? VorbisDecoderBatchFrames(o_decoder, _mode.batch_packets)
+        : 4096u;
+    std::uint32_t const channel_count = o_decoder.id_header.audio_channels;
+    std::vector<float> output(chunk_frames * channel_count);
+    std::vector<float*> channels(channel_count);
+    for (std::uint32_t i = 0u; i < channel_count; ++i)
+        channels[i] = &output[i * chunk_frames];
+
+    allocations = BenchmarkAllocationCount();
+    begin = Clock_t::now();
+    if (_mode.thread_count)
+    {
+        auto const write = [&](float const* const* _channels, std::uint32_t _count)
+        {
+            for (std::uint32_t i = 0u; i < channel_count; ++i)
+                std::copy(_channels[i], _channels[i] + _count, channels[i]);
+        };
+        trial.frames = VorbisDecoderDecodeParallel(o_decoder, _mode.thread_count, write);
+    }
+    else
+    {
+        for (;;)
+        {
+            std::uint64_t const read_allocations = BenchmarkAllocationCount();
+            // real-time reads and batches may end on packets without frames
+            std::size_t const frame_count = _mode.batch_packets
+                ? VorbisDecoderDecodePackets(o_decoder, _mode.batch_packets, channels.data(), chunk_frames)
+                : VorbisDecoderReadFrames(o_decoder, channels.data(), chunk_frames);
+            trial.max_read_allocations = std::max(trial.max_read_allocations,
+                                                  BenchmarkAllocationCount() - read_allocations);
+            trial.frames += frame_count;
+            if (!frame_count && VorbisDecoderEndOfStream(o_decoder))
+                break;
+        }
+    }
+    trial.decode_seconds = std::chrono::duration<double>(Clock_t::now() - begin).count();
+    trial.decode_allocations = BenchmarkAllocationCount() - allocations;
+    trial.error = o_decoder.error;
+    return trial;
+}
+
+// Flips the packet type bit of every packet starting on page _page_index, so
+// that each of them decodes as a hole.
+void BenchmarkDamagePage(std::vector<std::uint8_t> &_stream,
+                         std::size_t _page_index)
+{
+    std::size_t position = 0u;
+    for (std::size_t page_index = 0u; position + 27u <= _stream.size(); ++page_index)
+    {
+        std::uint8_t* header = &_stream[position];
+        std::uint8_t const segment_count = header[26];
+        std::uint8_t const* segment_table = header + 27;
+        std::size_t const body = position + 27u + segment_count;
+        std::size_t body_size = 0u;
+        for (std::uint8_t i = 0u; i < segment_count; ++i)
+            body_size += segment_table[i];
+
+        if (page_index == _page_index)
+        {
+            bool packet_start = !(header[5] & PageDesc::kContinuedPacket);
+            std::size_t offset = body;
+            for (std::uint8_t i = 0u; i < segment_count; ++i)
+            {
+                if (packet_start && segment_table[i])
+                    _stream[offset] ^= 1u;
+                offset += segment_table[i];
+                packet_start = (segment_table[i] < 255u);
+            }
+
+            std::fill(header + 22, header + 26, 0u);
+            std::uint32_t const checksum = OggChecksum(header, body + body_size - position);
+            for (int i = 0; i < 4; ++i)
+                header[22 + i] = (std::uint8_t)(checksum >> (8 * i));
+            return;
+        }
+        position = body + body_size;
+    }
+}
+
+// Streams decoded when the benchmark is given no file, generated in process
+// so that every host decodes the same data : mono, stereo and 5.1, both usual
+// blocksize pairs, floor 0 and floor 1, low and high bitrates. The damaged
+// stream has every packet of one page undecodable, real-time reads then run
+// into several packets without frames in a row.
+std::vector<std::pair<std::string, std::vector<std::uint8_t>>> BenchmarkCorpus()
+{
+    struct Stream
+    {
+        char const* name;
+        std::uint8_t channels;
+        std::uint8_t blocksize_0;
+        std::uint8_t blocksize_1;
+        std::uint8_t floor_type;
+        std::uint32_t bitrate;
+        std::size_t damaged_page; // 0 for none
+    };
+    static Stream const kStreams[] = {
+        { "mono_256_2048_floor1_48k", 1u, 8u, 11u, 1u, 48000u, 0u },
+        { "mono_512_4096_floor0_24k", 1u, 9u, 12u, 0u, 24000u, 0u },
+        { "stereo_256_2048_floor1_128k", 2u, 8u, 11u, 1u, 128000u, 0u },
+        { "stereo_256_2048_floor0_320k", 2u, 8u, 11u, 0u, 320000u, 0u },
+        { "stereo_512_4096_floor1_64k", 2u, 9u, 12u, 1u, 64000u, 0u },
+        { "5.1_256_2048_floor1_384k", 6u, 8u, 11u, 1u, 384000u, 0u },
+        { "5.1_512_4096_floor0_96k", 6u, 9u, 12u, 0u, 96000u, 0u },
+        { "stereo_256_2048_floor1_128k_damaged", 2u, 8u, 11u, 1u, 128000u, 6u }
+    };
+
+    std::vector<std::pair<std::string, std::vector<std::uint8_t>>> corpus;
+    for (Stream const& stream : kStreams)
+    {
+        VorbisEncoderParams params;
+        params.channels = stream.channels;
+        params.blocksize_0 = stream.blocksize_0;
+        params.blocksize_1 = stream.blocksize_1;
+        params.floor_type = stream.floor_type;
+        params.bitrate = stream.bitrate;
+        params.seconds = 10.;
+        std::vector<std::uint8_t> data = VorbisEncode(params);
+        if (stream.damaged_page)
+            BenchmarkDamagePage(data, stream.damaged_page);
+        corpus.emplace_back(std::string("corpus/") + stream.name, std::move(data));
+    }
+    return corpus;
+}
+
+// One JSON object per line, keys in a fixed order so that runs of different
+// builds can be diffed. Timings are the median of the trials.
+int BenchmarkStream(std::string const& _name,
+                    std::vector<std::uint8_t> const& _data,
+                    int _trials,
+                    int _pinned_cpu,
+                    BenchmarkMode const& _mode)
+{
+    // warm up the shared tables and the caches
+    std::unique_ptr<VorbisDecoder> decoder = std::make_unique<VorbisDecoder>();
+    BenchmarkTrial trial = BenchmarkDecode(_data, _mode, *decoder);
+
+    std::vector<BenchmarkTrial> trials;
+    for (int trial_index = 0; trial_index < _trials && !trial.error; ++trial_index)
+    {
+        decoder = std::make_unique<VorbisDecoder>();
+        trial = BenchmarkDecode(_data, _mode, *decoder);
+        trials.push_back(trial);
+    }
+
+    if (trial.error)
+    {
+        std::cout << "{\"file\":\"" << _name << "\",\"error\":" << trial.error << "}" << std::endl;
+        return 1;
+    }
+
+    auto median = [&trials](double BenchmarkTrial::* _field)
+    {
+        std::vector<double> values;
+        for (BenchmarkTrial const& trial : trials)
+            values.push_back(trial.*_field);
+        std::sort(values.begin(), values.end());
+        return values[values.size() / 2u];
+    };
+
+    VorbisIDHeader const& id = decoder->id_header;
+    double const decode_seconds = median(&BenchmarkTrial::decode_seconds);
+    double const audio_seconds = (double)trial.frames / (double)id.audio_sample_rate;
+    double const samples = (double)trial.frames * id.audio_channels;
+
+    std::cout << std::dec << "{\"file\":\"" << _name << "\""
+              << ",\"channels\":" << (unsigned)id.audio_channels
+              << ",\"sample_rate\":" << id.audio_sample_rate
+              << ",\"blocksizes\":[" << (1u << id.blocksize_0) << "," << (1u << id.blocksize_1) << "]"
+              << ",\"bitrate_nominal\":" << id.bitrate_nominal
+              << ",\"frames\":" << trial.frames
+              << ",\"packet_errors\":" << decoder->packet_errors
+              << ",\"trials\":" << trials.size()
+              << ",\"pinned_cpu\":" << _pinned_cpu
+              << ",\"open_seconds\":" << median(&BenchmarkTrial::open_seconds)
+              << ",\"decode_seconds\":" << decode_seconds
+              << ",\"x_realtime\":" << audio_seconds / decode_seconds
+              << ",\"ns_per_sample\":" << decode_seconds * 1e9 / samples;
+#if VORBIS_COUNT_ALLOCATIONS
+    std::cout << ",\"open_allocations\":" << trial.open_allocations
+              << ",\"decode_allocations\":" << trial.decode_allocations;
+#endif
+    std::cout << ",\"batch_packets\":" << _mode.batch_packets
+              << ",\"threads\":" << _mode.thread_count
+              << ",\"setup_bytes\":" << decoder->setup->size
+              << ",\"peak_rss_kb\":" << BenchmarkPeakRssKb();
+    if (decoder->realtime)
+    {
+        VorbisRealtimeLimits const& limits = VorbisDecoderRealtimeLimits(*decoder);
+        std::cout << ",\"realtime\":{\"max_packets_per_read\":" << limits.max_packets_per_read
+                  << ",\"max_packet_bytes\":" << limits.max_packet_bytes
+                  << ",\"max_packet_pages\":" << limits.max_packet_pages
+                  << ",\"max_imdct_per_packet\":" << limits.max_imdct_per_packet
+                  << ",\"max_imdct_size\":" << limits.max_imdct_size
+                  << ",\"max_allocations_per_read\":" << limits.max_allocations_per_read;
+#if VORBIS_COUNT_ALLOCATIONS
+        std::cout << ",\"max_read_allocations\":" << trial.max_read_allocations;
+#endif
+        std::cout << ",\"max_ticks_per_read\":" << limits.max_ticks_per_read
+                  << ",\"max_ns_per_read\":" << (std::uint64_t)((double)limits.max_ticks_per_read * 1e9
+                                                                  / VorbisProfileTicksPerSecond())
+                  << "}";
+    }
+#if VORBIS_PROFILE
+    std::cout << ",\"profile\":";
+    VorbisProfileWriteJson(decoder->buffers.profile, std::cout);
+#endif
+    std::cout << "}" << std::endl;
+
+    return 0;
+}
+
+// Benchmarks _files, or the generated corpus when there are none.
+int VorbisBenchmark(std::vector<char const*> const& _files,
+                    int _trials,
+                    int _cpu,
+                    BenchmarkMode const& _mode)
+{
+    int const pinned_cpu = ((_cpu >= 0) && BenchmarkPinThread(_cpu)) ? _cpu : -1;
+    int result = 0;
+
+    for (char const* path : _files)
+    {
+        std::ifstream file(path, std::ios_base::binary);
+        std::vector<std::uint8_t> data((std::istreambuf_iterator<char>(file)),
+                                       std::istreambuf_iterator<char>());
+        if (!file && !file.eof())
+        {
+            std::cout << "{\"file\":\"" << path << "\",\"error\":\"unreadable\"}" << std::endl;
+            result = 1;
+            continue;
+        }
+        result |= BenchmarkStream(path, data, _trials, pinned_cpu, _mode);
+    }
+
+    if (_files.empty())
+    {
+        for (auto const& stream : BenchmarkCorpus())
+            result |= BenchmarkStream(stream.first, stream.second, _trials, pinned_cpu, _mode);
+    }
+
+    return result;
+}
+
+// Decodes all of _files through the batch pool, the output is dropped. One JSON
+// object per file, then the aggregate throughput.
+int VorbisBatchBenchmark(std::vector<char const*> const& _files,
+                         unsigned _thread_count)
+{
+    std::vector<VorbisBatchResult> results;
+    VorbisBatchStats const stats = VorbisDecodeBatch(_files, _thread_count, results,
+                                                     [](std::uint32_t, std::uint64_t, float const* const*,
+                                                        std::uint32_t) {});
+
+    for (std::size_t i = 0u; i < _files.size(); ++i)
+    {
+        VorbisBatchResult const& result = results[i];
+        std::cout << std::dec << "{\"file\":\"" << _files[i] << "\"";
+        if (result.unreadable)
+            std::cout << ",\"error\":\"unreadable\"}" << std::endl;
+        else
+            std::cout << ",\"frames\":" << result.frames << ",\"error\":" << result.error
+                      << ",\"packet_errors\":" << result.packet_errors << "}" << std::endl;
+    }
+
+    std::cout << std::dec << "{\"files\":" << stats.files
+              << ",\"failed_files\":" << stats.failed_files
+              << ",\"packet_errors\":" << stats.packet_errors
+              << ",\"threads\":" << stats.threads
+              << ",\"tasks\":" << stats.tasks
+              << ",\"steals\":" << stats.steals
+              << ",\"frames\":" << stats.frames
+              << ",\"audio_seconds\":" << stats.audio_seconds
+              << ",\"wall_seconds\":" << stats.wall_seconds
+              << ",\"x_realtime\":" << stats.audio_seconds / stats.wall_seconds
+              << ",\"samples_per_second\":" << (double)stats.samples / stats.wall_seconds
+              << ",\"files_per_second\":" << (double)stats.files / stats.wall_seconds << "}" << std::endl;
+    return stats.failed_files ? 1 : 0;
+}
+
+// Checks the tree based decoder on fixed lengths, returns the mismatches.
+std::uint32_t Huffman_FunctionalTest()
+{
+    std::uint32_t mismatches = 0u;
+
+    // over-subscribed lengths build no tree
+    auto test_tree = BuildHuffmanTree({2, 2, 2, 2, 2});
+    mismatches += !test_tree.empty();
+
+    test_tree = BuildHuffmanTree({2, 4, 4, 4, 4, 2, 3, 3});
+    auto test_lut = Huffman_BuildLookupTable(test_tree);
+    std::uint32_t test_value = 0x00000001;
+    std::uint8_t const* dummy_buff = (std::uint8_t const*)&test_value;
+    int bit_offset = 0;
+    int bits_read = 0;
+    std::uint32_t entry = Huffman_ReadEntry(test_lut,
+                                            dummy_buff,
+                                            bit_offset,
+                                            bits_read);
+    mismatches += (entry != 5u || bits_read != 2);
+    return mismatches;
+}
+
+// =============================================================================
+// HUFFMAN HARNESS
+// =============================================================================
+
+// Random length set of a complete tree, grown by splitting leaves. Deep
+// favours the longest leaf so that lengths reach 32 quickly.
+std::vector<std::uint8_t> HuffmanHarness_RandomLengths(std::mt19937 &_rng,
+                                                       std::uint32_t _used_count,
+                                                       std::uint32_t _unused_count,
+                                                       bool _deep)
+{
+    std::vector<std::uint8_t> leaves{ 0u };
+    while (leaves.size() < _used_count)
+    {
+        std::size_t index = std::uniform_int_distribution<std::size_t>(0u, leaves.size() - 1u)(_rng);
+        if (_deep)
+            index = std::max_element(leaves.begin(), leaves.end()) - leaves.begin();
+        if (leaves[index] >= 32u)
+        {
+            index = std::min_element(leaves.begin(), leaves.end()) - leaves.begin();
+            if (leaves[index] >= 32u)
+                break;
+        }
+        std::uint8_t const length = ++leaves[index];
+        leaves.push_back(length);
+    }
+
+    std::vector<std::uint8_t> lengths(leaves.begin(), leaves.end());
+    lengths.insert(lengths.end(), _unused_count, 0u);
+    std::shuffle(lengths.begin(), lengths.end(), _rng);
+    return lengths;
+}
+
+// Appends _length bits of _codeword to _stream, MSB first, LSB first packing.
+void HuffmanHarness_WriteCodeword(std::vector<std::uint8_t> &_stream,
+                                  std::uint64_t &_bit_position,
+                                  std::uint32_t _codeword,
+                                  unsigned _length)
+{
+    for (unsigned i = _length; i-- > 0u; ++_bit_position)
+    {
+        if ((_bit_position >> 3u) >= _stream.size())
+            _stream.push_back(0u);
+        _stream[_bit_position >> 3u] |= (std::uint8_t)(((_codeword >> i) & 1u) << (_bit_position & 7u));
+    }
+}
+
+// Every codeword of the book, then a random bitstream, decoded by the table and
+// by the reference tree walk. Returns the number of mismatches.
+std::uint32_t HuffmanHarness_Check(std::vector<std::uint8_t> const& _lengths,
+                                   int _primary_bits,
+                                   std::mt19937 &_rng)
+{
+    std::uint32_t errors = 0u;
+    HuffmanTable const table = Huffman_BuildTable(_lengths, _primary_bits);
+
+    std::uint32_t used_count = 0u;
+    std::uint32_t single_entry = 0u;
+    for (std::uint32_t entry = 0u; entry < _lengths.size(); ++entry)
+        if (_lengths[entry])
+        {
+            ++used_count;
+            single_entry = entry;
+        }
+
+    // single entry books are not trees, their codeword is all zeros
+    if (used_count == 1u)
+    {
+        std::vector<std::uint8_t> stream(8u + VorbisDecodeBuffers::kPacketPadding, 0u);
+        std::uint8_t const* position = stream.data();
+        int bit_offset = 0;
+        int bits_read = 0;
+        std::uint32_t const entry = Huffman_DecodeEntry(table, position, bit_offset, bits_read);
+        return (entry != single_entry || bits_read != _lengths[single_entry]) ? 1u : 0u;
+    }
+
+    std::vector<BinaryNode> const tree = BuildHuffmanTree(_lengths);
+    HuffmanLUT const lut = Huffman_BuildLookupTable(tree);
+
+    std::vector<std::uint8_t> stream;
+    std::uint64_t bit_count = 0u;
+    for (BinaryNode const& node : tree)
+        if (node.v != -1u)
+            HuffmanHarness_WriteCodeword(stream, bit_count, node.v >> (32u - node.length), node.length);
+    for (int i = 0; i < 4096; ++i)
+        stream.push_back((std::uint8_t)_rng());
+    bit_count = stream.size() * 8u - 32u;
+    stream.resize(stream.size() + VorbisDecodeBuffers::kPacketPadding, 0u);
+
+    std::uint8_t const* table_position = stream.data();
+    std::uint8_t const* tree_position = stream.data();
+    int table_offset = 0;
+    int tree_offset = 0;
+    for (std::uint64_t bit = 0u; bit < bit_count;)
+    {
+        int table_bits = 0;
+        int tree_bits = 0;
+        std::uint32_t const table_entry = Huffman_DecodeEntry(table, table_position, table_offset, table_bits);
+        std::uint32_t const tree_entry = Huffman_ReadEntry(lut, tree_position, tree_offset, tree_bits);
+        if (table_entry != tree_entry || table_bits != tree_bits || tree_bits <= 0)
+        {
+            ++errors;
+            break;
+        }
+        bit += (std::uint64_t)tree_bits;
+    }
+    return errors;
+}
+
+// Decoded codewords per second over random bits, which follow the book's own
+// distribution for complete trees.
+double HuffmanHarness_Throughput(HuffmanTable const& _table,
+                                 std::vector<std::uint8_t> const& _stream)
+{
+    using Clock_t = std::chrono::steady_clock;
+    std::uint64_t const bit_count = (_stream.size() - VorbisDecodeBuffers::kPacketPadding) * 8u - 32u;
+
+    std::uint64_t codewords = 0u;
+    std::uint32_t checksum = 0u;
+    Clock_t::time_point const begin = Clock_t::now();
+    std::uint8_t const* position = _stream.data();
+    int bit_offset = 0;
+    for (std::uint64_t bit = 0u; bit < bit_count; ++codewords)
+    {
+        int bits_read = 0;
+        checksum += Huffman_DecodeEntry(_table, position, bit_offset, bits_read);
+        bit += (std::uint64_t)std::max(bits_read, 1);
+    }
+    double const seconds = std::chrono::duration<double>(Clock_t::now() - begin).count();
+    return (checksum == 0xdeadbeefu) ? 0.0 : (double)codewords / seconds;
+}
+
+int HuffmanHarness(std::uint32_t _seed, int _iterations)
+{
+    std::mt19937 rng(_seed);
+    std::uint32_t errors = Huffman_FunctionalTest();
+    std::uint32_t books = 0u;
+    for (int iteration = 0; iteration < _iterations; ++iteration)
+    {
+        std::uint32_t const used_count = std::uniform_int_distribution<std::uint32_t>(2u, 600u)(rng);
+        std::uint32_t const unused_count = (iteration % 3 == 0)
+            ? std::uniform_int_distribution<std::uint32_t>(0u, 2u * used_count)(rng) : 0u;
+        bool const deep = (iteration % 5 == 0);
+        std::vector<std::uint8_t> const lengths =
+            HuffmanHarness_RandomLengths(rng, deep ? 34u : used_count, unused_count, deep);
+
+        int const primary_bits = 4 + iteration % 9;
+        errors += HuffmanHarness_Check(lengths, primary_bits, rng);
+        ++books;
+
+        std::vector<std::uint8_t> single(std::uniform_int_distribution<std::uint32_t>(1u, 40u)(rng), 0u);
+        single[rng() % single.size()] = (std::uint8_t)(1u + rng() % 32u);
+        errors += HuffmanHarness_Check(single, primary_bits, rng);
+        ++books;
+    }
+
+    std::cout << std::dec << "{\"huffman_conformance\":{\"seed\":" << _seed
+              << ",\"books\":" << books
+              << ",\"errors\":" << errors << "}}" << std::endl;
+
+    // build time and decode rate across primary table widths
+    using Clock_t = std::chrono::steady_clock;
+    std::vector<std::uint8_t> stream(1u << 22u);
+    for (std::uint8_t &byte : stream)
+        byte = (std::uint8_t)rng();
+    stream.resize(stream.size() + VorbisDecodeBuffers::kPacketPadding, 0u);
+
+    std::uint32_t const book_sizes[] = { 16u, 256u, 4096u };
+    for (std::uint32_t used_count : book_sizes)
+    {
+        std::vector<std::uint8_t> const lengths = HuffmanHarness_RandomLengths(rng, used_count, 0u, false);
+        unsigned const max_length = *std::max_element(lengths.begin(), lengths.end());
+        for (int primary_bits = 4; primary_bits <= 14; ++primary_bits)
+        {
+            Clock_t::time_point const begin = Clock_t::now();
+            HuffmanTable const table = Huffman_BuildTable(lengths, primary_bits);
+            double const build_seconds = std::chrono::duration<double>(Clock_t::now() - begin).count();
+
+            std::cout << std::dec << "{\"huffman_bench\":{\"entries\":" << used_count
+                      << ",\"max_length\":" << max_length
+                      << ",\"primary_bits\":" << primary_bits
+                      << ",\"slots\":" << table.slots.size()
+                      << ",\"build_us\":" << build_seconds * 1e6
+                      << ",\"codewords_per_second\":" << HuffmanHarness_Throughput(table, stream)
+                      << "}}" << std::endl;
+        }
+    }
+
+    return errors ? 1 : 0;
+}
+
+// =============================================================================
+// GOLDEN OUTPUT
+// =============================================================================
+
+// Reference output of one stream, per packet that produces frames : a CRC of
+// the undithered 16 bit PCM, and the planar float PCM for ULP comparisons.
+// File layout, little endian : "VGLD", version, channels, packet count, then
+// (frames, checksum) per packet, then the float samples packet by packet.
+struct GoldenPacket
+{
+    std::uint32_t frames = 0u;
+    std::uint32_t checksum = 0u;
+};
 
-                std::uint32_t range = kRanges[floor.multiplier-1];
-                std::uint32_t bit_count = ilog(range-1);
-                std::vector<std::uint32_t> yvalues(2);
+struct GoldenOutput
+{
+    static constexpr std::uint32_t kVersion = 1u;
 
-                if (remaining_bits < bit_count) {
-                    nonzero = false; break;
-                }
-                yvalues[0] = ReadBits(bit_count, read_position, bit_offset);
-                remaining_bits -= bit_count;
+    std::uint32_t channels = 0u;
+    std::vector<GoldenPacket> packets;
+    std::vector<float> samples;
+};
 
-                if (remaining_bits < bit_count) {
-                    nonzero = false; break;
-                }
-                yvalues[1] = ReadBits(bit_count, read_position, bit_offset);
-                remaining_bits -= bit_count;
+std::uint32_t GoldenDecode(std::vector<std::uint8_t> const& _data,
+                           GoldenOutput &o_output)
+{
+    std::unique_ptr<VorbisDecoder> decoder = std::make_unique<VorbisDecoder>();
+    std::uint32_t const res = VorbisDecoderOpen(*decoder, _data.data(), _data.size());
+    if (res)
+        return res;
+
+    VorbisDecodeBuffers &buffers = decoder->buffers;
+    std::uint32_t const channel_count = decoder->id_header.audio_channels;
+    o_output = GoldenOutput{};
+    o_output.channels = channel_count;
+
+    std::vector<std::int16_t> frames;
+    std::vector<float*> channels(channel_count);
+    while (!decoder->error && decoder->page_index < decoder->pages->size() &&
+           decoder->frames_read < decoder->frame_count)
+    {
+        VorbisDecoderNextPacket(*decoder, &VorbisAudioDecode);
+        std::uint32_t const count = (std::uint32_t)std::min<std::uint64_t>(
+            buffers.pcm.size, decoder->frame_count - decoder->frames_read);
+        decoder->pcm_read = buffers.pcm.size;
+        decoder->frames_read += count;
+        if (!count)
+            continue;
+
+        frames.resize(count * channel_count);
+        VorbisWritePcmInterleaved<EVorbisPcmFormat::kInt16>(buffers, 0u, count, nullptr, frames.data());
+
+        std::size_t const offset = o_output.samples.size();
+        o_output.samples.resize(offset + count * channel_count);
+        for (std::uint32_t i = 0u; i < channel_count; ++i)
+            channels[i] = o_output.samples.data() + offset + i * count;
+        VorbisWritePcm(buffers, 0u, count, channels.data());
+
+        GoldenPacket packet;
+        packet.frames = count;
+        packet.checksum = OggChecksum(reinterpret_cast<std::uint8_t const*>(frames.data()),
+                                      frames.size() * sizeof(std::int16_t));
+        o_output.packets.push_back(packet);
+    }
+    return decoder->error;
+}
 
-                std::size_t yindex = 2;
-                for (std::uint8_t i = 0u; i < floor.partition_count; ++i)
-                {
-                    VorbisFloor::Floor1::Class partition_class = floor.classes[floor.partition_classes[i]];
-                    std::uint8_t cdim = partition_class.dimensions;
-                    std::uint8_t cbits = partition_class.subclass_logcount;
-                    std::uint32_t csub = (1u << cbits) - 1u;
-                    std::uint32_t cval = 0u;
-                    if (cbits > 0)
-                    {
-                        VorbisCodebook const& codebook = _setup.codebooks[partition_class.masterbook];
-                        HuffmanLUT codebook_lut = Huffman_BuildLookupTable(BuildHuffmanTree(codebook.entry_lengths));
+bool GoldenWrite(char const* _path, GoldenOutput const& _output)
+{
+    std::ofstream file(_path, std::ios_base::binary);
+    std::uint32_t const header[4] = { 0x444c4756u, GoldenOutput::kVersion,
+                                      _output.channels, (std::uint32_t)_output.packets.size() };
+    file.write(reinterpret_cast<char const*>(header), sizeof(header));
+    file.write(reinterpret_cast<char const*>(_output.packets.data()),
+               _output.packets.size() * sizeof(GoldenPacket));
+    file.write(reinterpret_cast<char const*>(_output.samples.data()),
+               _output.samples.size() * sizeof(float));
+    return (bool)file;
+}
 
-                        int bits_read = 0;
-                        cval = Huffman_ReadEntry(codebook_lut, read_position, bit_offset, bits_read);
-                        if (remaining_bits < bits_read) {
-                            nonzero = false; break;
-                        }
-                        if (bits_read < 0) return cval;
-                        remaining_bits -= bits_read;
-                    }
+bool GoldenRead(char const* _path, GoldenOutput &o_output)
+{
+    std::ifstream file(_path, std::ios_base::binary);
+    std::uint32_t header[4] = {};
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!file || header[0] != 0x444c4756u || header[1] != GoldenOutput::kVersion)
+        return false;
+
+    o_output.channels = header[2];
+    o_output.packets.resize(header[3]);
+    file.read(reinterpret_cast<char*>(o_output.packets.data()),
+              o_output.packets.size() * sizeof(GoldenPacket));
+    std::size_t sample_count = 0u;
+    for (GoldenPacket const& packet : o_output.packets)
+        sample_count += (std::size_t)packet.frames * o_output.channels;
+    o_output.samples.resize(sample_count);
+    file.read(reinterpret_cast<char*>(o_output.samples.data()), sample_count * sizeof(float));
+    return (bool)file;
+}
 
-                    yvalues.resize(yindex + cdim);
-                    for (std::uint8_t j = 0u; j < cdim; ++j)
-                    {
-                        std::uint32_t subbook_index = cval & csub;
-                        std::uint8_t codebook_index = partition_class.subclass_codebooks[subbook_index];
-                        cval = cval >> cbits;
-                        if (codebook_index != 0xff)
-                        {
-                            VorbisCodebook const& codebook = _setup.codebooks[codebook_index];
-                            HuffmanLUT codebook_lut = Huffman_BuildLookupTable(BuildHuffmanTree(codebook.entry_lengths));
-
-                            int bits_read = 0;
-                            yvalues[yindex + j] = Huffman_ReadEntry(codebook_lut, read_position, bit_offset, bits_read);
-                            if (remaining_bits < bits_read) {
-                                nonzero = false; break;
-                            }
-                            if (bits_read < 0) return yvalues[yindex + j];
-                            remaining_bits -= bits_read;
-                        }
-                        else
-                        {
-                            yvalues[yindex + j] = 0u;
-                        }
-                    }
-                    yindex += cdim;
-                }
+// Distance in representable floats, across zero as well.
+inline std::uint32_t GoldenUlpDistance(float _lhs, float _rhs)
+{
+    auto const ordered = [](float _value)
+    {
+        std::int32_t bits;
+        std::memcpy(&bits, &_value, sizeof(bits));
+        return (bits < 0) ? (std::int64_t)INT32_MIN - bits : (std::int64_t)bits;
+    };
+    std::int64_t const distance = ordered(_lhs) - ordered(_rhs);
+    return (std::uint32_t)std::min<std::int64_t>(std::abs(distance), UINT32_MAX);
+}
 
-                assert(nonzero);
-                // Amplitude value synthesis
-                std::vector<bool> step2_flag(yvalues.size());
-                step2_flag[0] = true; step2_flag[1] = true;
-                std::vector<std::uint32_t> final_yvalues(yvalues.size());
-                final_yvalues[0] = yvalues[0]; final_yvalues[1] = yvalues[1];
-                for (std::size_t i = 2; i < yvalues.size(); ++i)
-                {
-                    std::size_t ln_offset = low_neighbour(floor.values, i);
-                    std::size_t hn_offset = high_neighbour(floor.values, i);
+// Output of VorbisDecoderDecodeParallel, laid out as GoldenOutput::samples.
+std::uint32_t GoldenDecodeParallel(std::vector<std::uint8_t> const& _data,
+                                   unsigned _thread_count,
+                                   std::vector<float> &o_samples)
+{
+    std::unique_ptr<VorbisDecoder> decoder = std::make_unique<VorbisDecoder>();
+    std::uint32_t const res = VorbisDecoderOpen(*decoder, _data.data(), _data.size());
+    if (res)
+        return res;
+
+    std::uint32_t const channel_count = decoder->id_header.audio_channels;
+    o_samples.clear();
+    VorbisDecoderDecodeParallel(*decoder, _thread_count,
+                                [&](float const* const* _channels, std::uint32_t _count)
+                                {
+                                    for (std::uint32_t i = 0u; i < channel_count; ++i)
+                                        o_samples.insert(o_samples.end(), _channels[i], _channels[i] + _count);
+                                });
+    return decoder->error;
+}
 
-                    std::int32_t predicted = (std::int32_t)render_point(floor.values[ln_offset],
-                                                                        final_yvalues[ln_offset],
-                                                                        floor.values[hn_offset],
-                                                                        final_yvalues[hn_offset],
-                                                                        floor.values[i]);
+// Output of the split file path of VorbisDecodeBatch, planar over the whole
+// stream. The ranges are _range_packets long and decoded last to first.
+std::uint32_t GoldenDecodeRanges(std::vector<std::uint8_t> const& _data,
+                                 std::uint32_t _range_packets,
+                                 std::vector<float> &o_samples,
+                                 std::uint64_t &o_packet_errors)
+{
+    VorbisBatchStream stream;
+    stream.decoder = std::make_unique<VorbisDecoder>();
+    VorbisDecoder &decoder = *stream.decoder;
+    std::uint32_t const res = VorbisDecoderOpen(decoder, _data.data(), _data.size());
+    if (res)
+        return res;
+
+    stream.index = VorbisPacketIndex(*decoder.pages, decoder.id_header, decoder.setup->header(),
+                                     decoder.audio_page_index, decoder.audio_seg_index);
+    VorbisPacketFrameOffsets(stream.index, stream.frame_offsets);
+    std::uint64_t const frame_count = std::min(stream.frame_offsets.back(), decoder.frame_count);
+    std::uint32_t const channel_count = decoder.id_header.audio_channels;
+    o_samples.assign(frame_count * channel_count, 0.f);
+
+    std::unique_ptr<VorbisDecodeBuffers> buffers = std::make_unique<VorbisDecodeBuffers>();
+    std::uint32_t const packet_count = (std::uint32_t)stream.index.size();
+    for (std::uint32_t range_end = packet_count; range_end > 0u;)
+    {
+        std::uint32_t const range_begin = (range_end - 1u) / _range_packets * _range_packets;
+        VorbisBatchDecodeRange(stream, 0u, range_begin, range_end, *buffers,
+                               [&](std::uint32_t, std::uint64_t _offset,
+                                   float const* const* _channels, std::uint32_t _count)
+                               {
+                                   for (std::uint32_t i = 0u; i < channel_count; ++i)
+                                       std::copy(_channels[i], _channels[i] + _count,
+                                                 o_samples.begin() + i * frame_count + _offset);
+                               });
+        range_end = range_begin;
+    }
+    o_packet_errors = stream.packet_errors.load(std::memory_order_relaxed);
+    return decoder.error;
+}
 
-                    std::int32_t val = (std::int32_t)yvalues[i];
+// Samples that are not bit identical, and the size difference.
+std::uint64_t GoldenCountMismatches(std::vector<float> const& _lhs,
+                                    std::vector<float> const& _rhs)
+{
+    std::size_t const size = std::min(_lhs.size(), _rhs.size());
+    std::uint64_t mismatches = std::max(_lhs.size(), _rhs.size()) - size;
+    for (std::size_t i = 0u; i < size; ++i)
+        mismatches += std::memcmp(&_lhs[i], &_rhs[i], sizeof(float)) ? 1u : 0u;
+    return mismatches;
+}
 
-                    std::int32_t highroom = (std::int32_t)range - predicted;
-                    std::int32_t lowroom = (std::int32_t)predicted;
-                    std::int32_t room = std::min(highroom, lowroom) * 2;
+// Compares the parallel and split batch paths to the streaming _output. The
+// batch ranges place frames by the packet index, which only agrees with the
+// streaming layout without holes, so o_batch_mismatches is -1 for streams
+// with packet errors.
+void GoldenCheckPaths(std::vector<std::uint8_t> const& _data,
+                      GoldenOutput const& _output,
+                      unsigned _thread_count,
+                      std::int64_t &o_parallel_mismatches,
+                      std::int64_t &o_batch_mismatches)
+{
+    constexpr std::uint32_t kRangePackets = 16u;
 
-                    if (val)
-                    {
-                        step2_flag[ln_offset] = true;
-                        step2_flag[hn_offset] = true;
-                        step2_flag[i] = true;
-                        if (val >= room)
-                        {
-                            if (highroom > lowroom)
-                                final_yvalues[i] = std::min(range, (std::uint32_t)std::max(0, val));
-                            else
-                                final_yvalues[i] = std::min(range, (std::uint32_t)std::max(0, predicted - (val - highroom) - 1));
-                        }
-                        else
-                        {
-                            if (val & 0x1)
-                                final_yvalues[i] = std::min(range, (std::uint32_t)std::max(0, predicted - ((val + 1) / 2)));
-                            else
-                                final_yvalues[i] = std::min(range, (std::uint32_t)std::max(0, predicted + (val / 2)));
-                        }
-                    }
-                    else
-                    {
-                        step2_flag[i] = false;
-                        final_yvalues[i] = std::min(range, (std::uint32_t)std::max(0, predicted));
-                    }
-                }
+    std::vector<float> samples;
+    std::uint32_t error = GoldenDecodeParallel(_data, _thread_count, samples);
+    o_parallel_mismatches = error ? -1 : (std::int64_t)GoldenCountMismatches(_output.samples, samples);
 
-                // Curve synthesis
-                std::vector<int32_t> floor_vector(blocksize);
-            }
-        } break;
-        default: break;
-        }
-    }
+    std::uint64_t packet_errors = 0u;
+    error = GoldenDecodeRanges(_data, kRangePackets, samples, packet_errors);
+    if (error || packet_errors)
+    {
+        o_batch_mismatches = -1;
+        return;
     }
 
-    return 0u;
+    std::size_t const frame_count = _output.channels ? _output.samples.size() / _output.channels : 0u;
+    std::vector<float> planar(_output.samples.size());
+    std::size_t offset = 0u;
+    float const* packet_samples = _output.samples.data();
+    for (GoldenPacket const& packet : _output.packets)
+    {
+        for (std::uint32_t i = 0u; i < _output.channels; ++i, packet_samples += packet.frames)
+            std::copy(packet_samples, packet_samples + packet.frames, planar.begin() + i * frame_count + offset);
+        offset += packet.frames;
+    }
+    o_batch_mismatches = (std::int64_t)GoldenCountMismatches(planar, samples);
 }
 
-std::vector<BinaryNode> BuildHuffmanTree(std::vector<std::uint8_t> const& _lengths)
+// Decodes every file, compares it to <file>.golden, or rewrites the golden
+// files with _update, and reports accuracy and throughput as one JSON line
+// per file. Checksums must match unless _max_ulp allows float differences.
+// The parallel decode on _thread_count threads, 4 for 0, and the split batch
+// path must match the streaming output bit for bit.
+int GoldenHarness(std::vector<char const*> const& _files,
+                  bool _update,
+                  std::uint32_t _max_ulp,
+                  int _trials,
+                  unsigned _thread_count)
 {
-    std::vector<BinaryNode> tree(1);
-    tree.reserve(_lengths.size() * 2u);
-
-    std::uint32_t entry_count = 0u;
-    for (std::uint8_t length : _lengths)
+    int result = 0;
+    for (char const* path : _files)
     {
-        if (length == 0u) continue;
-        ++entry_count;
+        std::ifstream file(path, std::ios_base::binary);
+        std::vector<std::uint8_t> data((std::istreambuf_iterator<char>(file)),
+                                       std::istreambuf_iterator<char>());
+        std::string const golden_path = std::string(path) + ".golden";
+
+        GoldenOutput output;
+        std::uint32_t const error = GoldenDecode(data, output);
+        if (error)
+        {
+            std::cout << std::dec << "{\"file\":\"" << path << "\",\"error\":" << error << "}" << std::endl;
+            result = 1;
+            continue;
+        }
 
-        std::vector<std::size_t> path{ 0u };
-        while (path.back() < -2u)
+        if (_update)
         {
-            std::size_t nindex = path.back();
-            if ((path.size() > 1u && !tree[nindex].left && !tree[nindex].right) ||
-                (path.size() == length+1))
-            {
-                path.pop_back();
-                while (tree[path.back()].right == nindex)
-                {
-                    nindex = path.back();
-                    path.pop_back();
-                }
-                if (path.empty())
-                    return std::vector<BinaryNode>{};
+            bool const written = GoldenWrite(golden_path.c_str(), output);
+            std::cout << std::dec << "{\"file\":\"" << path << "\",\"golden\":\"" << golden_path << "\""
+                      << ",\"packets\":" << output.packets.size()
+                      << ",\"written\":" << (written ? "true" : "false") << "}" << std::endl;
+            result |= written ? 0 : 1;
+            continue;
+        }
 
-                nindex = path.back();
+        GoldenOutput golden;
+        if (!GoldenRead(golden_path.c_str(), golden))
+        {
+            std::cout << std::dec << "{\"file\":\"" << path << "\",\"error\":\"missing golden\"}" << std::endl;
+            result = 1;
+            continue;
+        }
 
-                if (tree[nindex].right)
-                    path.push_back(tree[nindex].right);
-                else
-                    path.push_back(-2u);
+        bool const same_layout = golden.channels == output.channels &&
+            golden.packets.size() == output.packets.size() &&
+            golden.samples.size() == output.samples.size();
+        std::uint32_t checksum_mismatches = 0u;
+        std::int64_t first_mismatch = -1;
+        std::uint32_t max_ulp = 0u;
+        std::int64_t max_ulp_packet = -1;
+
+        // the packets both outputs have, a layout change still points at where it starts
+        std::size_t const common_packets = (golden.channels == output.channels)
+            ? std::min(golden.packets.size(), output.packets.size())
+            : 0u;
+        std::size_t offset = 0u;
+        std::size_t packet = 0u;
+        for (; packet < common_packets; ++packet)
+        {
+            std::size_t const end = offset + (std::size_t)output.packets[packet].frames * output.channels;
+            if (golden.packets[packet].frames != output.packets[packet].frames ||
+                end > golden.samples.size() || end > output.samples.size())
+            {
+                first_mismatch = (first_mismatch < 0) ? (std::int64_t)packet : first_mismatch;
+                max_ulp = UINT32_MAX;
+                max_ulp_packet = (std::int64_t)packet;
+                break;
             }
-            else
+            if (golden.packets[packet].checksum != output.packets[packet].checksum)
             {
-                if (tree[nindex].left)
-                    path.push_back(tree[nindex].left);
-                else
-                    path.push_back(-1u);
+                ++checksum_mismatches;
+                first_mismatch = (first_mismatch < 0) ? (std::int64_t)packet : first_mismatch;
             }
 
-            assert(path.back() <= -1u);
-            assert(path.size() <= length+1);
+            for (; offset < end; ++offset)
+            {
+                std::uint32_t const ulp = GoldenUlpDistance(golden.samples[offset], output.samples[offset]);
+                if (ulp > max_ulp)
+                {
+                    max_ulp = ulp;
+                    max_ulp_packet = (std::int64_t)packet;
+                }
+            }
         }
 
-        std::uint32_t codeword = 0u;
-        for (int i = 1; i < path.size()-1; ++i)
-        {
-            std::uint32_t bit = (path[i] == tree[path[i-1]].left) ? 0u : 1u;
-            codeword |= bit << (length-i);
-        }
+        if (!same_layout && first_mismatch < 0)
+            first_mismatch = (std::int64_t)packet;
 
-        std::size_t nindex = *std::next(path.rbegin(), 1);
-        tree.emplace_back();
-        if (path.back() == -2u)
-        {
-            codeword |= 1u << ((length+1)-path.size());
-            assert(!tree[nindex].right);
-            tree[nindex].right = tree.size()-1u;
-            nindex = tree[nindex].right;
-        }
-        else
+        // several workers even on one core, the rounds and the stitch are what is checked
+        std::int64_t parallel_mismatches = 0;
+        std::int64_t batch_mismatches = 0;
+        GoldenCheckPaths(data, output, _thread_count ? _thread_count : 4u,
+                         parallel_mismatches, batch_mismatches);
+
+        bool const passed = same_layout && max_ulp <= _max_ulp &&
+            (_max_ulp > 0u || checksum_mismatches == 0u) &&
+            parallel_mismatches == 0 && batch_mismatches <= 0;
+        result |= passed ? 0 : 1;
+
+        // throughput of the streaming path, median of the trials
+        std::vector<double> decode_seconds;
+        std::uint64_t frames = 0u;
+        for (int trial_index = 0; trial_index < _trials; ++trial_index)
         {
-            assert(!tree[nindex].left);
-            tree[nindex].left = tree.size()-1u;
-            nindex = tree[nindex].left;
+            std::unique_ptr<VorbisDecoder> decoder = std::make_unique<VorbisDecoder>();
+            BenchmarkTrial const trial = BenchmarkDecode(data, BenchmarkMode{}, *decoder);
+            decode_seconds.push_back(trial.decode_seconds);
+            frames = trial.frames;
         }
+        std::sort(decode_seconds.begin(), decode_seconds.end());
+        double const seconds = decode_seconds[decode_seconds.size() / 2u];
+
+        std::cout << std::dec << "{\"file\":\"" << path << "\""
+                  << ",\"passed\":" << (passed ? "true" : "false")
+                  << ",\"layout_mismatch\":" << (same_layout ? "false" : "true")
+                  << ",\"channels\":" << output.channels
+                  << ",\"golden_channels\":" << golden.channels
+                  << ",\"packets\":" << output.packets.size()
+                  << ",\"golden_packets\":" << golden.packets.size()
+                  << ",\"checksum_mismatches\":" << checksum_mismatches
+                  << ",\"first_mismatch\":" << first_mismatch
+                  << ",\"max_ulp\":" << max_ulp
+                  << ",\"max_ulp_packet\":" << max_ulp_packet
+                  << ",\"parallel_mismatches\":" << parallel_mismatches
+                  << ",\"batch_mismatches\":" << batch_mismatches
+                  << ",\"frames\":" << frames
+                  << ",\"decode_seconds\":" << seconds
+                  << ",\"frames_per_second\":" << (double)frames / seconds << "}" << std::endl;
+    }
+    return result;
+}
 
-        for (int i = 0; i < (length - (path.size()-1)); ++i)
+// Runs every kernel of every level the host supports against the scalar
+// references on random data, one JSON line per level and kernel. Outputs must
+// match bit for bit.
+int VorbisKernelCheck(std::uint32_t _seed, int _iterations)
+{
+    using Clock_t = std::chrono::steady_clock;
+    std::mt19937 rng(_seed);
+    std::uniform_real_distribution<float> uniform(-1.f, 1.f);
+
+    // largest blocksize, aligned for the SSE2 coupling
+    constexpr std::uint32_t kLog2N = 13u;
+    constexpr std::uint32_t kN = 1u << kLog2N;
+    VorbisMdct const& mdct = VorbisGetMdct(kLog2N);
+    VorbisKernels const& reference = VorbisSelectKernels(0u);
+    std::uint32_t const host_features = VorbisCpuFeatures();
+
+    auto const random_vector = [&](std::size_t _size)
+    {
+        std::vector<float> values(_size);
+        for (float &value : values)
         {
-            tree.emplace_back();
-            tree[nindex].left = tree.size()-1u;
-            nindex = tree[nindex].left;
+            value = uniform(rng);
+            if ((rng() & 15u) == 0u)
+                value = (rng() & 1u) ? 0.f : -0.f;
         }
+        return values;
+    };
+    auto const same_bits = [](std::vector<float> const& _lhs, std::vector<float> const& _rhs)
+    {
+        return !std::memcmp(_lhs.data(), _rhs.data(), _lhs.size() * sizeof(float));
+    };
 
-        tree[nindex].v = codeword << (32 - length);
-        tree[nindex].length = length;
-        assert(!tree[nindex].left && !tree[nindex].right);
-    }
-
-    for (BinaryNode const &node : tree)
+    static std::uint32_t const kLevels[] = {
+        kCpuSse2, kCpuSse2 | kCpuAvx2, kCpuSse2 | kCpuAvx2 | kCpuAvx512, kCpuNeon
+    };
+    std::vector<std::uint32_t> levels = { 0u };
+    for (std::uint32_t features : kLevels)
     {
-        assert((!node.left && !node.right) ||
-               (node.left && node.right));
+        if ((host_features & features) == features)
+            levels.push_back(features);
     }
-    assert(tree.size() == (entry_count * 2u)-1u);
-
-    return tree;
-}
-
-HuffmanLUT Huffman_BuildLookupTable(std::vector<BinaryNode> const& _tree)
-{
-    HuffmanLUT result;
-    result.entries.reserve((_tree.size() + 1)/2);
-    result.lengths.reserve((_tree.size() + 1)/2);
-    result.indices.reserve((_tree.size() + 1)/2);
 
-    std::uint32_t node_index = 0u;
-    for (BinaryNode const& node : _tree)
+    int result = 0;
+    for (std::uint32_t features : levels)
     {
-        if (node.v == -1u) continue;
+        VorbisKernels const& kernels = VorbisSelectKernels(features);
+        struct Check { char const* name; std::uint32_t mismatches; double seconds; std::size_t elements; };
+        Check checks[7] = {
+            { "inverse_coupling", 0u, 0., 0u }, { "fft_pass", 0u, 0., 0u }, { "imdct_unfold", 0u, 0., 0u },
+            { "overlap_add", 0u, 0., 0u }, { "quantize_int16", 0u, 0., 0u },
+            { "quantize_int16_dither", 0u, 0., 0u }, { "quantize_int24_dither", 0u, 0., 0u }
+        };
+        auto const timed = [](Check &_check, std::size_t _elements, auto&& _kernel)
+        {
+            Clock_t::time_point const begin = Clock_t::now();
+            _kernel();
+            _check.seconds += std::chrono::duration<double>(Clock_t::now() - begin).count();
+            _check.elements += _elements;
+        };
 
-        auto entry_it = std::lower_bound(result.entries.begin(), result.entries.end(), node.v);
-        auto entry_index = std::distance(result.entries.begin(), entry_it);
-        auto lengths_it = std::next(result.lengths.begin(), entry_index);
-        auto indices_it = std::next(result.indices.begin(), entry_index);
-        result.entries.insert(entry_it, node.v);
-        result.lengths.insert(lengths_it, node.length);
-        result.indices.insert(indices_it, node_index++);
+        for (int iteration = 0; iteration < _iterations; ++iteration)
+        {
+            std::uint32_t const n = 1u + rng() % (kN / 2u);
+            {
+                std::vector<float> m = random_vector(n), a = random_vector(n);
+                std::vector<float> m_ref = m, a_ref = a;
+                reference.inverse_coupling(m_ref.data(), a_ref.data(), n);
+                timed(checks[0], n, [&]() { kernels.inverse_coupling(m.data(), a.data(), n); });
+                checks[0].mismatches += !same_bits(m, m_ref) || !same_bits(a, a_ref);
+            }
+            {
+                // every stage of the largest FFT, as VorbisInverseFft runs them
+                std::uint32_t const size = kN / 4u;
+                std::vector<float> re = random_vector(size), im = random_vector(size);
+                std::vector<float> re_ref = re, im_ref = im;
+                float const* twiddles = mdct.stage_twiddles.data();
+                for (std::uint32_t h = (ilog(size - 1u) & 1u) ? 2u : 1u; h < size; twiddles += 4u * h, h *= 4u)
+                {
+                    reference.fft_pass(re_ref.data(), im_ref.data(), size, h, twiddles);
+                    timed(checks[1], size, [&]() { kernels.fft_pass(re.data(), im.data(), size, h, twiddles); });
+                }
+                checks[1].mismatches += !same_bits(re, re_ref) || !same_bits(im, im_ref);
+            }
+            {
+                std::uint32_t const block_n = 1u << (6u + rng() % 8u);
+                std::vector<float> const u = random_vector(block_n / 2u), window = random_vector(block_n);
+                std::vector<float> out(block_n), out_ref(block_n);
+                reference.imdct_unfold(u.data(), window.data(), out_ref.data(), block_n);
+                timed(checks[2], block_n, [&]() { kernels.imdct_unfold(u.data(), window.data(), out.data(), block_n); });
+                checks[2].mismatches += !same_bits(out, out_ref);
+            }
+            {
+                std::vector<float> const a = random_vector(n), b = random_vector(n);
+                std::vector<float> out(n), out_ref(n);
+                reference.overlap_add(out_ref.data(), a.data(), b.data(), n);
+                timed(checks[3], n, [&]() { kernels.overlap_add(out.data(), a.data(), b.data(), n); });
+                checks[3].mismatches += !same_bits(out, out_ref);
+            }
+            {
+                std::vector<float> samples = random_vector(n);
+                for (float &sample : samples)
+                    sample *= 1.25f;
+                std::vector<std::int16_t> out(n), out_ref(n);
+                reference.quantize_int16(samples.data(), nullptr, 0u, n, nullptr,
+                                         reinterpret_cast<std::uint8_t*>(out_ref.data()), 2u);
+                timed(checks[4], n, [&]()
+                {
+                    kernels.quantize_int16(samples.data(), nullptr, 0u, n, nullptr,
+                                           reinterpret_cast<std::uint8_t*>(out.data()), 2u);
+                });
+                checks[4].mismatches += (out != out_ref);
+            }
+            {
+                // dithered with the overlap, from an unaligned start, twice to carry the lane state
+                std::vector<float> samples = random_vector(n), overlap = random_vector(n);
+                std::uint32_t const begin = rng() % n;
+                VorbisDither dither, dither_ref;
+                dither_ref.state[0] = dither.state[0] = rng() | 1u;
+                std::vector<std::int16_t> out(n), out_ref(n);
+                for (int pass = 0; pass < 2; ++pass)
+                {
+                    reference.quantize_int16(samples.data(), overlap.data(), begin, n, &dither_ref,
+                                             reinterpret_cast<std::uint8_t*>(out_ref.data()), 2u);
+                    timed(checks[5], n - begin, [&]()
+                    {
+                        kernels.quantize_int16(samples.data(), overlap.data(), begin, n, &dither,
+                                               reinterpret_cast<std::uint8_t*>(out.data()), 2u);
+                    });
+                    checks[5].mismatches += (out != out_ref) ||
+                        std::memcmp(dither.state, dither_ref.state, sizeof(dither.state));
+                }
+            }
+            {
+                std::vector<float> samples = random_vector(n);
+                VorbisDither dither, dither_ref;
+                std::vector<std::uint8_t> out(3u * n), out_ref(3u * n);
+                reference.quantize_int24(samples.data(), nullptr, 0u, n, &dither_ref, out_ref.data(), 3u);
+                timed(checks[6], n, [&]()
+                {
+                    kernels.quantize_int24(samples.data(), nullptr, 0u, n, &dither, out.data(), 3u);
+                });
+                checks[6].mismatches += (out != out_ref) ||
+                    std::memcmp(dither.state, dither_ref.state, sizeof(dither.state));
+            }
+        }
+
+        for (Check const& check : checks)
+        {
+            result |= check.mismatches ? 1 : 0;
+            std::cout << std::dec << "{\"level\":\"" << kernels.name << "\""
+                      << ",\"kernel\":\"" << check.name << "\""
+                      << ",\"iterations\":" << _iterations
+                      << ",\"mismatches\":" << check.mismatches
+                      << ",\"ns_per_element\":" << check.seconds * 1e9 / (double)std::max<std::size_t>(check.elements, 1u)
+                      << "}" << std::endl;
+        }
     }
 
+    std::cout << "{\"selected\":\"" << VorbisGetKernels().name << "\",\"passed\":"
+              << (result ? "false" : "true") << "}" << std::endl;
     return result;
 }
 
-std::uint32_t Huffman_ReadEntry(HuffmanLUT const& _lut,
-                                std::uint8_t const* &_base_address,
-                                int &_bit_offset,
-                                int &o_bits_read)
+int main(int argc, char** argv)
 {
-    std::uint32_t buffer = 0u;
-    int bits_read = 0;
-    auto entry_it = std::prev(_lut.entries.end());
-    auto length_it = _lut.lengths.begin();
-
-    while (!(*length_it == bits_read && *entry_it == buffer))
+    // usage : [--profile] file.ogg [output.raw]
+    //         --bench [--trials N] [--cpu K] [--realtime P] [--batch B] [--threads T]
+    //                 [file.ogg...], a generated corpus without files
+    //         --batch-decode [--threads T] file.ogg...
+    //         --huffman [--seed S] [--trials N]
+    //         --golden [--update] [--max-ulp U] [--trials N] [--threads T] file.ogg...
+    //         --kernels [--seed S] [--trials N]
+    //         --encode out.ogg [--channels C] [--rate R] [--blocksizes A B]
+    //                  [--bitrate B] [--floor F] [--seconds S] [--seed S]
+    bool print_profile = false;
+    bool benchmark = false;
+    bool batch_decode = false;
+    bool huffman = false;
+    bool encode = false;
+    bool golden = false;
+    bool kernels = false;
+    bool update_golden = false;
+    std::uint32_t max_ulp = 0u;
+    VorbisEncoderParams encoder_params;
+    std::uint32_t seed = 1u;
+    int trials = 5;
+    int cpu = -1;
+    BenchmarkMode benchmark_mode;
+    std::vector<char const*> arguments;
+    for (int i = 1; i < argc; ++i)
     {
-        buffer |= (ReadBits(1, _base_address, _bit_offset) << (31-bits_read++));
-        entry_it = std::lower_bound(_lut.entries.begin(), _lut.entries.end(), buffer);
-        length_it = std::next(_lut.lengths.begin(), std::distance(_lut.entries.begin(), entry_it));
-
-        if (bits_read > 31)
+        if (!std::strcmp(argv[i], "--profile"))
+            print_profile = true;
+        else if (!std::strcmp(argv[i], "--bench"))
+            benchmark = true;
+        else if (!std::strcmp(argv[i], "--batch-decode"))
+            batch_decode = true;
+        else if (!std::strcmp(argv[i], "--huffman"))
+            huffman = true;
+        else if (!std::strcmp(argv[i], "--seed") && i + 1 < argc)
+            seed = (std::uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--trials") && i + 1 < argc)
+            trials = std::max(1, std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--cpu") && i + 1 < argc)
+            cpu = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--realtime") && i + 1 < argc)
+            benchmark_mode.realtime_packets = (std::uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--batch") && i + 1 < argc)
+            benchmark_mode.batch_packets = (std::uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--threads") && i + 1 < argc)
+            benchmark_mode.thread_count = (std::uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--encode"))
+            encode = true;
+        else if (!std::strcmp(argv[i], "--golden"))
+            golden = true;
+        else if (!std::strcmp(argv[i], "--kernels"))
+            kernels = true;
+        else if (!std::strcmp(argv[i], "--update"))
+            update_golden = true;
+        else if (!std::strcmp(argv[i], "--max-ulp") && i + 1 < argc)
+            max_ulp = (std::uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--channels") && i + 1 < argc)
+            encoder_params.channels = (std::uint8_t)std::min(255, std::max(1, std::atoi(argv[++i])));
+        else if (!std::strcmp(argv[i], "--rate") && i + 1 < argc)
+            encoder_params.sample_rate = (std::uint32_t)std::max(1, std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--blocksizes") && i + 2 < argc)
         {
-            o_bits_read = -1;
-            return PackError(EVorbisError::kInvalidStream, FInvalidStream::kUnknownCodeword);
+            int const blocksize_0 = std::atoi(argv[++i]);
+            int const blocksize_1 = std::atoi(argv[++i]);
+            encoder_params.blocksize_0 = (std::uint8_t)std::min(13, std::max(6, blocksize_0));
+            encoder_params.blocksize_1 = (std::uint8_t)std::min(13, std::max((int)encoder_params.blocksize_0, blocksize_1));
         }
+        else if (!std::strcmp(argv[i], "--bitrate") && i + 1 < argc)
+            encoder_params.bitrate = (std::uint32_t)std::max(1, std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--floor") && i + 1 < argc)
+            encoder_params.floor_type = (std::uint8_t)(std::atoi(argv[++i]) ? 1u : 0u);
+        else if (!std::strcmp(argv[i], "--seconds") && i + 1 < argc)
+            encoder_params.seconds = std::max(0., std::atof(argv[++i]));
+        else
+            arguments.push_back(argv[i]);
     }
 
-    o_bits_read = bits_read-1;
-    return *std::next(_lut.indices.begin(), std::distance(_lut.entries.begin(), entry_it));
-}
-
-void Huffman_FunctionalTest()
-{
-    auto test_tree = BuildHuffmanTree({2, 2, 2, 2, 2});
-    assert(test_tree.empty());
+    if (huffman)
+        return HuffmanHarness(seed, trials * 40);
 
-    test_tree = BuildHuffmanTree({2, 4, 4, 4, 4, 2, 3, 3});
+    if (kernels)
+        return VorbisKernelCheck(seed, trials * 20);
 
-    std::cout << "huffman begin" << std::endl;
-    for (BinaryNode const&node : test_tree)
+    if (encode)
     {
-        if (node.v != -1u)
+        if (arguments.empty())
         {
-            std::cout << std::dec << (unsigned)node.length << " "
-                      << std::hex << (unsigned)node.v << std::endl;
+            std::cout << "No output file specified" << std::endl;
+            return 1;
         }
+        encoder_params.seed = seed;
+        std::vector<std::uint8_t> const stream = VorbisEncode(encoder_params);
+        std::ofstream output(arguments[0], std::ios_base::binary);
+        output.write(reinterpret_cast<char const*>(stream.data()), (std::streamsize)stream.size());
+        std::cout << "Encoded " << stream.size() << " bytes" << std::endl;
+        return output ? 0 : 1;
     }
-    auto test_lut = Huffman_BuildLookupTable(test_tree);
-    std::uint32_t test_value = 0x00000001;
-    std::uint8_t const* dummy_buff = (std::uint8_t const*)&test_value;
-    int bit_offset = 0;
-    int bits_read = 0;
-    std::uint32_t entry = Huffman_ReadEntry(test_lut,
-                                            dummy_buff,
-                                            bit_offset,
-                                            bits_read);
-    assert(entry == 5);
-};
 
-int main(int argc, char** argv)
-{
-    if (argc < 2)
+    if (benchmark)
+        return VorbisBenchmark(arguments, trials, cpu, benchmark_mode);
+
+    if (arguments.empty())
     {
         std::cout << "No file specified" << std::endl;
         return 1;
     }
 
+    if (batch_decode)
+        return VorbisBatchBenchmark(arguments, benchmark_mode.thread_count);
+
+    if (golden)
+        return GoldenHarness(arguments, update_golden, max_ulp, trials, benchmark_mode.thread_count);
+
     std::unique_ptr<std::uint8_t> buff{};
     std::streamsize file_size = 0ull;
     {
-        std::ifstream file(argv[1], std::ios_base::binary);
+        std::ifstream file(arguments[0], std::ios_base::binary);
         file.seekg(0, std::ios_base::end);
         file_size = static_cast<std::streamsize>(file.tellg());
         file.seekg(0, std::ios_base::beg);
 
         if (file_size < (1024 * 1024 * 1024))
         {
-            buff.reset(new std::uint8_t [file_size]);
+            buff.reset(new std::uint8_t [file_size + VorbisDecodeBuffers::kPacketPadding]());
             file.read(reinterpret_cast<char*>(buff.get()), file_size);
         }
         else
@@ -2063,7 +7974,6 @@ int main(int argc, char** argv)
 
         std::cout << file_size << std::endl;
     }
-    debug_baseBuff = buff.get();
 
 #ifdef SHOW_FIRST_KB
     for (int i = 0; i < 1024 && i < file_size; ++i)
@@ -2076,42 +7986,29 @@ int main(int argc, char** argv)
     }
 #endif
 
-    OggContents const ogg_pages = DecodeOgg(buff.get(), static_cast<std::size_t>(file_size));
-    std::vector<std::uint32_t> const vorbis_serials = GetVorbisSerials(ogg_pages);
-    if (vorbis_serials.empty())
+    VorbisDecoder decoder;
+    std::uint32_t res = VorbisDecoderOpen(decoder, buff.get(), static_cast<std::size_t>(file_size));
+    if (res >> 16u != EVorbisError::kNoError)
     {
-        std::cout << "No Vorbis frame found in file" << std::endl;
+        std::cout << "Vorbis error " << (res >> 16u) << std::endl;
+        Trace_Dump(stderr);
         return 1;
     }
 
 #if 0
-    PrintPages(ogg_pages.at(vorbis_serials.front()));
+    PrintPages(*decoder.pages);
     return 0;
 #endif
 
-    std::cout << std::hex << vorbis_serials.front() << std::endl;
-
-    std::size_t page_index = 0u;
-    std::size_t seg_index = 0u;
-    VorbisIDHeader id_header;
-    VorbisSetupHeader setup_header;
-    std::uint32_t res = VorbisHeaders(ogg_pages.at(vorbis_serials.front()),
-                                      page_index, seg_index,
-                                      id_header, setup_header);
-    if (res >> 16u != EVorbisError::kNoError)
-    {
-        std::cout << "Vorbis error " << (res >> 16u) << std::endl;
-        return 1;
-    }
-
-    std::cout << "Page " << page_index << " segment " << seg_index << std::endl;
+    VorbisIDHeader const& id_header = decoder.id_header;
+    std::cout << "Page " << decoder.audio_page_index << " segment " << decoder.audio_seg_index << std::endl;
 
 #if 0
-    for (VorbisCodebook const& codebook : setup_header.codebooks)
+    for (VorbisCodebook const& codebook : decoder.setup->header().codebooks)
     {
         using StdClock_t = std::chrono::high_resolution_clock;
         StdClock_t::time_point begin = StdClock_t::now();
-        auto data_tree = BuildHuffmanTree(codebook.entry_lengths);
+        auto data_tree = BuildHuffmanTree({ codebook.entry_lengths.begin(), codebook.entry_lengths.end() });
         auto data_lut = Huffman_BuildLookupTable(data_tree);
         StdClock_t::time_point end = StdClock_t::now();
         std::cout << "BuildHuffmanTree(), size=" << data_tree.size()
@@ -2134,20 +8031,31 @@ int main(int argc, char** argv)
     }
 #endif
 
-    res = VorbisAudioDecode(ogg_pages.at(vorbis_serials.front()),
-                            id_header,
-                            setup_header,
-                            page_index, seg_index);
-    std::cout << "AudioDecode output " << res << std::endl;
+    // Optional raw output, interleaved 16 bit little endian
+    std::ofstream output;
+    if (arguments.size() > 1u)
+        output.open(arguments[1], std::ios_base::binary);
+
+    std::vector<std::int16_t> frames(4096u * id_header.audio_channels);
+    std::uint64_t frame_total = 0u;
+    while (std::size_t frame_count = VorbisDecoderReadFrames(decoder, frames.data(), 4096u))
+    {
+        if (output.is_open())
+            output.write(reinterpret_cast<char const*>(frames.data()),
+                         frame_count * id_header.audio_channels * sizeof(std::int16_t));
+        frame_total += frame_count;
+    }
+
+    std::cout << "AudioDecode output " << decoder.error << " "
+              << std::dec << frame_total << " frames, "
+              << decoder.packet_errors << " packets skipped" << std::endl;
+    if (decoder.error || decoder.packet_errors)
+        Trace_Dump(stderr);
 
-    if (!res)
+    if (print_profile)
     {
-        seg_index = 0;
-        res = VorbisAudioDecode(ogg_pages.at(vorbis_serials.front()),
-                                id_header,
-                                setup_header,
-                                ++page_index, seg_index);
-        std::cout << "AudioDecode output " << res << std::endl;
+        VorbisProfileWriteJson(decoder.buffers.profile, std::cout);
+        std::cout << std::endl;
     }
 
     std::cout << "ID header : " << std::endl